@@ -0,0 +1,598 @@
+#define _GNU_SOURCE
+#include "rdma.h"
+#include "log_ring.h"
+#include "log_pack.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/*
+ * Append-path benchmark. For every combination of record size, batch size,
+ * queue depth, signal interval and inline size it forks a consumer that
+ * drains the ring as fast as it can, streams records at it and reports
+ * append throughput plus the distribution of commit latency: time from
+ * log_ring_append until a completion shows the record has landed remotely,
+ * or with -A until the consumer's acknowledgement says it has taken it.
+ *
+ * With -z the sweep also covers packing each batch into one record, as
+ * compute_node -z does, compressed or not, against the plain path. The
+ * consumer expands every batch it takes, so both ends pay for the codec.
+ * Records are text tuples with random keys and values, cycled through a
+ * pool so a batch never repeats one, which compresses about as well as a
+ * real WAL rather than the best case of a constant fill.
+ *
+ * Results go to stdout (or -f) as CSV or JSON; connection chatter from the
+ * library is discarded.
+ */
+
+#define BENCH_PORT 19890
+#define BENCH_RECORDS 200000
+#define BENCH_MAX_LIST 16
+#define BENCH_PENDING (1 << 18) // Records appended but not yet known to have landed
+#define BENCH_ACK_EVERY 32      // Records the consumer takes between acknowledgements
+#define BENCH_POOL 1024         // Distinct records the producer cycles through
+#define BENCH_UNSEALED UINT64_MAX // Pending end of a record still in the pack
+
+// Log-linear histogram: exact below HIST_SUB ns, then HIST_SUB / 2 buckets per power of two
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_HALF (HIST_SUB / 2)
+#define HIST_BUCKETS (HIST_SUB + 58 * HIST_HALF)
+
+struct hist {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+};
+
+struct int_list {
+    long v[BENCH_MAX_LIST];
+    int n;
+};
+
+struct pending {
+    uint64_t end; // Ring position the record ends at, or its LSN with -A
+    uint64_t t0;
+};
+
+struct point {
+    long rec_size;
+    long batch;
+    long depth;
+    long interval;
+    long inline_size;
+    long codec; // enum log_codec to pack batches with, -1 to append records as they are
+};
+
+struct result {
+    double seconds;
+    double recs_per_sec;
+    double gbytes_per_sec;
+    double ratio; // Record bytes per byte of batch body sent
+    double p50, p99, p999, max; // Microseconds
+};
+
+static long num_records = BENCH_RECORDS;
+static int use_imm;
+static int use_ack;
+static FILE *out;
+
+static int hist_index(uint64_t v)
+{
+    int g;
+
+    if (v < HIST_SUB)
+        return (int)v;
+    g = 63 - __builtin_clzll(v) - HIST_SUB_BITS + 1;
+    if (g > 58)
+        return HIST_BUCKETS - 1;
+    return HIST_SUB + (g - 1) * HIST_HALF + (int)((v >> g) - HIST_HALF);
+}
+
+/* Midpoint of the values that land in bucket idx. */
+static double hist_value(int idx)
+{
+    int g;
+
+    if (idx < HIST_SUB)
+        return idx;
+    g = (idx - HIST_SUB) / HIST_HALF + 1;
+    return (double)((uint64_t)((idx - HIST_SUB) % HIST_HALF + HIST_HALF) << g) + ((1ULL << g) - 1) / 2.0;
+}
+
+static void hist_add(struct hist *h, uint64_t v)
+{
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if (v > h->max)
+        h->max = v;
+}
+
+static double hist_percentile(const struct hist *h, double p)
+{
+    uint64_t want = (uint64_t)(p * h->total + 0.999999);
+    uint64_t seen = 0;
+
+    if (!want)
+        want = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= want)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+static int parse_list(const char *s, struct int_list *l)
+{
+    char *end;
+
+    l->n = 0;
+    while (*s) {
+        if (l->n == BENCH_MAX_LIST) {
+            fprintf(stderr, "at most %d values per list\n", BENCH_MAX_LIST);
+            return 1;
+        }
+        l->v[l->n++] = strtol(s, &end, 0);
+        if (end == s || (*end && *end != ',')) {
+            fprintf(stderr, "bad list '%s'\n", s);
+            return 1;
+        }
+        s = *end ? end + 1 : end;
+    }
+    return l->n == 0;
+}
+
+/* Like parse_list, for codec names; off appends without packing. */
+static int parse_codecs(const char *s, struct int_list *l)
+{
+    char buf[256], *tok, *save = NULL;
+    int codec;
+
+    snprintf(buf, sizeof(buf), "%s", s);
+    l->n = 0;
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (l->n == BENCH_MAX_LIST) {
+            fprintf(stderr, "at most %d values per list\n", BENCH_MAX_LIST);
+            return 1;
+        }
+        if (!strcmp(tok, "off"))
+            codec = -1;
+        else if (log_codec_parse(tok, &codec))
+            return 1;
+        l->v[l->n++] = codec;
+    }
+    return l->n == 0;
+}
+
+static void fill_records(char *pool, long size)
+{
+    for (long i = 0; i < BENCH_POOL; i++) {
+        char *rec = pool + i * size;
+
+        for (long off = 0; off < size;) {
+            char tuple[64];
+            int n = snprintf(tuple, sizeof(tuple), "INSERT k=%08lx v=%08lx%08lx;", random(), random(), random());
+
+            memcpy(rec + off, tuple, n < size - off ? n : size - off);
+            off += n;
+        }
+    }
+}
+
+static void apply_point(const struct point *pt)
+{
+    config.queue_depth = pt->depth;
+    config.signal_interval = pt->interval;
+    config.inline_size = pt->inline_size;
+    config.buf_size = log_ring_region_size(RDMA_BUFFER_SIZE);
+}
+
+/* Listening before the fork means the producer's connect can't race the
+ * consumer's setup. */
+static int bench_listen(int port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 1)) {
+        fprintf(stderr, "Failed to listen on port %d: %s\n", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Child: accept one producer and drain its ring until end of stream,
+ * expanding the batches it takes. */
+static int run_consumer(int lfd, long rec_size)
+{
+    struct resources res;
+    struct log_ring ring;
+    struct log_unpack it;
+    uint32_t len, flag;
+    long batch = sizeof(struct ring_batch) + LOG_PACK_MAX_RAW;
+    long cap = rec_size > batch ? rec_size : batch;
+    char *rec, *scratch;
+    int rc;
+
+    rec = (char *)malloc(cap);
+    scratch = (char *)malloc(LOG_PACK_MAX_RAW);
+    resources_init(&res);
+    if (!rec || !scratch || resources_create(&res))
+        return 1;
+
+    res.sock = accept(lfd, NULL, NULL);
+    close(lfd);
+    if (res.sock < 0 || connect_qp(&res) || log_ring_init(&ring, res.buf, res.buf_size))
+        return 1;
+
+    for (long taken = 0;; taken += rc) {
+        rc = log_ring_consume(&ring, rec, cap, &len, &flag);
+        if (rc < 0)
+            return 1;
+        if (rc && flag == RING_REC_EOS)
+            break;
+        if (rc && flag == RING_REC_BATCH) {
+            const void *payload;
+            uint32_t n;
+            int more;
+
+            if (log_unpack_open(&it, rec, len, scratch, LOG_PACK_MAX_RAW))
+                return 1;
+            while ((more = log_unpack_next(&it, &payload, &n)) > 0)
+                ;
+            if (more < 0)
+                return 1;
+        }
+        // Like the logstore: acknowledge when caught up, and now and then under load
+        if (use_ack && (!rc || taken % BENCH_ACK_EVERY == 0) &&
+            (log_ring_ack(&res, &ring, ring.lsn) || rdma_reap(&res)))
+            return 1;
+    }
+    resources_destroy(&res);
+    free(scratch);
+    free(rec);
+    return 0;
+}
+
+/* Send the batch staged in the pack; the records in it, pending up to
+ * index pt, learn where they end. */
+static int pack_seal(struct resources *res, struct log_ring *ring, struct log_pack *pack, struct pending *pend,
+                     uint64_t *sealed, uint64_t pt)
+{
+    uint64_t lsn = ring->lsn;
+    uint32_t nrecs;
+    uint32_t len = log_pack_seal(pack, &nrecs);
+
+    if (!len)
+        return 0;
+    if (log_ring_append_batch(res, ring, pack->out, len, nrecs))
+        return 1;
+    for (; *sealed < pt; (*sealed)++)
+        pend[*sealed % BENCH_PENDING].end = use_ack ? ++lsn : ring->tail;
+    return 0;
+}
+
+// Stage the record pending at index pt - 1, sealing the batch once full
+static int pack_append(struct resources *res, struct log_ring *ring, struct log_pack *pack, const char *rec,
+                       uint32_t len, struct pending *pend, uint64_t *sealed, uint64_t pt)
+{
+    int rc = log_pack_add(pack, rec, len);
+
+    if (rc > 0) {
+        if (pack_seal(res, ring, pack, pend, sealed, pt - 1))
+            return 1;
+        rc = log_pack_add(pack, rec, len);
+    }
+    if (rc < 0) {
+        fprintf(stderr, "%u byte records do not fit in a %d byte batch\n", len, LOG_PACK_MAX_RAW);
+        return 1;
+    }
+    return pack->nrecs >= pack->max_recs ? pack_seal(res, ring, pack, pend, sealed, pt) : 0;
+}
+
+static void retire(struct resources *res, struct log_ring *ring, struct pending *pend, uint64_t *ph, uint64_t pt,
+                   struct hist *h)
+{
+    uint64_t done = use_ack ? __atomic_load_n(&ring->ctrl->received_lsn, __ATOMIC_ACQUIRE)
+                            : __atomic_load_n(&res->done_cookie, __ATOMIC_ACQUIRE);
+    uint64_t now;
+
+    if (*ph == pt || pend[*ph % BENCH_PENDING].end > done)
+        return;
+    now = stats_now();
+    while (*ph < pt && pend[*ph % BENCH_PENDING].end <= done) {
+        hist_add(h, now - pend[*ph % BENCH_PENDING].t0);
+        (*ph)++;
+    }
+}
+
+static int run_producer(int port, const struct point *p, struct result *r)
+{
+    static struct hist h;
+    struct resources res;
+    struct log_ring ring;
+    struct log_pack *pack = NULL;
+    struct pending *pend;
+    uint64_t ph = 0, pt = 0, sealed = 0;
+    uint64_t start, elapsed;
+    char *pool;
+
+    pend = (struct pending *)malloc(BENCH_PENDING * sizeof(*pend));
+    pool = (char *)malloc(BENCH_POOL * p->rec_size);
+    if (!pend || !pool)
+        return 1;
+    fill_records(pool, p->rec_size);
+    memset(&h, 0, sizeof(h));
+    if (p->codec >= 0) {
+        pack = (struct log_pack *)malloc(sizeof(*pack));
+        if (!pack)
+            return 1;
+        log_pack_init(pack, p->codec, p->batch);
+    }
+
+    resources_init(&res);
+    if (resources_create(&res))
+        return 1;
+
+    res.sock = sock_connect("127.0.0.1", port);
+    if (res.sock < 0 || connect_qp(&res) || log_ring_init(&ring, res.buf, res.buf_size))
+        return 1;
+    // A packed batch is a single record with a doorbell of its own
+    log_ring_set_batch(&ring, pack ? 1 : p->batch);
+    if (use_imm)
+        ring.flush_flags = RDMA_WRITE_IMM;
+
+    start = stats_now();
+    for (long i = 0; i < num_records; i++) {
+        uint64_t t0 = stats_now();
+        const char *rec = pool + (i % BENCH_POOL) * p->rec_size;
+
+        if (pt - ph == BENCH_PENDING) {
+            if (pack && pack_seal(&res, &ring, pack, pend, &sealed, pt))
+                return 1;
+            if (use_ack ? log_ring_wait_for_lsn(&res, &ring, pend[ph % BENCH_PENDING].end, 0)
+                        : poll_completion(&res))
+                return 1;
+            retire(&res, &ring, pend, &ph, pt, &h);
+            i--;
+            continue;
+        }
+        pend[pt % BENCH_PENDING].t0 = t0;
+        if (pack) {
+            pend[pt % BENCH_PENDING].end = BENCH_UNSEALED;
+            pt++;
+            if (pack_append(&res, &ring, pack, rec, p->rec_size, pend, &sealed, pt))
+                return 1;
+        } else {
+            if (log_ring_append(&res, &ring, rec, p->rec_size, RING_REC_VALID))
+                return 1;
+            pend[pt % BENCH_PENDING].end = use_ack ? ring.lsn : ring.tail;
+            pt++;
+        }
+
+        if (rdma_reap(&res))
+            return 1;
+        retire(&res, &ring, pend, &ph, pt, &h);
+    }
+    if (pack && pack_seal(&res, &ring, pack, pend, &sealed, pt))
+        return 1;
+    if (log_ring_flush(&res, &ring) || rdma_drain(&res) ||
+        (use_ack && log_ring_wait_for_lsn(&res, &ring, ring.lsn, 0)))
+        return 1;
+    retire(&res, &ring, pend, &ph, pt, &h);
+    elapsed = stats_now() - start;
+
+    if (log_ring_append(&res, &ring, NULL, 0, RING_REC_EOS) || log_ring_flush(&res, &ring) || rdma_drain(&res))
+        return 1;
+    resources_destroy(&res);
+
+    r->seconds = elapsed / 1e9;
+    r->recs_per_sec = num_records / r->seconds;
+    r->gbytes_per_sec = (double)num_records * p->rec_size / elapsed;
+    r->ratio = pack && pack->packed_bytes ? (double)pack->raw_bytes / pack->packed_bytes : 1.0;
+    r->p50 = hist_percentile(&h, 0.50) / 1e3;
+    r->p99 = hist_percentile(&h, 0.99) / 1e3;
+    r->p999 = hist_percentile(&h, 0.999) / 1e3;
+    r->max = h.max / 1e3;
+    free(pend);
+    free(pool);
+    free(pack);
+    return 0;
+}
+
+static int run_point(int port, const struct point *p, struct result *r)
+{
+    int status = 0;
+    pid_t pid;
+    int lfd;
+    int rc;
+
+    apply_point(p);
+    lfd = bench_listen(port);
+    if (lfd < 0)
+        return 1;
+    fflush(NULL);
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "fork failed: %s\n", strerror(errno));
+        close(lfd);
+        return 1;
+    }
+    if (pid == 0)
+        _exit(run_consumer(lfd, p->rec_size));
+    close(lfd);
+
+    rc = run_producer(port, p, r);
+    if (rc)
+        kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    return rc || !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+static void emit(int json, int first, const struct point *p, const struct result *r)
+{
+    const char *xport = config.transport ? config.transport->name : verbs_transport.name;
+    const char *codec = p->codec < 0 ? "off" : log_codec_name(p->codec);
+
+    if (!json) {
+        if (first)
+            fprintf(out, "transport,record_size,batch,queue_depth,signal_interval,inline,imm,ack,codec,records,"
+                         "seconds,records_per_sec,gbytes_per_sec,ratio,p50_us,p99_us,p999_us,max_us\n");
+        fprintf(out, "%s,%ld,%ld,%ld,%ld,%ld,%d,%d,%s,%ld,%.6f,%.0f,%.4f,%.2f,%.3f,%.3f,%.3f,%.3f\n",
+                xport, p->rec_size, p->batch, p->depth, p->interval, p->inline_size, use_imm, use_ack, codec,
+                num_records, r->seconds, r->recs_per_sec, r->gbytes_per_sec, r->ratio, r->p50, r->p99, r->p999,
+                r->max);
+    } else {
+        fprintf(out, "%s\n  {\"transport\": \"%s\", \"record_size\": %ld, \"batch\": %ld, \"queue_depth\": %ld, "
+                     "\"signal_interval\": %ld, \"inline\": %ld, \"imm\": %d, \"ack\": %d, \"codec\": \"%s\", "
+                     "\"records\": %ld, \"seconds\": %.6f, \"records_per_sec\": %.0f, \"gbytes_per_sec\": %.4f, "
+                     "\"ratio\": %.2f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f}",
+                first ? "[" : ",", xport, p->rec_size, p->batch, p->depth, p->interval, p->inline_size, use_imm,
+                use_ack, codec, num_records, r->seconds, r->recs_per_sec, r->gbytes_per_sec, r->ratio, r->p50,
+                r->p99, r->p999, r->max);
+    }
+    fflush(out);
+}
+
+static void usage_bench(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-r sizes] [-b batches] [-q depths] [-s intervals] [-i inline_sizes]\n"
+            "          [-n records] [-T verbs|shm] [-d ib_dev] [-g gid_idx] [-c busy|event|hybrid] [-w] [-A] [-M mtu]\n"
+            "          [-Q qps] [-z off,none,lz4] [-p base_port] [-o csv|json] [-f file]\n", argv0);
+    fprintf(stderr, "  Lists are comma separated and swept as a cross product, e.g. -r 64,256,4096\n");
+    fprintf(stderr, "  -i 0,256 compares plain and inline posting; -w announces batches with immediates\n");
+    fprintf(stderr, "  -Q stripes batches round-robin over that many QPs\n");
+    fprintf(stderr, "  -z off,lz4 compares plain appends with batches packed into one compressed record\n");
+    fprintf(stderr, "  -A times commits to the consumer's one-sided acknowledgement instead of the local CQE\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct int_list sizes = { { 64, 256, 1024, 4096 }, 4 };
+    struct int_list batches = { { 1, 16, 64 }, 3 };
+    struct int_list depths = { { 256 }, 1 };
+    struct int_list intervals = { { 1, 32 }, 2 };
+    struct int_list inlines = { { DEFAULT_INLINE_SIZE }, 1 };
+    struct int_list codecs = { { -1 }, 1 };
+    const char *path = NULL;
+    int port = BENCH_PORT;
+    int json = 0;
+    int first = 1;
+    int failed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:b:q:s:i:n:T:d:g:c:wAM:Q:z:p:o:f:")) != -1) {
+        switch (opt) {
+        case 'r':
+            failed |= parse_list(optarg, &sizes);
+            break;
+        case 'b':
+            failed |= parse_list(optarg, &batches);
+            break;
+        case 'q':
+            failed |= parse_list(optarg, &depths);
+            break;
+        case 's':
+            failed |= parse_list(optarg, &intervals);
+            break;
+        case 'i':
+            failed |= parse_list(optarg, &inlines);
+            break;
+        case 'n':
+            num_records = atol(optarg);
+            break;
+        case 'T':
+            failed |= transport_parse(optarg, &config.transport);
+            break;
+        case 'd':
+            config.dev_name = optarg;
+            break;
+        case 'g':
+            config.gid_idx = atoi(optarg);
+            break;
+        case 'c':
+            failed |= cq_mode_parse(optarg, &config.cq_mode);
+            break;
+        case 'w':
+            use_imm = 1;
+            break;
+        case 'A':
+            use_ack = 1;
+            break;
+        case 'M':
+            config.mtu = atoi(optarg);
+            break;
+        case 'Q':
+            config.num_qps = atoi(optarg);
+            break;
+        case 'z':
+            failed |= parse_codecs(optarg, &codecs);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'o':
+            json = !strcmp(optarg, "json");
+            failed |= !json && strcmp(optarg, "csv");
+            break;
+        case 'f':
+            path = optarg;
+            break;
+        default:
+            failed = 1;
+            break;
+        }
+    }
+    if (failed || optind != argc || num_records <= 0 || config.num_qps < 1 || config.num_qps > RDMA_MAX_QPS) {
+        usage_bench(argv[0]);
+        return 1;
+    }
+
+    // Results keep the real stdout; everything the library prints there goes away
+    out = path ? fopen(path, "w") : fdopen(dup(STDOUT_FILENO), "w");
+    if (!out || !freopen("/dev/null", "w", stdout)) {
+        fprintf(stderr, "Failed to open output: %s\n", strerror(errno));
+        return 1;
+    }
+
+    for (int a = 0; a < sizes.n; a++)
+    for (int b = 0; b < batches.n; b++)
+    for (int c = 0; c < depths.n; c++)
+    for (int d = 0; d < intervals.n; d++)
+    for (int e = 0; e < inlines.n; e++)
+    for (int f = 0; f < codecs.n; f++) {
+        struct point p = { sizes.v[a], batches.v[b], depths.v[c], intervals.v[d], inlines.v[e], codecs.v[f] };
+        struct result r;
+
+        if (run_point(port, &p, &r)) {
+            fprintf(stderr, "Point size=%ld batch=%ld depth=%ld interval=%ld inline=%ld codec=%ld failed\n",
+                    p.rec_size, p.batch, p.depth, p.interval, p.inline_size, p.codec);
+            failed = 1;
+            continue;
+        }
+        emit(json, first, &p, &r);
+        first = 0;
+    }
+    if (json)
+        fprintf(out, first ? "[]\n" : "\n]\n");
+    fclose(out);
+    return failed;
+}
@@ -0,0 +1,299 @@
+#include "completion.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static const char *cq_mode_names[] = { "busy", "event", "hybrid" };
+
+int cq_mode_parse(const char *name, enum cq_mode *mode)
+{
+    for (int i = 0; i <= CQ_MODE_HYBRID; i++) {
+        if (!strcmp(name, cq_mode_names[i])) {
+            *mode = (enum cq_mode)i;
+            return 0;
+        }
+    }
+    fprintf(stderr, "unknown CQ mode '%s' (busy, event or hybrid)\n", name);
+    return 1;
+}
+
+const char *cq_mode_str(enum cq_mode mode)
+{
+    return (mode <= CQ_MODE_HYBRID) ? cq_mode_names[mode] : "unknown";
+}
+
+static uint64_t now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void soft_cq_init(struct soft_cq *scq)
+{
+    memset(scq, 0, sizeof(*scq));
+}
+
+/* Returns 0, or 1 if the queue is full. */
+int soft_cq_push(struct soft_cq *scq, const struct ibv_wc *wc)
+{
+    uint64_t tail = __atomic_load_n(&scq->tail, __ATOMIC_RELAXED);
+    struct soft_cqe *e;
+
+    do {
+        if (tail - __atomic_load_n(&scq->head, __ATOMIC_ACQUIRE) >= SOFT_CQ_ENTRIES)
+            return 1;
+    } while (!__atomic_compare_exchange_n(&scq->tail, &tail, tail + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    e = &scq->ring[tail % SOFT_CQ_ENTRIES];
+    e->wr_id = wc->wr_id;
+    e->qp_num = wc->qp_num;
+    e->imm_data = wc->imm_data;
+    e->byte_len = wc->byte_len;
+    e->opcode = wc->opcode;
+    e->status = wc->status;
+    e->wc_flags = wc->wc_flags;
+    __atomic_store_n(&e->seq, tail + 1, __ATOMIC_RELEASE);
+
+    // Pairs with the fence in soft_cq_block between raising waiters and rechecking
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&scq->waiters, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&scq->wake, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &scq->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+    return 0;
+}
+
+static int soft_cq_empty(struct soft_cq *scq)
+{
+    uint64_t head = __atomic_load_n(&scq->head, __ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&scq->ring[head % SOFT_CQ_ENTRIES].seq, __ATOMIC_ACQUIRE) != head + 1;
+}
+
+int soft_cq_poll(struct soft_cq *scq, struct ibv_wc *wc, int max)
+{
+    uint64_t head = __atomic_load_n(&scq->head, __ATOMIC_ACQUIRE);
+    int n = 0;
+
+    while (n < max) {
+        struct soft_cqe *e = &scq->ring[head % SOFT_CQ_ENTRIES];
+
+        if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != head + 1)
+            break;
+
+        memset(&wc[n], 0, sizeof(wc[n]));
+        wc[n].wr_id = e->wr_id;
+        wc[n].qp_num = e->qp_num;
+        wc[n].imm_data = e->imm_data;
+        wc[n].byte_len = e->byte_len;
+        wc[n].opcode = (enum ibv_wc_opcode)e->opcode;
+        wc[n].status = (enum ibv_wc_status)e->status;
+        wc[n].wc_flags = e->wc_flags;
+
+        /* A slot is only reused once head has passed it, so the copy is
+         * good if no other consumer claimed it meanwhile. */
+        if (__atomic_compare_exchange_n(&scq->head, &head, head + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            head++;
+            n++;
+        }
+    }
+    return n;
+}
+
+/* Sleep until something is pushed or timeout_ms passes. */
+static void soft_cq_sleep(struct soft_cq *scq, int timeout_ms)
+{
+    struct timespec ts = { timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000 };
+    uint32_t wake = __atomic_load_n(&scq->wake, __ATOMIC_ACQUIRE);
+
+    __atomic_add_fetch(&scq->waiters, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (soft_cq_empty(scq))
+        syscall(SYS_futex, &scq->wake, FUTEX_WAIT, wake, &ts, NULL, 0);
+    __atomic_sub_fetch(&scq->waiters, 1, __ATOMIC_RELAXED);
+}
+
+int cq_engine_init(struct cq_engine *eng, struct ibv_context *ctx, int cqe, enum cq_mode mode)
+{
+    struct epoll_event ev;
+    int flags;
+
+    memset(eng, 0, sizeof(*eng));
+    eng->epfd = -1;
+    eng->mode = mode;
+    eng->spin_usec = CQ_DEFAULT_SPIN_USEC;
+
+    if (mode != CQ_MODE_BUSY) {
+        eng->channel = ibv_create_comp_channel(ctx);
+        if (!eng->channel) {
+            fprintf(stderr, "failed to create completion channel\n");
+            goto cq_engine_init_err;
+        }
+
+        flags = fcntl(eng->channel->fd, F_GETFL);
+        if (fcntl(eng->channel->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            fprintf(stderr, "failed to make completion channel non-blocking: %s\n", strerror(errno));
+            goto cq_engine_init_err;
+        }
+
+        eng->epfd = epoll_create1(0);
+        if (eng->epfd < 0) {
+            fprintf(stderr, "epoll_create1 failed: %s\n", strerror(errno));
+            goto cq_engine_init_err;
+        }
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        if (epoll_ctl(eng->epfd, EPOLL_CTL_ADD, eng->channel->fd, &ev)) {
+            fprintf(stderr, "failed to add completion channel to epoll: %s\n", strerror(errno));
+            goto cq_engine_init_err;
+        }
+    }
+
+    eng->cq = ibv_create_cq(ctx, cqe, NULL, eng->channel, 0);
+    if (!eng->cq) {
+        fprintf(stderr, "failed to create CQ with %d entries\n", cqe);
+        goto cq_engine_init_err;
+    }
+    return 0;
+
+cq_engine_init_err:
+    cq_engine_destroy(eng);
+    return 1;
+}
+
+void cq_engine_init_soft(struct cq_engine *eng, struct soft_cq *scq, enum cq_mode mode)
+{
+    memset(eng, 0, sizeof(*eng));
+    eng->epfd = -1;
+    eng->mode = mode;
+    eng->spin_usec = CQ_DEFAULT_SPIN_USEC;
+    eng->scq = scq;
+}
+
+void cq_engine_destroy(struct cq_engine *eng)
+{
+    // A soft CQ's memory belongs to the transport that handed it out
+    eng->scq = NULL;
+    if (eng->cq) {
+        if (eng->unacked)
+            ibv_ack_cq_events(eng->cq, eng->unacked);
+        if (ibv_destroy_cq(eng->cq))
+            fprintf(stderr, "failed to destroy CQ\n");
+        eng->cq = NULL;
+    }
+    if (eng->epfd >= 0) {
+        close(eng->epfd);
+        eng->epfd = -1;
+    }
+    if (eng->channel) {
+        if (ibv_destroy_comp_channel(eng->channel))
+            fprintf(stderr, "failed to destroy completion channel\n");
+        eng->channel = NULL;
+    }
+}
+
+/* Drain up to max CQEs without blocking. */
+int cq_engine_poll(struct cq_engine *eng, struct ibv_wc *wc, int max)
+{
+    if (eng->scq)
+        return soft_cq_poll(eng->scq, wc, max);
+    return ibv_poll_cq(eng->cq, max, wc);
+}
+
+/* Arm the CQ, then sleep until the channel fires or timeout_ms passes.
+ * Returns CQEs found, 0 on timeout, -1 on error. */
+static int cq_engine_block(struct cq_engine *eng, struct ibv_wc *wc, int max, int timeout_ms)
+{
+    uint64_t deadline = now_usec() + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0) * 1000;
+    struct epoll_event ev;
+    struct ibv_cq *ev_cq;
+    void *ev_ctx;
+    int n;
+
+    if (eng->scq) {
+        n = soft_cq_poll(eng->scq, wc, max);
+        if (n || !timeout_ms)
+            return n;
+        soft_cq_sleep(eng->scq, timeout_ms);
+        return soft_cq_poll(eng->scq, wc, max);
+    }
+
+    for (;;) {
+        if (!eng->armed) {
+            if (ibv_req_notify_cq(eng->cq, 0)) {
+                fprintf(stderr, "ibv_req_notify_cq failed\n");
+                return -1;
+            }
+            eng->armed = 1;
+            // A CQE may have landed before the CQ was armed
+            n = ibv_poll_cq(eng->cq, max, wc);
+            if (n)
+                return n;
+        }
+
+        // After EINTR or a wakeup without a CQE, wait only for what is left
+        if (timeout_ms > 0) {
+            uint64_t now = now_usec();
+
+            timeout_ms = now < deadline ? (int)((deadline - now + 999) / 1000) : 0;
+        }
+        n = epoll_wait(eng->epfd, &ev, 1, timeout_ms);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "epoll_wait on completion channel failed: %s\n", strerror(errno));
+            return -1;
+        }
+        if (n == 0)
+            return 0;
+
+        while (ibv_get_cq_event(eng->channel, &ev_cq, &ev_ctx) == 0) {
+            eng->armed = 0;
+            if (++eng->unacked >= CQ_ACK_BATCH) {
+                ibv_ack_cq_events(eng->cq, eng->unacked);
+                eng->unacked = 0;
+            }
+        }
+
+        n = ibv_poll_cq(eng->cq, max, wc);
+        if (n)
+            return n;
+    }
+}
+
+/* Wait for at least one CQE according to the engine mode. Returns CQEs
+ * found, 0 on timeout, -1 on error. */
+int cq_engine_wait(struct cq_engine *eng, struct ibv_wc *wc, int max, int timeout_ms)
+{
+    uint64_t start = now_usec();
+    uint64_t spin = (uint64_t)timeout_ms * 1000;
+    int n;
+
+    if (eng->mode == CQ_MODE_EVENT)
+        return cq_engine_block(eng, wc, max, timeout_ms);
+
+    if (eng->mode == CQ_MODE_HYBRID && (uint64_t)eng->spin_usec < spin)
+        spin = eng->spin_usec;
+
+    do {
+        n = cq_engine_poll(eng, wc, max);
+        if (n)
+            return n;
+    } while (now_usec() - start < spin);
+
+    if (eng->mode == CQ_MODE_BUSY)
+        return 0;
+
+    timeout_ms -= (now_usec() - start) / 1000;
+    return cq_engine_block(eng, wc, max, timeout_ms > 0 ? timeout_ms : 0);
+}
@@ -0,0 +1,75 @@
+#ifndef COMPLETION_H
+#define COMPLETION_H
+
+#include <infiniband/verbs.h>
+#include <stdint.h>
+
+/*
+ * Completion engine: owns a CQ and drains it in batches using one of three
+ * wait strategies, selectable at runtime. The CQ is either a verbs CQ or a
+ * soft_cq that a software transport fills.
+ */
+
+#define CQ_POLL_BATCH 32
+#define CQ_DEFAULT_SPIN_USEC 50
+#define CQ_ACK_BATCH 64 // Events acked together to amortize the ack lock
+
+enum cq_mode {
+    CQ_MODE_BUSY,   // Spin on ibv_poll_cq, lowest latency
+    CQ_MODE_EVENT,  // Arm the CQ and sleep in epoll on the completion channel
+    CQ_MODE_HYBRID, // Spin for spin_usec, then arm and block
+};
+
+#define SOFT_CQ_ENTRIES 4096
+
+struct soft_cqe {
+    uint64_t wr_id;
+    uint32_t qp_num;
+    uint32_t imm_data;  // Network byte order, as in ibv_wc
+    uint32_t byte_len;
+    uint8_t opcode;     // enum ibv_wc_opcode
+    uint8_t status;     // enum ibv_wc_status
+    uint8_t wc_flags;
+    uint8_t pad;
+    uint64_t seq;       // Slot + 1 once the entry is published
+};
+
+/* Completion queue in plain (possibly shared) memory. Any number of
+ * producers, in this or another process, reserve slots by CAS on tail;
+ * consumers claim entries by CAS on head. A blocked consumer sleeps on a
+ * shared futex that producers kick while someone is waiting. */
+struct soft_cq {
+    uint64_t head;
+    char pad0[56];
+    uint64_t tail;
+    uint32_t waiters;
+    uint32_t wake;      // Futex word
+    char pad1[48];
+    struct soft_cqe ring[SOFT_CQ_ENTRIES];
+};
+
+void soft_cq_init(struct soft_cq *scq);
+int soft_cq_push(struct soft_cq *scq, const struct ibv_wc *wc);
+int soft_cq_poll(struct soft_cq *scq, struct ibv_wc *wc, int max);
+
+struct cq_engine {
+    struct ibv_cq *cq;
+    struct soft_cq *scq; // Set instead of cq by software transports
+    struct ibv_comp_channel *channel;
+    int epfd;
+    enum cq_mode mode;
+    int spin_usec;
+    int armed;
+    unsigned int unacked;
+};
+
+int cq_mode_parse(const char *name, enum cq_mode *mode);
+const char *cq_mode_str(enum cq_mode mode);
+
+int cq_engine_init(struct cq_engine *eng, struct ibv_context *ctx, int cqe, enum cq_mode mode);
+void cq_engine_init_soft(struct cq_engine *eng, struct soft_cq *scq, enum cq_mode mode);
+void cq_engine_destroy(struct cq_engine *eng);
+int cq_engine_poll(struct cq_engine *eng, struct ibv_wc *wc, int max);
+int cq_engine_wait(struct cq_engine *eng, struct ibv_wc *wc, int max, int timeout_ms);
+
+#endif // COMPLETION_H
@@ -1,4 +1,12 @@
 #include "rdma.h"
+#include "log_ring.h"
+#include "log_stage.h"
+#include "log_quorum.h"
+#include "log_pack.h"
+#include "log_shared.h"
+#include "log_fetch.h"
+#include "logging.h"
+#include "stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,86 +15,559 @@
 #include <netdb.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
 
 #define NUM_XLOGS 10
 #define XLOG_SIZE 256
+#define MAX_PRODUCERS 64
+#define WAL_PAGES 256 // Buffer cache -g Xlogs are gathered from
+#define WAL_PAGE_MAX (64 * 1024) // Largest Xlog a logstore takes
+#define SHARED_MAX_BATCH 256 // Xlogs reserved with one fetch-and-add
+#define FETCH_BUSY_RETRIES 100 // The window frees up once the logstore sees the last range's connection close
 
-struct xlog_entry {
-    uint32_t flag;
-    char data[XLOG_SIZE];
+struct producer {
+    pthread_t thread;
+    struct log_stage *stage;
+    int index;
+    long count;
+    int sync_commit;
+    int rc;
 };
 
-int main(int argc, char *argv[]) {
-    struct resources res;
-    struct sockaddr_in addr;
+// A backend generating WAL: appends through the staging area, concurrently with the others
+static void *producer_thread(void *arg)
+{
+    struct producer *p = (struct producer *)arg;
+    char xlog[XLOG_SIZE];
+
+    for (long i = 0; i < p->count; i++) {
+        int len = snprintf(xlog, XLOG_SIZE, "Xlog-%d-%ld", p->index, i) + 1;
+        uint64_t end;
+
+        if (log_stage_append(p->stage, xlog, len, RING_REC_VALID, &end) != 0 ||
+            (p->sync_commit && log_stage_wait(p->stage, end, 1) != 0)) {
+            fprintf(stderr, "Producer %d failed at Xlog %ld\n", p->index, i);
+            p->rc = 1;
+            break;
+        }
+    }
+    return NULL;
+}
 
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <logstore_ip> <port>\n", argv[0]);
-        fprintf(stderr, "Example: %s 192.168.100.2 5555\n", argv[0]);
+static int run_producers(struct resources *res, struct log_ring *ring, int nthreads, long num_xlogs, int sync_commit)
+{
+    struct producer producers[MAX_PRODUCERS];
+    struct log_stage stage;
+    int rc = 0;
+
+    if (log_stage_start(&stage, res, ring) != 0)
         return 1;
+
+    for (int i = 0; i < nthreads; i++) {
+        producers[i].stage = &stage;
+        producers[i].index = i;
+        producers[i].count = num_xlogs / nthreads + (i < num_xlogs % nthreads);
+        producers[i].sync_commit = sync_commit;
+        producers[i].rc = 0;
+        if (pthread_create(&producers[i].thread, NULL, producer_thread, &producers[i]) != 0) {
+            fprintf(stderr, "Failed to start producer %d\n", i);
+            nthreads = i;
+            rc = 1;
+            break;
+        }
     }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(producers[i].thread, NULL);
+        rc |= producers[i].rc;
+    }
+
+    rc |= log_stage_stop(&stage);
+    printf("%d producers staged %lu Xlogs in %lu flushes\n", nthreads, (unsigned long)ring->lsn,
+           (unsigned long)stage.flushes);
+    return rc;
+}
 
-    config.tcp_port = atoi(argv[2]);
+/* Connect to one logstore given as host[:port] and lay its log ring over
+ * the registered buffer. r->res must have been through resources_init. */
+static int connect_replica(struct log_replica *r, const char *endpoint, int default_port)
+{
+    struct sockaddr_in addr;
+    char host[64];
+    const char *colon = strchr(endpoint, ':');
+    size_t hlen = colon ? (size_t)(colon - endpoint) : strlen(endpoint);
+    int port = colon ? atoi(colon + 1) : default_port;
+
+    if (hlen >= sizeof(host)) {
+        fprintf(stderr, "Invalid logstore address %s\n", endpoint);
+        return 1;
+    }
+    memcpy(host, endpoint, hlen);
+    host[hlen] = '\0';
+    snprintf(r->name, sizeof(r->name), "%s:%d", host, port);
 
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(config.tcp_port);
-    if (inet_pton(AF_INET, argv[1], &addr.sin_addr) <= 0) {
-        fprintf(stderr, "Invalid IP address\n");
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid IP address %s\n", host);
         return 1;
     }
 
-    printf("Connecting to LogStore at %s:%d\n", argv[1], config.tcp_port);
+    printf("Connecting to LogStore at %s\n", r->name);
 
-    resources_init(&res);
-    if (resources_create(&res) != 0) {
+    if (resources_create(&r->res) != 0) {
         fprintf(stderr, "Failed to create RDMA resources\n");
         return 1;
     }
 
-    res.sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (res.sock < 0) {
+    r->res.sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (r->res.sock < 0) {
         fprintf(stderr, "Failed to create socket\n");
         return 1;
     }
 
-    if (connect(res.sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        fprintf(stderr, "Failed to connect to server\n");
+    if (connect(r->res.sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Failed to connect to %s\n", r->name);
         return 1;
     }
 
-    if (connect_qp(&res) != 0) {
+    if (connect_qp(&r->res) != 0) {
         fprintf(stderr, "Failed to connect QPs\n");
         return 1;
     }
 
-    printf("RDMA connection established.\n");
+    if (r->res.remote_props.size != r->res.buf_size) {
+        fprintf(stderr, "Log ring size mismatch: local %u, remote %u\n", r->res.buf_size, r->res.remote_props.size);
+        return 1;
+    }
 
-    struct xlog_entry *xlog_buffer = (struct xlog_entry *)res.buf;
+    if (log_ring_init(&r->ring, r->res.buf, r->res.buf_size) != 0) {
+        fprintf(stderr, "Failed to initialize log ring\n");
+        return 1;
+    }
+    return 0;
+}
 
-    for (int i = 0; i < NUM_XLOGS; i++) {
-        snprintf(xlog_buffer[i].data, XLOG_SIZE, "Xlog-%d", i);
-        xlog_buffer[i].flag = 1;
+// Recovery replay: what a restarted node would apply, here just shown
+static int replay_xlog(void *arg, uint64_t lsn, const void *payload, uint32_t len)
+{
+    (void)arg;
+    pr_debug("Replaying Xlog LSN %lu: %.*s\n", (unsigned long)lsn, (int)len, (const char *)payload);
+    return 0;
+}
 
-        printf("Sending Xlog: %s\n", xlog_buffer[i].data);
+/* Read log log_id back from a logstore with RDMA READs, one window-sized
+ * range per connection, replaying records as they land. */
+static int fetch_log(const char *endpoint, int default_port, uint32_t log_id)
+{
+    struct log_replica *r = (struct log_replica *)calloc(1, sizeof(*r));
+    struct log_fetch_stats st;
+    struct timespec t0, t1;
+    uint64_t from = 1, records = 0, bytes = 0, reads = 0;
+    int busy = 0;
+    double secs;
+    int rc = 0;
 
-        if (rdma_write(&res, i * sizeof(struct xlog_entry), sizeof(struct xlog_entry)) != 0) {
-            fprintf(stderr, "Failed to perform RDMA Write for Xlog: %s\n", xlog_buffer[i].data);
-            continue;
+    if (!r)
+        return 1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    do {
+        memset(&st, 0, sizeof(st));
+        resources_init(&r->res);
+        r->res.fetch_log = log_id;
+        r->res.fetch_lsn = from;
+        if (connect_replica(r, endpoint, default_port) != 0 || log_fetch(&r->res, replay_xlog, NULL, &st) != 0) {
+            if (st.status == FETCH_BUSY && ++busy < FETCH_BUSY_RETRIES) {
+                resources_destroy(&r->res);
+                usleep(1000);
+                continue;
+            }
+            fprintf(stderr, "Failed to fetch log %u from LSN %lu\n", log_id, (unsigned long)from);
+            rc = 1;
+        } else {
+            char b;
+
+            // The logstore frees the window when it sees us go; wait for that before asking again
+            shutdown(r->res.sock, SHUT_WR);
+            while (read(r->res.sock, &b, 1) > 0)
+                ;
         }
+        resources_destroy(&r->res);
+        busy = 0;
+        records += st.records;
+        bytes += st.bytes;
+        reads += st.reads;
+        if (st.records)
+            from = st.last_lsn + 1;
+    } while (!rc && (st.status == FETCH_BUSY || (st.more && st.records)));
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    free(r);
+
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("Fetched %lu Xlogs of log %u up to LSN %lu: %lu bytes in %lu READs, %.3f s, %.1f MB/s\n",
+           (unsigned long)records, log_id, (unsigned long)(from - 1), (unsigned long)bytes,
+           (unsigned long)reads, secs, secs > 0 ? bytes / secs / 1e6 : 0.0);
+    return rc;
+}
+
+/* Append to the logstore's shared log alongside other compute nodes: one
+ * fetch-and-add per batch of Xlogs reserves their place, then they are
+ * written. No acknowledgements come back; an Xlog is in once the logstore's
+ * head has moved past it. */
+static int append_shared(struct log_replica *r, long num_xlogs, int batch_size, int sync_commit)
+{
+    static char xlogs[SHARED_MAX_BATCH][XLOG_SIZE];
+    const void *payloads[SHARED_MAX_BATCH];
+    uint32_t lens[SHARED_MAX_BATCH];
+    struct log_shared sh;
+    int pid = getpid();
+
+    if (log_shared_open(&sh, &r->res) != 0)
+        return 1;
+    if (batch_size < 1)
+        batch_size = 1;
+    if (batch_size > SHARED_MAX_BATCH)
+        batch_size = SHARED_MAX_BATCH;
+
+    for (long i = 0; i < num_xlogs;) {
+        int n;
+
+        for (n = 0; n < batch_size && i < num_xlogs; n++, i++) {
+            lens[n] = snprintf(xlogs[n], XLOG_SIZE, "Xlog-%d-%ld", pid, i) + 1;
+            payloads[n] = xlogs[n];
+            pr_debug("Sending Xlog: %s\n", xlogs[n]);
+        }
+        if (log_shared_append(&sh, payloads, lens, n) != 0) {
+            fprintf(stderr, "Failed to append Xlogs to the shared log\n");
+            return 1;
+        }
+        if (sync_commit && log_shared_wait(&sh, sh.end) != 0)
+            return 1;
+    }
+
+    if (log_shared_wait(&sh, sh.end) != 0) {
+        fprintf(stderr, "Xlogs were not published in the shared log\n");
+        return 1;
+    }
+    printf("All %lu Xlogs published in the shared log, reserved with %lu fetch-and-adds, %lu head reads\n",
+           (unsigned long)sh.records, (unsigned long)sh.reserves, (unsigned long)sh.head_reads);
+    if (rdma_drain(&r->res) != 0)
+        return 1;
+    return resources_destroy(&r->res);
+}
 
-        printf("Xlog sent successfully: %s\n", xlog_buffer[i].data);
+/* A stand-in for a buffer cache: WAL_PAGES pages of page_size bytes that
+ * Xlogs are written from in place, each replica's MR cache registering
+ * them as they are first used. The pages never change, so any may be in
+ * flight at any time. */
+static char *wal_pages_create(size_t page_size)
+{
+    char *pages = (char *)aligned_alloc(4096, (WAL_PAGES * page_size + 4095) & ~(size_t)4095);
 
-        usleep(10000);  // 10ms between sends
+    if (!pages)
+        return NULL;
+    for (int p = 0; p < WAL_PAGES; p++) {
+        char *page = pages + p * page_size;
+
+        for (size_t off = 0; off < page_size; off++)
+            page[off] = 'a' + (p + off) % 26;
+        snprintf(page, page_size, "WAL page %d", p);
     }
+    return pages;
+}
+
+int main(int argc, char *argv[]) {
+    struct log_replica *rep;
+    struct log_quorum q;
+    char *endpoints[QUORUM_MAX_REPLICAS];
+    char *list, *save = NULL;
+    char xlog[XLOG_SIZE];
+    long num_xlogs = NUM_XLOGS;
+    int batch_size = 16;
+    int notify = 0;
+    int sync_commit = 0;
+    int nthreads = 1;
+    int nrep = 0;
+    int quorum = 0;
+    long fetch = -1;
+    int codec = -1;
+    long gather = 0;
+    char *pages = NULL;
+    long log_id = 1;
+    int usage = 0;
+    int opt;
 
-    printf("All Xlogs sent. Cleaning up...\n");
+    while ((opt = getopt(argc, argv, "b:s:q:c:i:P:H:wSt:T:M:Q:p:k:F:L:Rz:Gg:m:o")) != -1) {
+        switch (opt) {
+        case 'b':
+            batch_size = atoi(optarg);
+            break;
+        case 's':
+            config.signal_interval = atoi(optarg);
+            break;
+        case 'q':
+            config.queue_depth = atoi(optarg);
+            break;
+        case 'i':
+            config.inline_size = atoi(optarg);
+            break;
+        case 'P':
+            config.pool_size = (size_t)atol(optarg) << 20;
+            break;
+        case 'H':
+            if (mem_pool_parse_page(optarg, &config.hugepage_size))
+                return 1;
+            break;
+        case 'c':
+            if (cq_mode_parse(optarg, &config.cq_mode))
+                return 1;
+            break;
+        case 'w':
+            notify = 1;
+            break;
+        case 'S':
+            sync_commit = 1;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'T':
+            if (transport_parse(optarg, &config.transport))
+                return 1;
+            break;
+        case 'M':
+            config.mtu = atoi(optarg);
+            break;
+        case 'Q':
+            config.num_qps = atoi(optarg);
+            break;
+        case 'p':
+            if (rdma_parse_ports(optarg))
+                return 1;
+            break;
+        case 'k':
+            quorum = atoi(optarg);
+            break;
+        case 'F':
+            fetch = atol(optarg);
+            break;
+        case 'L':
+            log_id = atol(optarg);
+            break;
+        case 'R':
+            config.spare_qps = 1;
+            break;
+        case 'z':
+            if (log_codec_parse(optarg, &codec))
+                return 1;
+            config.pack = 1;
+            break;
+        case 'G':
+            config.shared_log = 1;
+            break;
+        case 'g':
+            gather = atol(optarg);
+            break;
+        case 'm':
+            config.mr_budget = (size_t)atol(optarg) << 20;
+            break;
+        case 'o':
+            config.mr_odp = 1;
+            break;
+        default:
+            usage = 1;
+            break;
+        }
+    }
+
+    if (usage || (argc - optind != 2 && argc - optind != 3) || nthreads < 1 || nthreads > MAX_PRODUCERS ||
+        config.num_qps < 1 || config.num_qps > RDMA_MAX_QPS || gather < 0 || gather > WAL_PAGE_MAX ||
+        log_id < 1 || log_id > UINT32_MAX) {
+        fprintf(stderr, "Usage: %s [-b batch] [-s signal_interval] [-q queue_depth] [-c busy|event|hybrid] [-i inline_size]\n"
+                "          [-P pool_mb] [-H none|2m|1g] [-w] [-S] [-t producers] [-T verbs|shm] [-M mtu]\n"
+                "          [-Q qps] [-p port,...] [-k quorum] [-L log_id] [-F log_id] [-R] [-z none|lz4]\n"
+                "          [-G] [-g xlog_bytes] [-m mr_budget_mb] [-o]\n"
+                "          <logstore_ip[:port][,...]> <port> [num_xlogs]\n", argv[0]);
+        fprintf(stderr, "  -w announces each batch with RDMA write-with-immediate\n");
+        fprintf(stderr, "  -S waits for each Xlog to be durable on the logstore before the next\n");
+        fprintf(stderr, "  -t appends from that many threads through a group-commit staging area (-b is then adaptive)\n");
+        fprintf(stderr, "  -M caps the path MTU in bytes, otherwise the best both ports support\n");
+        fprintf(stderr, "  -Q stripes appends over up to %d QPs, -p spreads them over those HCA ports\n", RDMA_MAX_QPS);
+        fprintf(stderr, "  Several logstores get every Xlog; one counts as committed once -k of them (default a majority) have it\n");
+        fprintf(stderr, "  -R keeps a spare QP per QP and fails over to it when a QP errors, replaying unacknowledged Xlogs\n");
+        fprintf(stderr, "  -z packs each batch of -b Xlogs into one record, compressed with lz4 or left as is with none\n");
+        fprintf(stderr, "  -g appends Xlogs of that many bytes (up to %d) straight from registered pages, without copying them\n",
+                WAL_PAGE_MAX);
+        fprintf(stderr, "  -m caps the memory registered for -g at that many MB (default %d, 0 for no cap), -o registers it\n"
+                "     on demand (ODP) where the HCA supports it\n", (int)(DEFAULT_MR_BUDGET >> 20));
+        fprintf(stderr, "  -G appends to the logstore's shared log, which other compute nodes append to as well\n");
+        fprintf(stderr, "  -L names the log the Xlogs persist to on the logstores (default 1), the same after a restart\n");
+        fprintf(stderr, "  -F reads stored log log_id back from the (first) logstore with RDMA READs instead of appending\n");
+        fprintf(stderr, "  -T shm talks to a logstore on this host through shared memory, no HCA needed\n");
+        fprintf(stderr, "Example: %s -b 32 192.168.100.2 5555 1000000\n", argv[0]);
+        return 1;
+    }
+
+    config.tcp_port = atoi(argv[optind + 1]);
+    config.log_id = (uint32_t)log_id;
+    config.buf_size = log_ring_region_size(RDMA_BUFFER_SIZE);
+    if (argc - optind == 3)
+        num_xlogs = atol(argv[optind + 2]);
+
+    for (list = strtok_r(argv[optind], ",", &save); list; list = strtok_r(NULL, ",", &save)) {
+        if (nrep == QUORUM_MAX_REPLICAS) {
+            fprintf(stderr, "At most %d logstores\n", QUORUM_MAX_REPLICAS);
+            return 1;
+        }
+        endpoints[nrep++] = list;
+    }
+    // Readable with rdma_stats <pid> while running
+    if (stats_open() == 0)
+        atexit(stats_close);
+    stats_thread("main");
+
+    if (fetch >= 0) {
+        if (fetch_log(endpoints[0], config.tcp_port, (uint32_t)fetch) != 0)
+            return 1;
+        stats_print(stdout, stats_page());
+        return 0;
+    }
+    if (!quorum)
+        quorum = nrep / 2 + 1;
+    if (nthreads > 1 && nrep > 1) {
+        fprintf(stderr, "Staged producers append to a single logstore\n");
+        return 1;
+    }
+    if (nthreads > 1 && config.spare_qps) {
+        fprintf(stderr, "Staged producers do not fail over, -R needs -t 1\n");
+        return 1;
+    }
+    if (nthreads > 1 && config.pack) {
+        fprintf(stderr, "Staged producers do not pack, -z needs -t 1\n");
+        return 1;
+    }
+
+    if (gather && (nthreads > 1 || config.spare_qps || config.pack || config.shared_log)) {
+        fprintf(stderr, "Xlogs gathered from pages go out one by one and can't be replayed, -g excludes -t, -R, -z and -G\n");
+        return 1;
+    }
+    if (config.shared_log && (nrep > 1 || nthreads > 1 || config.spare_qps || config.pack)) {
+        fprintf(stderr, "The shared log takes plain Xlogs from one thread to one logstore, -G excludes -t, -R and -z\n");
+        return 1;
+    }
+
+    rep = (struct log_replica *)calloc(nrep, sizeof(*rep));
+    if (!rep)
+        return 1;
+    if (config.shared_log) {
+        resources_init(&rep[0].res);
+        if (connect_replica(&rep[0], endpoints[0], config.tcp_port) != 0 ||
+            append_shared(&rep[0], num_xlogs, batch_size, sync_commit) != 0)
+            return 1;
+        free(rep);
+        stats_print(stdout, stats_page());
+        printf("All Xlogs sent. Resources destroyed. Exiting.\n");
+        return 0;
+    }
+    for (int i = 0; i < nrep; i++) {
+        resources_init(&rep[i].res);
+        if (connect_replica(&rep[i], endpoints[i], config.tcp_port) != 0)
+            return 1;
+        if (config.pack && !(rep[i].res.remote_props.flags & CM_FLAG_PACK)) {
+            fprintf(stderr, "LogStore %s does not take packed batches\n", rep[i].name);
+            return 1;
+        }
+        // A packed batch is one record, and goes out on its own doorbell
+        log_ring_set_batch(&rep[i].ring, config.pack ? 1 : batch_size);
+        if (notify)
+            rep[i].ring.flush_flags = RDMA_WRITE_IMM;
+    }
+    if (log_quorum_init(&q, rep, nrep, quorum) != 0)
+        return 1;
+    if (config.pack) {
+        q.pack = (struct log_pack *)malloc(sizeof(*q.pack));
+        if (!q.pack)
+            return 1;
+        log_pack_init(q.pack, codec, batch_size);
+    }
+
+    if (gather && !(pages = wal_pages_create(gather))) {
+        fprintf(stderr, "Failed to set up WAL pages\n");
+        return 1;
+    }
+
+    printf("RDMA connection established to %d LogStore(s), quorum %d.\n", nrep, quorum);
+
+    if (nthreads > 1) {
+        if (run_producers(&rep[0].res, &rep[0].ring, nthreads, num_xlogs, sync_commit) != 0) {
+            fprintf(stderr, "Failed to append Xlogs from %d producers\n", nthreads);
+            return 1;
+        }
+        q.lsn = rep[0].ring.lsn;
+    }
+
+    for (long i = 0; nthreads == 1 && i < num_xlogs; i++) {
+        int len = snprintf(xlog, XLOG_SIZE, "Xlog-%ld", i) + 1;
+        struct iovec page;
+
+        pr_debug("Sending Xlog: %s\n", xlog);
+
+        if (pages) {
+            page.iov_base = pages + (i % WAL_PAGES) * gather;
+            page.iov_len = gather;
+            if (log_quorum_appendv(&q, &page, 1) != 0) {
+                fprintf(stderr, "Failed to perform RDMA Write for Xlog %ld from page %ld\n", i, i % WAL_PAGES);
+                return 1;
+            }
+        } else if (log_quorum_append(&q, xlog, len, RING_REC_VALID) != 0) {
+            fprintf(stderr, "Failed to perform RDMA Write for Xlog: %s\n", xlog);
+            return 1;
+        }
+        if (sync_commit && log_quorum_wait(&q, q.lsn, 1) != 0) {
+            fprintf(stderr, "Xlog %s was not acknowledged durable\n", xlog);
+            return 1;
+        }
+    }
+
+    // The logstores acknowledge by writing their watermarks into our ring_ctrl
+    if (log_quorum_wait(&q, q.lsn, 1) != 0) {
+        fprintf(stderr, "Failed to get Xlogs acknowledged\n");
+        return 1;
+    }
+    printf("All Xlogs durable on %d of %d LogStore(s) up to LSN %lu\n", q.quorum, q.n,
+           (unsigned long)log_quorum_lsn(&q, 1));
+    for (int i = 0; i < nrep; i++) {
+        if (rep[i].failovers)
+            printf("LogStore %s failed over to spare QPs %d time(s)\n", rep[i].name, rep[i].failovers);
+    }
+    if (q.pack)
+        printf("Packed into %lu %s batches: %lu bytes of Xlogs sent as %lu (%.2fx)\n",
+               (unsigned long)q.pack->batches, log_codec_name(codec), (unsigned long)q.pack->raw_bytes,
+               (unsigned long)q.pack->packed_bytes,
+               q.pack->packed_bytes ? (double)q.pack->raw_bytes / q.pack->packed_bytes : 0.0);
+    // The pages are about to be freed, so their MRs must go first
+    for (int i = 0; pages && i < nrep; i++) {
+        if (!rep[i].live || !rep[i].res.mr_cache)
+            continue;
+        if (rdma_mem_invalidate(&rep[i].res, pages, WAL_PAGES * gather) != 0) {
+            fprintf(stderr, "Failed to release the MRs of the WAL pages\n");
+            return 1;
+        }
+        printf("LogStore %s ", rep[i].name);
+        mr_cache_print(stdout, rep[i].res.mr_cache);
+    }
 
-    if (resources_destroy(&res) != 0) {
-        fprintf(stderr, "Failed to destroy resources\n");
+    if (log_quorum_close(&q) != 0) {
+        fprintf(stderr, "Failed to send end of stream\n");
         return 1;
     }
+    free(q.pack);
+    free(rep);
+    free(pages);
 
-    printf("Resources destroyed. Exiting.\n");
+    stats_print(stdout, stats_page());
+    printf("All Xlogs sent. Resources destroyed. Exiting.\n");
     return 0;
-}
\ No newline at end of file
+}
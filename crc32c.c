@@ -0,0 +1,187 @@
+#include "crc32c.h"
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78 // Castagnoli, reflected
+#define CRC_BLOCK 512          // Bytes per stream when running three at once
+
+/* All the loops work on the raw register: no inversion on the way in or
+ * out, which keeps the update linear and lets split streams be combined. */
+typedef uint32_t (*crc_raw_fn)(uint32_t crc, const unsigned char *p, size_t len);
+
+static uint32_t sw_table[8][256];
+static uint32_t shift_table[4][256]; // A raw CRC advanced over CRC_BLOCK zero bytes
+static crc_raw_fn crc_raw;
+static const char *crc_impl_name = "sw";
+
+static uint32_t crc_shift(uint32_t crc)
+{
+    return shift_table[0][crc & 0xff] ^ shift_table[1][(crc >> 8) & 0xff] ^
+           shift_table[2][(crc >> 16) & 0xff] ^ shift_table[3][crc >> 24];
+}
+
+static uint32_t sw_raw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    while (len && ((uintptr_t)p & 7)) {
+        crc = sw_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (len >= 8) {
+        uint64_t w;
+
+        memcpy(&w, p, 8);
+        w ^= crc;
+        crc = sw_table[7][w & 0xff] ^ sw_table[6][(w >> 8) & 0xff] ^
+              sw_table[5][(w >> 16) & 0xff] ^ sw_table[4][(w >> 24) & 0xff] ^
+              sw_table[3][(w >> 32) & 0xff] ^ sw_table[2][(w >> 40) & 0xff] ^
+              sw_table[1][(w >> 48) & 0xff] ^ sw_table[0][w >> 56];
+        p += 8;
+        len -= 8;
+    }
+#endif
+    while (len--)
+        crc = sw_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t sse42_raw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t c0 = crc;
+    uint64_t w0, w1, w2;
+
+    while (len && ((uintptr_t)p & 7)) {
+        c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+        len--;
+    }
+    while (len >= 3 * CRC_BLOCK) {
+        const unsigned char *end = p + CRC_BLOCK;
+        uint64_t c1 = 0, c2 = 0;
+
+        do {
+            memcpy(&w0, p, 8);
+            memcpy(&w1, p + CRC_BLOCK, 8);
+            memcpy(&w2, p + 2 * CRC_BLOCK, 8);
+            c0 = _mm_crc32_u64(c0, w0);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+            p += 8;
+        } while (p < end);
+        c0 = crc_shift((uint32_t)c0) ^ c1;
+        c0 = crc_shift((uint32_t)c0) ^ c2;
+        p += 2 * CRC_BLOCK;
+        len -= 3 * CRC_BLOCK;
+    }
+    while (len >= 8) {
+        memcpy(&w0, p, 8);
+        c0 = _mm_crc32_u64(c0, w0);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+    return (uint32_t)c0;
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t armv8_raw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint32_t c0 = crc;
+    uint64_t w0, w1, w2;
+
+    while (len && ((uintptr_t)p & 7)) {
+        c0 = __crc32cb(c0, *p++);
+        len--;
+    }
+    while (len >= 3 * CRC_BLOCK) {
+        const unsigned char *end = p + CRC_BLOCK;
+        uint32_t c1 = 0, c2 = 0;
+
+        do {
+            memcpy(&w0, p, 8);
+            memcpy(&w1, p + CRC_BLOCK, 8);
+            memcpy(&w2, p + 2 * CRC_BLOCK, 8);
+            c0 = __crc32cd(c0, w0);
+            c1 = __crc32cd(c1, w1);
+            c2 = __crc32cd(c2, w2);
+            p += 8;
+        } while (p < end);
+        c0 = crc_shift(c0) ^ c1;
+        c0 = crc_shift(c0) ^ c2;
+        p += 2 * CRC_BLOCK;
+        len -= 3 * CRC_BLOCK;
+    }
+    while (len >= 8) {
+        memcpy(&w0, p, 8);
+        c0 = __crc32cd(c0, w0);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        c0 = __crc32cb(c0, *p++);
+    return c0;
+}
+#endif
+
+__attribute__((constructor))
+static void crc32c_init(void)
+{
+    static const unsigned char zeros[CRC_BLOCK];
+    uint32_t basis[32];
+
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+
+        for (int k = 0; k < 8; k++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        sw_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++)
+        for (int k = 1; k < 8; k++)
+            sw_table[k][n] = (sw_table[k - 1][n] >> 8) ^ sw_table[0][sw_table[k - 1][n] & 0xff];
+
+    crc_raw = sw_raw;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc_raw = sse42_raw;
+        crc_impl_name = "sse4.2";
+    }
+#elif defined(__aarch64__) && defined(HWCAP_CRC32)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc_raw = armv8_raw;
+        crc_impl_name = "armv8";
+    }
+#endif
+
+    // Running over zeros is linear in the starting value, so one pass per bit builds the tables
+    for (int i = 0; i < 32; i++)
+        basis[i] = sw_raw(1u << i, zeros, CRC_BLOCK);
+    for (int k = 0; k < 4; k++) {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t v = 0;
+
+            for (int j = 0; j < 8; j++)
+                if (n & (1u << j))
+                    v ^= basis[8 * k + j];
+            shift_table[k][n] = v;
+        }
+    }
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    return ~crc_raw(~crc, (const unsigned char *)buf, len);
+}
+
+const char *crc32c_impl(void)
+{
+    return crc_impl_name;
+}
@@ -0,0 +1,24 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * CRC32C (Castagnoli), as used by iSCSI, ext4 and most log formats.
+ *
+ * Runs on the SSE4.2 crc32 instruction on x86-64 and the ARMv8 CRC32
+ * extension on aarch64 when the CPU has them, slice-by-8 tables otherwise.
+ * The instruction has a latency of three cycles but issues every cycle, so
+ * buffers of a few blocks are split into three independent streams whose
+ * CRCs are combined at the end.
+ *
+ * crc32c(0, buf, len) gives the standard checksum; passing a previous
+ * result continues it over the next piece of the same message.
+ */
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+// Which implementation crc32c() dispatches to: "sse4.2", "armv8" or "sw"
+const char *crc32c_impl(void);
+
+#endif // CRC32C_H
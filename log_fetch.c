@@ -0,0 +1,195 @@
+#include "log_fetch.h"
+#include "seg_store.h"
+#include "crc32c.h"
+#include "spin_wait.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Same framing as the segment files
+static uint64_t fetch_rec_size(uint32_t len)
+{
+    return (sizeof(struct seg_rec_hdr) + len + 7) & ~(uint64_t)7;
+}
+
+/* Small enough to always fit in an empty socket buffer. */
+int log_fetch_reply_send(int sock, const struct log_fetch_reply *reply)
+{
+    struct log_fetch_reply wire;
+
+    memset(&wire, 0, sizeof(wire));
+    wire.status = htonl(reply->status);
+    wire.rkey = htonl(reply->rkey);
+    wire.offset = (int64_t)htonll((uint64_t)reply->offset);
+    wire.bytes = htonll(reply->bytes);
+    wire.first_lsn = htonll(reply->first_lsn);
+    wire.last_lsn = htonll(reply->last_lsn);
+    wire.more = htonl(reply->more);
+    return write(sock, &wire, sizeof(wire)) != sizeof(wire);
+}
+
+static int fetch_reply_recv(int sock, struct log_fetch_reply *reply)
+{
+    struct log_fetch_reply wire;
+    size_t got = 0;
+
+    while (got < sizeof(wire)) {
+        ssize_t n = read(sock, (char *)&wire + got, sizeof(wire) - got);
+
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            fprintf(stderr, "failed to read the fetch reply\n");
+            return 1;
+        }
+        got += n;
+    }
+    reply->status = ntohl(wire.status);
+    reply->rkey = ntohl(wire.rkey);
+    reply->offset = (int64_t)ntohll((uint64_t)wire.offset);
+    reply->bytes = ntohll(wire.bytes);
+    reply->first_lsn = ntohll(wire.first_lsn);
+    reply->last_lsn = ntohll(wire.last_lsn);
+    reply->more = ntohl(wire.more);
+    return 0;
+}
+
+static void stage_copy(const char *stage, uint64_t size, uint64_t pos, void *dst, uint64_t n)
+{
+    uint64_t off = pos % size;
+    uint64_t first = (n < size - off) ? n : size - off;
+
+    memcpy(dst, stage + off, first);
+    if (n > first)
+        memcpy((char *)dst + first, stage, n - first);
+}
+
+/* Fetch the range the logstore put in its window and replay it record by
+ * record. Returns 0 once every record has been replayed, 1 on a failed
+ * read, a record that fails its checks or a replay error. */
+int log_fetch(struct resources *res, log_replay_fn replay, void *arg, struct log_fetch_stats *st)
+{
+    struct log_fetch_reply reply;
+    uint64_t stage_size = res->buf_size / FETCH_READ_SIZE * FETCH_READ_SIZE;
+    uint64_t depth = res->params.rd_atomic ? res->params.rd_atomic : 1;
+    uint64_t base = res->done_cookie;
+    uint64_t window, posted = 0, parsed = 0, next_lsn;
+    struct spin_wait w;
+    char *wrapped = NULL;
+    int rc = 0;
+
+    memset(st, 0, sizeof(*st));
+    if (fetch_reply_recv(res->sock, &reply))
+        return 1;
+    st->status = reply.status;
+    // A busy window frees up once its connection closes, that is for the caller to retry
+    if (reply.status != FETCH_OK) {
+        if (reply.status != FETCH_BUSY)
+            fprintf(stderr, "Logstore does not serve log %u: %s\n", res->fetch_log,
+                    reply.status == FETCH_NO_LOG ? "no such log" : "failed to load it");
+        return 1;
+    }
+    st->more = reply.more;
+    if (!reply.bytes)
+        return 0;
+
+    // Reads never straddle the end of the staging ring, and at least two are kept in flight
+    if (stage_size < 2 * FETCH_READ_SIZE) {
+        fprintf(stderr, "%u byte buffer is too small to stage %d byte reads\n", res->buf_size, FETCH_READ_SIZE);
+        return 1;
+    }
+    if (depth > stage_size / FETCH_READ_SIZE)
+        depth = stage_size / FETCH_READ_SIZE;
+    if (depth > res->sq_depth)
+        depth = res->sq_depth;
+
+    window = res->remote_props.addr + reply.offset;
+    next_lsn = reply.first_lsn;
+
+    spin_wait_init(&w, SPIN_WAIT_SPINS);
+    while (parsed < reply.bytes) {
+        uint64_t landed = __atomic_load_n(&res->done_cookie, __ATOMIC_ACQUIRE) - base;
+        int progress = 0;
+
+        // Keep the pipe full; a read may reuse staging space once the records in it are replayed
+        while (posted < reply.bytes && posted - landed < depth * FETCH_READ_SIZE) {
+            uint64_t len = reply.bytes - posted < FETCH_READ_SIZE ? reply.bytes - posted : FETCH_READ_SIZE;
+
+            if (posted + len - parsed > stage_size)
+                break;
+            if (rdma_read_post(res, posted % stage_size, window + posted, reply.rkey, len, base + posted + len)) {
+                rc = 1;
+                goto log_fetch_exit;
+            }
+            posted += len;
+            st->reads++;
+        }
+
+        while (parsed + sizeof(struct seg_rec_hdr) <= landed) {
+            struct seg_rec_hdr hdr;
+            const char *payload;
+            uint64_t rec;
+
+            stage_copy(res->buf, stage_size, parsed, &hdr, sizeof(hdr));
+            rec = fetch_rec_size(hdr.len);
+            if (hdr.lsn != next_lsn || rec > stage_size || parsed + rec > reply.bytes) {
+                fprintf(stderr, "Fetched record at offset %lu is not LSN %lu\n", (unsigned long)parsed,
+                        (unsigned long)next_lsn);
+                rc = 1;
+                goto log_fetch_exit;
+            }
+            if (parsed + rec > landed)
+                break;
+
+            if (parsed % stage_size + rec <= stage_size) {
+                payload = res->buf + parsed % stage_size + sizeof(hdr);
+            } else {
+                // Wrapped around the staging ring, replay from a contiguous copy
+                if (!wrapped && !(wrapped = (char *)malloc(stage_size))) {
+                    rc = 1;
+                    goto log_fetch_exit;
+                }
+                stage_copy(res->buf, stage_size, parsed + sizeof(hdr), wrapped, hdr.len);
+                payload = wrapped;
+            }
+            if (crc32c(0, payload, hdr.len) != hdr.crc) {
+                fprintf(stderr, "Fetched record LSN %lu failed its CRC check\n", (unsigned long)hdr.lsn);
+                rc = 1;
+                goto log_fetch_exit;
+            }
+            if (replay(arg, hdr.lsn, payload, hdr.len)) {
+                rc = 1;
+                goto log_fetch_exit;
+            }
+            if (!st->first_lsn)
+                st->first_lsn = hdr.lsn;
+            st->last_lsn = hdr.lsn;
+            st->records++;
+            next_lsn++;
+            parsed += rec;
+            progress = 1;
+        }
+        if (parsed == reply.bytes)
+            break;
+
+        if (rdma_reap(res) || res->failed_status != IBV_WC_SUCCESS) {
+            rc = 1;
+            goto log_fetch_exit;
+        }
+        if (progress) {
+            spin_wait_reset(&w);
+        } else if (spin_wait(&w)) {
+            fprintf(stderr, "Fetch stalled at %lu of %lu bytes\n", (unsigned long)landed,
+                    (unsigned long)reply.bytes);
+            rc = 1;
+            goto log_fetch_exit;
+        }
+    }
+    st->bytes = parsed;
+
+log_fetch_exit:
+    free(wrapped);
+    return rc;
+}
@@ -0,0 +1,68 @@
+#ifndef LOG_FETCH_H
+#define LOG_FETCH_H
+
+#include <stdint.h>
+#include "rdma.h"
+
+/*
+ * Reading a stored log back with RDMA READs, e.g. to replay its tail after
+ * a compute node restart.
+ *
+ * A connection whose handshake carries a fetch_lsn asks the logstore for
+ * log fetch_log (the log_id its writer sent, and the log-<id> directory it
+ * was persisted to) from that LSN on. The logstore loads as much of it as fits into its fetch window,
+ * a region at the head of its registered pool, and once the QPs are up
+ * answers with a log_fetch_reply saying where the window is and what it
+ * holds. The logstore CPU is then out of the picture.
+ *
+ * log_fetch() pulls the window with FETCH_READ_SIZE READs, keeping as many
+ * in flight as the negotiated max_rd_atomic allows, through the local
+ * buffer used as a staging ring. RC completes READs in order, so
+ * done_cookie tells how much of the window has landed. Each record is
+ * checked against the LSN sequence and its CRC32C and handed to the
+ * replay callback as soon as the READ carrying its end completes, while
+ * the later ones are still on the wire. The window is in segment file
+ * format: seg_rec_hdr, then the payload padded to 8.
+ *
+ * A log larger than the window comes back in ranges: the reply says there
+ * is more, and the caller reconnects from last_lsn + 1. The window serves
+ * one connection at a time.
+ */
+
+#define FETCH_READ_SIZE (64 * 1024) // Bytes per RDMA READ
+
+enum fetch_status {
+    FETCH_OK,
+    FETCH_NO_LOG, // Not persisting, or no such log
+    FETCH_BUSY,   // The window is serving another connection
+    FETCH_FAILED,
+};
+
+// Sent by the logstore after the ready bytes, network byte order
+struct log_fetch_reply {
+    uint32_t status; // enum fetch_status
+    uint32_t rkey;
+    int64_t offset;  // Window address relative to the region address in the handshake
+    uint64_t bytes;
+    uint64_t first_lsn;
+    uint64_t last_lsn;
+    uint32_t more;   // The log goes on past last_lsn
+    uint32_t pad;
+} __attribute__((packed));
+
+typedef int (*log_replay_fn)(void *arg, uint64_t lsn, const void *payload, uint32_t len);
+
+struct log_fetch_stats {
+    uint64_t first_lsn;
+    uint64_t last_lsn;
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t reads;
+    uint32_t status; // enum fetch_status from the reply
+    int more;
+};
+
+int log_fetch_reply_send(int sock, const struct log_fetch_reply *reply);
+int log_fetch(struct resources *res, log_replay_fn replay, void *arg, struct log_fetch_stats *st);
+
+#endif // LOG_FETCH_H
@@ -0,0 +1,133 @@
+#include "log_pack.h"
+#include "lz4_block.h"
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+
+static const char *const codec_names[] = { "none", "lz4" };
+
+int log_codec_parse(const char *name, int *codec)
+{
+    for (int i = 0; i < (int)(sizeof(codec_names) / sizeof(codec_names[0])); i++) {
+        if (!strcmp(name, codec_names[i])) {
+            *codec = i;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Unknown codec %s, expected none or lz4\n", name);
+    return 1;
+}
+
+const char *log_codec_name(int codec)
+{
+    return codec >= 0 && codec < (int)(sizeof(codec_names) / sizeof(codec_names[0])) ? codec_names[codec] : "?";
+}
+
+void log_pack_init(struct log_pack *pack, int codec, int max_recs)
+{
+    memset(pack, 0, offsetof(struct log_pack, raw));
+    pack->codec = codec;
+    pack->max_recs = max_recs > 0 ? max_recs : 1;
+}
+
+/* Stage a record. Returns 0 on success, 1 if the batch has no room left
+ * for it (seal first) and -1 if it is too large to ever go in a batch. */
+int log_pack_add(struct log_pack *pack, const void *payload, uint32_t len)
+{
+    if (len > LOG_PACK_MAX_RAW - sizeof(uint32_t))
+        return -1;
+    if (pack->raw_len + sizeof(uint32_t) + len > LOG_PACK_MAX_RAW)
+        return 1;
+
+    memcpy(pack->raw + pack->raw_len, &len, sizeof(len));
+    memcpy(pack->raw + pack->raw_len + sizeof(len), payload, len);
+    pack->raw_len += sizeof(len) + len;
+    pack->nrecs++;
+    return 0;
+}
+
+/* Compress the staged records into pack->out and start a new batch.
+ * Returns the size of the ring payload now in pack->out and how many
+ * records it holds, 0 if nothing was staged. */
+uint32_t log_pack_seal(struct log_pack *pack, uint32_t *nrecs)
+{
+    struct ring_batch hdr;
+    uint32_t body = 0;
+
+    *nrecs = pack->nrecs;
+    if (!pack->nrecs)
+        return 0;
+
+    hdr.raw_len = pack->raw_len;
+    hdr.codec = LOG_CODEC_NONE;
+    hdr.pad = 0;
+    // Only worth it if it shrinks
+    if (pack->codec == LOG_CODEC_LZ4)
+        body = lz4_compress(pack->raw, pack->raw_len, pack->out + sizeof(hdr), pack->raw_len - 1);
+    if (body) {
+        hdr.codec = LOG_CODEC_LZ4;
+    } else {
+        memcpy(pack->out + sizeof(hdr), pack->raw, pack->raw_len);
+        body = pack->raw_len;
+    }
+    memcpy(pack->out, &hdr, sizeof(hdr));
+
+    pack->batches++;
+    pack->raw_bytes += pack->raw_len;
+    pack->packed_bytes += body;
+    pack->nrecs = 0;
+    pack->raw_len = 0;
+    return sizeof(hdr) + body;
+}
+
+/* Expand a RING_REC_BATCH payload for log_unpack_next. A compressed body
+ * goes into scratch, an uncompressed one is walked in place, so batch must
+ * stay put until the walk is over. Returns 0, or -1 if the batch is
+ * malformed or expands past cap bytes. */
+int log_unpack_open(struct log_unpack *it, const void *batch, uint32_t len, void *scratch, uint32_t cap)
+{
+    struct ring_batch hdr;
+    const char *body = (const char *)batch + sizeof(hdr);
+    uint32_t body_len;
+
+    if (len < sizeof(hdr)) {
+        fprintf(stderr, "log batch of %u bytes is too short\n", len);
+        return -1;
+    }
+    memcpy(&hdr, batch, sizeof(hdr));
+    body_len = len - sizeof(hdr);
+
+    switch (hdr.codec) {
+    case LOG_CODEC_NONE:
+        if (body_len != hdr.raw_len)
+            break;
+        it->p = body;
+        it->end = body + body_len;
+        return 0;
+    case LOG_CODEC_LZ4:
+        if (hdr.raw_len > cap || lz4_decompress(body, body_len, scratch, hdr.raw_len) != (int)hdr.raw_len)
+            break;
+        it->p = (const char *)scratch;
+        it->end = (const char *)scratch + hdr.raw_len;
+        return 0;
+    }
+    fprintf(stderr, "log batch of %u bytes does not expand to %u with codec %s\n", body_len, hdr.raw_len,
+            log_codec_name(hdr.codec));
+    return -1;
+}
+
+/* Returns 1 with the next record of the batch, 0 past the last one and -1
+ * if a length runs past the end. */
+int log_unpack_next(struct log_unpack *it, const void **payload, uint32_t *len)
+{
+    if (it->p == it->end)
+        return 0;
+    if ((size_t)(it->end - it->p) < sizeof(*len))
+        return -1;
+    memcpy(len, it->p, sizeof(*len));
+    if (*len > (size_t)(it->end - it->p) - sizeof(*len))
+        return -1;
+    *payload = it->p + sizeof(*len);
+    it->p += sizeof(*len) + *len;
+    return 1;
+}
@@ -0,0 +1,71 @@
+#ifndef LOG_PACK_H
+#define LOG_PACK_H
+
+#include <stdint.h>
+
+/*
+ * Compressed log batches.
+ *
+ * A producer that packs stages the records of a batch in a log_pack
+ * instead of framing each in the ring, then seals the whole batch into a
+ * single ring record of type RING_REC_BATCH, whose header count says how
+ * many LSNs it covers (from its own on). Its payload is
+ *
+ *   [ ring_batch | body ]
+ *
+ * where the body, once expanded to raw_len bytes with the given codec, is
+ * the records back to back as [ u32 length | payload ], unpadded. A batch
+ * that does not shrink goes out with LOG_CODEC_NONE, the body as is. The
+ * ring's CRC covers the compressed bytes, so a torn batch is caught before
+ * anything is expanded.
+ *
+ * Compression only pays where the wire is the bottleneck (WAN-stretched
+ * RoCE, replication fan-out): it trades producer CPU for bytes, and the
+ * consumer expands a batch only when it takes it. Which connections pack
+ * is up to the producer, as long as the consumer offered CM_FLAG_PACK.
+ */
+
+#define LOG_PACK_MAX_RAW (32 * 1024) // Raw bytes per batch; larger records go out on their own
+
+enum log_codec {
+    LOG_CODEC_NONE,
+    LOG_CODEC_LZ4,
+};
+
+struct ring_batch {
+    uint32_t raw_len; // Body size once expanded
+    uint16_t codec;   // enum log_codec
+    uint16_t pad;
+};
+
+struct log_pack {
+    int codec;
+    uint32_t max_recs;  // Records per batch
+    uint32_t nrecs;     // Staged so far
+    uint32_t raw_len;
+    uint64_t batches;   // Totals over all sealed batches
+    uint64_t raw_bytes;
+    uint64_t packed_bytes;
+    char raw[LOG_PACK_MAX_RAW];
+    char out[sizeof(struct ring_batch) + LOG_PACK_MAX_RAW];
+};
+
+// Walks the records of a batch taken from the ring
+struct log_unpack {
+    const char *p;
+    const char *end;
+};
+
+int log_codec_parse(const char *name, int *codec);
+const char *log_codec_name(int codec);
+
+// Producer side
+void log_pack_init(struct log_pack *pack, int codec, int max_recs);
+int log_pack_add(struct log_pack *pack, const void *payload, uint32_t len);
+uint32_t log_pack_seal(struct log_pack *pack, uint32_t *nrecs);
+
+// Consumer side
+int log_unpack_open(struct log_unpack *it, const void *batch, uint32_t len, void *scratch, uint32_t cap);
+int log_unpack_next(struct log_unpack *it, const void **payload, uint32_t *len);
+
+#endif // LOG_PACK_H
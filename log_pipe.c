@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+#include "log_pipe.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+
+int spsc_push(struct spsc_queue *q, void *item)
+{
+    uint64_t tail = q->tail;
+
+    if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == PIPE_QUEUE_DEPTH)
+        return 1;
+    q->slots[tail & (PIPE_QUEUE_DEPTH - 1)] = item;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void *spsc_pop(struct spsc_queue *q)
+{
+    uint64_t head = q->head;
+    void *item;
+
+    if (head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    item = q->slots[head & (PIPE_QUEUE_DEPTH - 1)];
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+int log_pipe_pin(int n)
+{
+    cpu_set_t allowed, one;
+    int count, cpu;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || !(count = CPU_COUNT(&allowed)))
+        return 1;
+    n %= count;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && n-- == 0)
+            break;
+    }
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(one), &one) != 0) {
+        fprintf(stderr, "Failed to pin thread to CPU %d\n", cpu);
+        return 1;
+    }
+    return 0;
+}
+
+static void *pipe_worker_thread(void *arg)
+{
+    struct pipe_worker *w = (struct pipe_worker *)arg;
+    struct log_pipe *pipe = w->pipe;
+    char name[16];
+    int idle = 0;
+
+    snprintf(name, sizeof(name), "worker-%d", w->index);
+    stats_thread(name);
+    if (pipe->first_cpu >= 0)
+        log_pipe_pin(pipe->first_cpu + w->index);
+
+    // Whatever was submitted before stop is still worked off
+    for (;;) {
+        int found = 0;
+
+        for (int f = 0; f < pipe->nfeeds; f++) {
+            struct spsc_queue *q = &pipe->queues[f * pipe->nworkers + w->index];
+            void *item;
+
+            while ((item = spsc_pop(q))) {
+                pipe->work(item);
+                w->items++;
+                STATS_ADD(pipe_items, 1);
+                found = 1;
+            }
+        }
+        if (found) {
+            idle = 0;
+            continue;
+        }
+        if (__atomic_load_n(&pipe->stop, __ATOMIC_ACQUIRE))
+            break;
+        if (++idle > PIPE_IDLE_SPINS)
+            usleep(PIPE_IDLE_US);
+    }
+    return NULL;
+}
+
+/* Start nworkers threads working off the queues of nfeeds pollers. */
+int log_pipe_start(struct log_pipe *pipe, int nfeeds, int nworkers, int first_cpu, void (*work)(void *item))
+{
+    memset(pipe, 0, sizeof(*pipe));
+    if (nfeeds < 1 || nfeeds > PIPE_MAX_FEEDS || nworkers < 1 || nworkers > PIPE_MAX_WORKERS) {
+        fprintf(stderr, "A pipeline takes 1 to %d pollers and 1 to %d workers\n", PIPE_MAX_FEEDS, PIPE_MAX_WORKERS);
+        return 1;
+    }
+    pipe->nfeeds = nfeeds;
+    pipe->nworkers = nworkers;
+    pipe->first_cpu = first_cpu;
+    pipe->work = work;
+    pipe->queues = (struct spsc_queue *)aligned_alloc(64, sizeof(*pipe->queues) * nfeeds * nworkers);
+    if (!pipe->queues)
+        return 1;
+    memset(pipe->queues, 0, sizeof(*pipe->queues) * nfeeds * nworkers);
+
+    for (int i = 0; i < nworkers; i++) {
+        pipe->workers[i].pipe = pipe;
+        pipe->workers[i].index = i;
+        if (pthread_create(&pipe->workers[i].thread, NULL, pipe_worker_thread, &pipe->workers[i]) != 0) {
+            fprintf(stderr, "Failed to start worker thread %d\n", i);
+            pipe->nworkers = i;
+            log_pipe_stop(pipe);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Queue item for some worker; 1 if all of the feed's queues are full. */
+int log_pipe_submit(struct log_pipe *pipe, int feed, void *item)
+{
+    struct spsc_queue *queues = &pipe->queues[feed * pipe->nworkers];
+    int w = pipe->next[feed];
+
+    for (int tries = 0; tries < pipe->nworkers; tries++) {
+        if (!spsc_push(&queues[w], item)) {
+            pipe->next[feed] = (w + 1) % pipe->nworkers;
+            return 0;
+        }
+        w = (w + 1) % pipe->nworkers;
+    }
+    return 1;
+}
+
+/* Stop the workers once they have worked off their queues. */
+void log_pipe_stop(struct log_pipe *pipe)
+{
+    __atomic_store_n(&pipe->stop, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < pipe->nworkers; i++)
+        pthread_join(pipe->workers[i].thread, NULL);
+    free(pipe->queues);
+    pipe->queues = NULL;
+}
@@ -0,0 +1,70 @@
+#ifndef LOG_PIPE_H
+#define LOG_PIPE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Worker pool behind the logstore's pollers (consumer side).
+ *
+ * A poller that only detects arrivals can keep up with the wire; checking
+ * CRCs, expanding batches and checksumming records for the segment store
+ * can't, not on one core. With a pipeline each poller hands every record
+ * it finds to a worker through a bounded single-producer/single-consumer
+ * queue, one per poller and worker, so no queue is ever contended: the
+ * poller is the only one pushing and the worker the only one popping, and
+ * each index sits on its own cache line. Workers take from all their
+ * queues in turn and call work() on each item, which reports back through
+ * the item itself; the poller retires items in order from there.
+ *
+ * log_pipe_submit() tries the workers round-robin starting after the last
+ * one used and fails once every queue of the poller is full, which is the
+ * backpressure: the poller stops taking records until workers catch up.
+ * Idle workers spin for a while, then sleep PIPE_IDLE_US between polls.
+ *
+ * log_pipe_pin() binds the calling thread to the n-th CPU it is allowed
+ * on (wrapping around), so pollers and workers each get a core of their
+ * own as long as there are enough.
+ */
+
+#define PIPE_MAX_WORKERS 64
+#define PIPE_MAX_FEEDS 64
+#define PIPE_QUEUE_DEPTH 256 // Items per queue, a power of two
+#define PIPE_IDLE_SPINS 1000 // Empty sweeps before a worker starts sleeping
+#define PIPE_IDLE_US 20
+
+struct spsc_queue {
+    uint64_t head __attribute__((aligned(64))); // Next to pop, consumer only
+    uint64_t tail __attribute__((aligned(64))); // Next to push, producer only
+    void *slots[PIPE_QUEUE_DEPTH] __attribute__((aligned(64)));
+};
+
+struct log_pipe;
+
+struct pipe_worker {
+    struct log_pipe *pipe;
+    pthread_t thread;
+    int index;
+    uint64_t items;
+};
+
+struct log_pipe {
+    int nfeeds;
+    int nworkers;
+    int first_cpu;                   // log_pipe_pin() index of worker 0, -1 to leave workers unpinned
+    void (*work)(void *item);
+    struct spsc_queue *queues;       // nfeeds x nworkers, feed-major
+    int next[PIPE_MAX_FEEDS];        // Worker each feed tries first, feed only
+    struct pipe_worker workers[PIPE_MAX_WORKERS];
+    int stop;
+};
+
+int spsc_push(struct spsc_queue *q, void *item);
+void *spsc_pop(struct spsc_queue *q);
+
+int log_pipe_start(struct log_pipe *pipe, int nfeeds, int nworkers, int first_cpu, void (*work)(void *item));
+int log_pipe_submit(struct log_pipe *pipe, int feed, void *item);
+void log_pipe_stop(struct log_pipe *pipe);
+int log_pipe_pin(int n);
+
+#endif // LOG_PIPE_H
@@ -0,0 +1,323 @@
+#include "log_quorum.h"
+#include "spin_wait.h"
+#include <stdio.h>
+#include <string.h>
+
+static int replica_replay(struct resources *res, void *arg)
+{
+    return log_ring_replay(res, &((struct log_replica *)arg)->ring);
+}
+
+/* Fail a replica over to its spare QPs and replay what it had not taken. */
+static int replica_recover(struct log_replica *r)
+{
+    fprintf(stderr, "Logstore %s: %s at cookie %lu, failing over to spare QPs\n", r->name,
+            ibv_wc_status_str(r->res.failed_status), (unsigned long)r->res.failed_cookie);
+    if (rdma_reconnect(&r->res, replica_replay, r) != 0)
+        return 1;
+    r->failovers++;
+    return 0;
+}
+
+/* Take a replica out of the set and close its connection, unless its QPs
+ * failed and it can fail over instead. Returns 1 if the rest can no longer
+ * form a quorum; check r->live to tell whether the replica stayed. */
+static int replica_drop(struct log_quorum *q, struct log_replica *r, const char *why)
+{
+    if (r->res.failed_status != IBV_WC_SUCCESS && r->res.spare_qp && replica_recover(r) == 0)
+        return 0;
+
+    if (r->res.failed_status != IBV_WC_SUCCESS)
+        fprintf(stderr, "Dropping logstore %s: %s (landed up to %lu, %s)\n", r->name, why,
+                (unsigned long)r->res.done_cookie, ibv_wc_status_str(r->res.failed_status));
+    else
+        fprintf(stderr, "Dropping logstore %s: %s\n", r->name, why);
+
+    r->live = 0;
+    q->live--;
+    resources_destroy(&r->res);
+    if (q->live < q->quorum) {
+        fprintf(stderr, "%d of %d logstores left, a quorum needs %d\n", q->live, q->n, q->quorum);
+        return 1;
+    }
+    return 0;
+}
+
+/* MR cache quiesce hook: writes queued in the ring may gather from the MR
+ * about to go, so post them, then wait for everything posted. */
+static int replica_quiesce(void *arg)
+{
+    struct log_replica *r = (struct log_replica *)arg;
+
+    if (!r->live)
+        return 0;
+    return log_ring_flush(&r->res, &r->ring) || rdma_drain(&r->res);
+}
+
+/* Starts out with every replica live. The rings must all be fresh, which
+ * keeps their positions and LSNs in step from the first record on. */
+int log_quorum_init(struct log_quorum *q, struct log_replica *rep, int n, int quorum)
+{
+    if (n < 1 || n > QUORUM_MAX_REPLICAS || quorum < 1 || quorum > n) {
+        fprintf(stderr, "quorum of %d out of %d logstores is not possible\n", quorum, n);
+        return 1;
+    }
+    for (int i = 1; i < n; i++) {
+        if (rep[i].ring.size != rep[0].ring.size || rep[i].ring.tail != rep[0].ring.tail) {
+            fprintf(stderr, "log ring of %s does not match %s\n", rep[i].name, rep[0].name);
+            return 1;
+        }
+    }
+
+    memset(q, 0, sizeof(*q));
+    q->rep = rep;
+    q->n = n;
+    q->quorum = quorum;
+    for (int i = 0; i < n; i++) {
+        struct mr_cache *c = rdma_mr_cache(&rep[i].res);
+
+        if (!c)
+            return 1;
+        mr_cache_set_quiesce(c, replica_quiesce, &rep[i]);
+        rep[i].live = 1;
+    }
+    q->live = n;
+    return 0;
+}
+
+/* Reserve the next record on one replica. A ring that is still full after
+ * pulling its head back is waited for only while the quorum needs it, and
+ * only as long as its head moves within SPIN_WAIT_TIMEOUT_MS. Returns 0
+ * with *pos set, 1 if the replica was dropped instead and -1 on failure. */
+static int replica_reserve(struct log_quorum *q, struct log_replica *r, uint32_t len, uint32_t nlsns, uint64_t *pos)
+{
+    struct spin_wait w;
+    uint64_t lsn, head = r->ring.head;
+    int synced = 0;
+    int rc;
+
+    spin_wait_init(&w, RING_SPACE_SPINS);
+    while ((rc = log_ring_reserve_n(&r->ring, len, nlsns, pos, &lsn)) == 1) {
+        const char *why = "failed to post";
+
+        if (synced && q->live > q->quorum)
+            why = "fell a full ring behind";
+        else if (synced && r->ring.head == head && spin_wait(&w))
+            why = "ring stayed full, its consumer is stuck";
+        // Queued records can't be consumed until they are posted
+        else if (!log_ring_flush(&r->res, &r->ring) && !log_ring_sync_head(&r->res, &r->ring)) {
+            if (r->ring.head != head)
+                spin_wait_reset(&w);
+            head = r->ring.head;
+            synced = 1;
+            continue;
+        }
+        if (replica_drop(q, r, why))
+            return -1;
+        if (!r->live)
+            return 1;
+        // Failed over, the replay brought head up to date
+        synced = 0;
+        head = r->ring.head;
+        spin_wait_reset(&w);
+    }
+    if (rc < 0) {
+        fprintf(stderr, "record of %u bytes does not fit in a %lu byte ring\n", len, (unsigned long)r->ring.size);
+        return -1;
+    }
+    return 0;
+}
+
+/* Frame one ring record as LSN lsn, or a batch of count from lsn on, on
+ * every replica left. The first replica frames it, the others get a copy
+ * of the framed bytes. */
+static int quorum_put(struct log_quorum *q, const void *payload, uint32_t len, uint32_t flag, uint32_t count,
+                      uint64_t lsn)
+{
+    struct log_replica *src = NULL;
+    uint64_t rec = log_ring_rec_size(len);
+    uint64_t pos = 0;
+
+    for (int i = 0; i < q->n; i++) {
+        if (q->rep[i].live && replica_reserve(q, &q->rep[i], len, count ? count : 1, &pos) < 0)
+            return 1;
+    }
+    if (q->live < q->quorum)
+        return 1;
+
+    for (int i = 0; i < q->n; i++) {
+        struct log_replica *r = &q->rep[i];
+
+        if (!r->live)
+            continue;
+        if (src)
+            log_ring_clone(&r->ring, &src->ring, pos, rec);
+        else if (count)
+            log_ring_fill_batch(&r->ring, pos, lsn, count, payload, len);
+        else
+            log_ring_fill(&r->ring, pos, lsn, payload, len, flag);
+        src = r;
+        if (log_ring_post(&r->res, &r->ring, pos, rec) && replica_drop(q, r, "failed to post"))
+            return 1;
+    }
+    return 0;
+}
+
+// Send what the pack has staged, which holds the LSNs up to q->lsn
+static int quorum_seal(struct log_quorum *q)
+{
+    uint32_t nrecs;
+    uint32_t len = log_pack_seal(q->pack, &nrecs);
+
+    if (!len)
+        return 0;
+    return quorum_put(q, q->pack->out, len, RING_REC_BATCH, nrecs, q->lsn - nrecs + 1);
+}
+
+/* Append one record to every replica left, or stage it in the pack. A
+ * record too large for a batch, or one that is not a plain record, goes
+ * out on its own after the batch staged ahead of it. */
+int log_quorum_append(struct log_quorum *q, const void *payload, uint32_t len, uint32_t flag)
+{
+    if (q->pack && flag == RING_REC_VALID) {
+        int rc = log_pack_add(q->pack, payload, len);
+
+        if (rc > 0) {
+            if (quorum_seal(q))
+                return 1;
+            rc = log_pack_add(q->pack, payload, len);
+        }
+        if (rc == 0) {
+            q->lsn++;
+            return q->pack->nrecs >= q->pack->max_recs ? quorum_seal(q) : 0;
+        }
+    }
+    if (q->pack && quorum_seal(q))
+        return 1;
+
+    if (quorum_put(q, payload, len, flag, 0, q->lsn + 1))
+        return 1;
+    q->lsn++;
+    return 0;
+}
+
+/* Append one record whose payload is gathered from caller buffers, see
+ * log_ring_postv. Each replica gathers it on its own, through its own
+ * device's MR cache. Packing copies anyway and does not take these. */
+int log_quorum_appendv(struct log_quorum *q, const struct iovec *iov, int iovcnt)
+{
+    uint64_t len = log_ring_iov_len(iov, iovcnt);
+    uint64_t pos = 0;
+
+    if (q->pack) {
+        fprintf(stderr, "packed batches can't gather Xlogs from caller buffers\n");
+        return 1;
+    }
+    if (len > UINT32_MAX) {
+        fprintf(stderr, "record of %lu bytes is too large\n", (unsigned long)len);
+        return 1;
+    }
+    for (int i = 0; i < q->n; i++) {
+        if (q->rep[i].live && replica_reserve(q, &q->rep[i], (uint32_t)len, 1, &pos) < 0)
+            return 1;
+    }
+    if (q->live < q->quorum)
+        return 1;
+
+    for (int i = 0; i < q->n; i++) {
+        struct log_replica *r = &q->rep[i];
+
+        if (r->live && log_ring_postv(&r->res, &r->ring, pos, q->lsn + 1, iov, iovcnt, RING_REC_VALID) &&
+            replica_drop(q, r, "failed to post"))
+            return 1;
+    }
+    q->lsn++;
+    return 0;
+}
+
+int log_quorum_flush(struct log_quorum *q)
+{
+    if (q->pack && quorum_seal(q))
+        return 1;
+    for (int i = 0; i < q->n; i++) {
+        struct log_replica *r = &q->rep[i];
+
+        if (r->live && log_ring_flush(&r->res, &r->ring) && replica_drop(q, r, "failed to post"))
+            return 1;
+    }
+    return 0;
+}
+
+/* Highest LSN that at least `quorum` live replicas have received, or made
+ * durable: the quorum-th largest of their watermarks. */
+uint64_t log_quorum_lsn(const struct log_quorum *q, int durable)
+{
+    uint64_t marks[QUORUM_MAX_REPLICAS];
+    int n = 0;
+
+    for (int i = 0; i < q->n; i++) {
+        const struct ring_ctrl *ctrl = q->rep[i].ring.ctrl;
+        uint64_t mark;
+        int j;
+
+        if (!q->rep[i].live)
+            continue;
+        mark = __atomic_load_n(durable ? &ctrl->durable_lsn : &ctrl->received_lsn, __ATOMIC_ACQUIRE);
+        // Insertion sort, largest first
+        for (j = n++; j > 0 && marks[j - 1] < mark; j--)
+            marks[j] = marks[j - 1];
+        marks[j] = mark;
+    }
+    return n >= q->quorum ? marks[q->quorum - 1] : 0;
+}
+
+/* Wait until a quorum reports lsn received, or durable with `durable`.
+ * Queued records are posted first. Replicas whose writes fail meanwhile
+ * are dropped; the wait fails once no quorum is left. */
+int log_quorum_wait(struct log_quorum *q, uint64_t lsn, int durable)
+{
+    struct spin_wait w;
+
+    if (log_quorum_flush(q))
+        return 1;
+
+    spin_wait_init(&w, SPIN_WAIT_SPINS);
+    while (log_quorum_lsn(q, durable) < lsn) {
+        for (int i = 0; i < q->n; i++) {
+            struct log_replica *r = &q->rep[i];
+
+            if (r->live && (rdma_reap(&r->res) || r->res.failed_status != IBV_WC_SUCCESS) &&
+                replica_drop(q, r, "write failed"))
+                return 1;
+        }
+        if (spin_wait(&w)) {
+            fprintf(stderr, "LSN %lu not %s on %d of %d logstores after %d ms, quorum is at %lu\n",
+                    (unsigned long)lsn, durable ? "durable" : "received", q->quorum, q->live,
+                    SPIN_WAIT_TIMEOUT_MS, (unsigned long)log_quorum_lsn(q, durable));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* End the stream on every replica left, wait for the writes to land and
+ * close the connections. */
+int log_quorum_close(struct log_quorum *q)
+{
+    int rc = log_quorum_append(q, NULL, 0, RING_REC_EOS) || log_quorum_flush(q);
+
+    for (int i = 0; i < q->n; i++) {
+        struct log_replica *r = &q->rep[i];
+
+        if (!r->live)
+            continue;
+        if (rdma_drain(&r->res) != 0) {
+            fprintf(stderr, "End of stream did not reach logstore %s\n", r->name);
+            rc = 1;
+        }
+        r->live = 0;
+        rc |= resources_destroy(&r->res);
+    }
+    q->live = 0;
+    return rc;
+}
@@ -0,0 +1,65 @@
+#ifndef LOG_QUORUM_H
+#define LOG_QUORUM_H
+
+#include <stdint.h>
+#include "rdma.h"
+#include "log_ring.h"
+#include "log_pack.h"
+
+/*
+ * Quorum replication of one log to several logstores (compute node side).
+ *
+ * Every replica has its own connection and its own log ring. The rings are
+ * the same size and see the same records in the same order, so a record
+ * sits at the same position with the same LSN in all of them: it is framed
+ * once, copied into the other rings and posted on every replica's QP
+ * before any completion is waited for, so the writes travel in parallel.
+ *
+ * A record is committed once `quorum` replicas report it received (or
+ * durable) through the watermarks they write into their ring_ctrl. The
+ * waiter counts whichever replicas answer first, so a slow one does not
+ * add to commit latency while enough others keep up.
+ *
+ * A replica whose QPs fail is failed over to its spare QPs if both sides
+ * keep them (config.spare_qps): the records it had not taken are replayed
+ * onto the new QPs and it stays in the set. Otherwise, or if that fails
+ * too, it is dropped from the set, as it is when its ring is still full
+ * after pulling its head back while the others could carry the quorum
+ * without it: a laggard that far behind would otherwise stall every
+ * append. A dropped replica misses records from then on and has to be
+ * caught up out of band before it may serve the log. Appends fail once
+ * fewer than `quorum` replicas are left.
+ *
+ * With a log_pack set, records are staged and go out max_recs at a time
+ * as one compressed RING_REC_BATCH record, sealed early by a flush or a
+ * wait. They have their LSNs from the moment they are staged.
+ */
+
+#define QUORUM_MAX_REPLICAS 8
+
+struct log_replica {
+    struct resources res;
+    struct log_ring ring;
+    char name[80]; // host:port, for messages
+    int live;
+    int failovers; // Times its QPs were replaced
+};
+
+struct log_quorum {
+    struct log_replica *rep;
+    int n;
+    int quorum; // Replicas that must have a record before it counts
+    int live;
+    uint64_t lsn; // Last LSN appended
+    struct log_pack *pack; // Batches records before they are framed, NULL to send each on its own
+};
+
+int log_quorum_init(struct log_quorum *q, struct log_replica *rep, int n, int quorum);
+int log_quorum_append(struct log_quorum *q, const void *payload, uint32_t len, uint32_t flag);
+int log_quorum_appendv(struct log_quorum *q, const struct iovec *iov, int iovcnt);
+int log_quorum_flush(struct log_quorum *q);
+uint64_t log_quorum_lsn(const struct log_quorum *q, int durable);
+int log_quorum_wait(struct log_quorum *q, uint64_t lsn, int durable);
+int log_quorum_close(struct log_quorum *q);
+
+#endif // LOG_QUORUM_H
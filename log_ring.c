@@ -0,0 +1,688 @@
+#include "log_ring.h"
+#include "rdma.h"
+#include "crc32c.h"
+#include "spin_wait.h"
+#include <stdio.h>
+#include <string.h>
+
+size_t log_ring_region_size(uint64_t ring_size)
+{
+    return RING_CTRL_SIZE + ring_size;
+}
+
+int log_ring_init(struct log_ring *ring, char *region, size_t region_size)
+{
+    uint64_t size;
+
+    if (region_size <= RING_CTRL_SIZE) {
+        fprintf(stderr, "log ring region too small: %zu bytes\n", region_size);
+        return 1;
+    }
+
+    size = region_size - RING_CTRL_SIZE;
+    if (size & (size - 1)) {
+        fprintf(stderr, "log ring size %lu is not a power of two\n", (unsigned long)size);
+        return 1;
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    ring->ctrl = (struct ring_ctrl *)region;
+    ring->data = region + RING_CTRL_SIZE;
+    ring->size = size;
+    ring->batch_size = 1;
+
+    ring->ctrl->head = 0;
+    ring->ctrl->size = size;
+    ring->ctrl->received_lsn = 0;
+    ring->ctrl->durable_lsn = 0;
+    ring->ctrl->tail = 0;
+    return 0;
+}
+
+uint64_t log_ring_rec_size(uint32_t len)
+{
+    return ((sizeof(struct ring_rec_hdr) + len + RING_ALIGN - 1) & ~(uint64_t)(RING_ALIGN - 1)) +
+           sizeof(struct ring_rec_trailer);
+}
+
+static void ring_copy_in(struct log_ring *ring, uint64_t pos, const void *src, uint64_t n)
+{
+    uint64_t off = pos & (ring->size - 1);
+    uint64_t first = (n < ring->size - off) ? n : ring->size - off;
+
+    memcpy(ring->data + off, src, first);
+    if (n > first)
+        memcpy(ring->data, (const char *)src + first, n - first);
+}
+
+static void ring_copy_out(struct log_ring *ring, uint64_t pos, void *dst, uint64_t n)
+{
+    uint64_t off = pos & (ring->size - 1);
+    uint64_t first = (n < ring->size - off) ? n : ring->size - off;
+
+    memcpy(dst, ring->data + off, first);
+    if (n > first)
+        memcpy((char *)dst + first, ring->data, n - first);
+}
+
+void log_ring_zero(struct log_ring *ring, uint64_t pos, uint64_t n)
+{
+    uint64_t off = pos & (ring->size - 1);
+    uint64_t first = (n < ring->size - off) ? n : ring->size - off;
+
+    memset(ring->data + off, 0, first);
+    if (n > first)
+        memset(ring->data, 0, n - first);
+}
+
+/* Copy n framed bytes at pos from a ring of the same size, so a record
+ * framed once can go out to several consumers. */
+void log_ring_clone(struct log_ring *dst, const struct log_ring *src, uint64_t pos, uint64_t n)
+{
+    uint64_t off = pos & (src->size - 1);
+    uint64_t first = (n < src->size - off) ? n : src->size - off;
+
+    memcpy(dst->data + off, src->data + off, first);
+    if (n > first)
+        memcpy(dst->data, src->data, n - first);
+}
+
+/* Returns 0 and the record position and LSN on success, 1 if the ring is
+ * full and -1 if the record can never fit. */
+int log_ring_reserve(struct log_ring *ring, uint32_t len, uint64_t *pos, uint64_t *lsn)
+{
+    return log_ring_reserve_n(ring, len, 1, pos, lsn);
+}
+
+/* Same for a batch record covering nlsns LSNs; *lsn is the first. */
+int log_ring_reserve_n(struct log_ring *ring, uint32_t len, uint32_t nlsns, uint64_t *pos, uint64_t *lsn)
+{
+    uint64_t rec = log_ring_rec_size(len);
+
+    if (rec > ring->size)
+        return -1;
+    if (ring->tail + rec - ring->head > ring->size)
+        return 1;
+
+    *pos = ring->tail;
+    *lsn = ring->lsn + 1;
+    ring->lsn += nlsns;
+    ring->tail += rec;
+    return 0;
+}
+
+static uint32_t rec_mark(uint64_t lsn)
+{
+    uint32_t mark = RING_REC_MARK ^ (uint32_t)lsn;
+
+    return mark ? mark : RING_REC_MARK; // Zero is what an empty slot holds
+}
+
+/* The CRC runs over the caller's payload rather than the ring copy, so a
+ * record that wraps needs no special casing. */
+static void ring_fill(struct log_ring *ring, uint64_t pos, uint64_t lsn, const void *payload, uint32_t len,
+                      uint32_t flag, uint32_t count)
+{
+    struct ring_rec_hdr hdr;
+    struct ring_rec_trailer tr;
+
+    hdr.len = len;
+    hdr.type = flag;
+    hdr.count = count;
+    hdr.lsn = lsn;
+    tr.crc = crc32c(crc32c(0, &hdr, RING_REC_CRC_HDR), payload, len);
+    tr.mark = rec_mark(lsn);
+    if (len)
+        ring_copy_in(ring, pos + sizeof(hdr), payload, len);
+    ring_copy_in(ring, pos + log_ring_rec_size(len) - sizeof(tr), &tr, sizeof(tr));
+    ring_copy_in(ring, pos, &hdr, sizeof(hdr));
+}
+
+void log_ring_fill(struct log_ring *ring, uint64_t pos, uint64_t lsn, const void *payload, uint32_t len, uint32_t flag)
+{
+    ring_fill(ring, pos, lsn, payload, len, flag, 0);
+}
+
+/* A RING_REC_BATCH record reserved with log_ring_reserve_n, payload as
+ * sealed by log_pack_seal. */
+void log_ring_fill_batch(struct log_ring *ring, uint64_t pos, uint64_t lsn, uint32_t count, const void *payload,
+                         uint32_t len)
+{
+    ring_fill(ring, pos, lsn, payload, len, RING_REC_BATCH, count);
+}
+
+static uint64_t *stage_stamp(struct log_ring *ring, uint64_t pos)
+{
+    return (uint64_t *)(ring->data + ((pos + offsetof(struct ring_rec_hdr, lsn)) & (ring->size - 1)));
+}
+
+/* Like log_ring_fill, but from any thread and without an LSN: the lsn word
+ * is stored last, as ~pos, to tell the flusher the record is complete. A
+ * real LSN never comes near that value. */
+void log_ring_stage_fill(struct log_ring *ring, uint64_t pos, const void *payload, uint32_t len, uint32_t flag)
+{
+    struct ring_rec_hdr hdr;
+    struct ring_rec_trailer tr;
+
+    hdr.len = len;
+    hdr.type = flag;
+    hdr.count = 0;
+    tr.crc = crc32c(crc32c(0, &hdr, RING_REC_CRC_HDR), payload, len);
+    tr.mark = 0;
+    if (len)
+        ring_copy_in(ring, pos + sizeof(hdr), payload, len);
+    ring_copy_in(ring, pos + log_ring_rec_size(len) - sizeof(tr), &tr, sizeof(tr));
+    ring_copy_in(ring, pos, &hdr, RING_REC_CRC_HDR);
+    __atomic_store_n(stage_stamp(ring, pos), ~pos, __ATOMIC_RELEASE);
+}
+
+/* Flusher side: if the record at pos is complete, give it the next LSN and
+ * its mark and return its size; 0 if it is still being filled. */
+uint64_t log_ring_stage_seal(struct log_ring *ring, uint64_t pos)
+{
+    uint64_t *stamp = stage_stamp(ring, pos);
+    struct ring_rec_trailer *tr;
+    struct ring_rec_hdr hdr;
+    uint64_t rec;
+
+    if (__atomic_load_n(stamp, __ATOMIC_ACQUIRE) != ~pos)
+        return 0;
+
+    ring_copy_out(ring, pos, &hdr, RING_REC_CRC_HDR);
+    rec = log_ring_rec_size(hdr.len);
+    *stamp = ++ring->lsn;
+    tr = (struct ring_rec_trailer *)(ring->data + ((pos + rec - sizeof(*tr)) & (ring->size - 1)));
+    tr->mark = rec_mark(ring->lsn);
+    return rec;
+}
+
+void log_ring_set_batch(struct log_ring *ring, int batch_size)
+{
+    if (batch_size < 1)
+        batch_size = 1;
+    if (batch_size > RING_MAX_BATCH / 2)
+        batch_size = RING_MAX_BATCH / 2;
+    ring->batch_size = batch_size;
+}
+
+/* Queue the record at pos for the next doorbell, flushing once the batch is
+ * full. */
+int log_ring_post(struct resources *res, struct log_ring *ring, uint64_t pos, uint64_t length)
+{
+    size_t base = ring->data - res->buf;
+    uint64_t off = pos & (ring->size - 1);
+    uint64_t first = (length < ring->size - off) ? length : ring->size - off;
+
+    /* The header lives in the first piece; queue the wrapped remainder ahead
+     * of it so the flag is not visible before the payload it covers. */
+    if (length > first) {
+        ring->batch[ring->nsegs].offset = base;
+        ring->batch[ring->nsegs].length = length - first;
+        ring->batch[ring->nsegs].cookie = pos;
+        ring->batch[ring->nsegs].sgl = NULL;
+        ring->nsegs++;
+    }
+    // Completion cookie is the ring position up to which records have landed
+    ring->batch[ring->nsegs].offset = base + off;
+    ring->batch[ring->nsegs].length = first;
+    ring->batch[ring->nsegs].cookie = pos + length;
+    ring->batch[ring->nsegs].sgl = NULL;
+    ring->nsegs++;
+
+    if (++ring->nrecs >= ring->batch_size)
+        return log_ring_flush(res, ring);
+    return 0;
+}
+
+int log_ring_flush(struct resources *res, struct log_ring *ring)
+{
+    int rc = 0;
+
+    if (ring->nsegs) {
+        rc = rdma_write_batch(res, ring->batch, ring->nsegs, ring->flush_flags);
+        if (rc)
+            fprintf(stderr, "failed to post %d ring segments, error: %d\n", ring->nsegs, rc);
+    }
+    ring->nsegs = 0;
+    ring->nrecs = 0;
+    ring->nsges = 0;
+    return rc;
+}
+
+int log_ring_sync_head(struct resources *res, struct log_ring *ring)
+{
+    size_t off = (char *)ring->ctrl - res->buf;
+    int rc;
+
+    rc = rdma_read(res, off + offsetof(struct ring_ctrl, head), sizeof(ring->ctrl->head));
+    if (rc) {
+        fprintf(stderr, "failed to read ring head, error: %d\n", rc);
+        return rc;
+    }
+
+    ring->head = ring->ctrl->head;
+    return 0;
+}
+
+/* After a failover to fresh QPs: post again every record the consumer has
+ * not taken, from its head as read back over the new QP to the tail, and
+ * wait until they have landed. Records that did land before the failure
+ * are rewritten with the same bytes. The consumer must be held back
+ * meanwhile (rdma_reconnect does), or a record it takes and zeroes could be
+ * written back behind its head. Queued segments are covered and dropped. */
+int log_ring_replay(struct resources *res, struct log_ring *ring)
+{
+    struct ring_rec_hdr hdr;
+    uint64_t pos, rec;
+
+    ring->nsegs = 0;
+    ring->nrecs = 0;
+    ring->nsges = 0;
+    if (log_ring_sync_head(res, ring))
+        return 1;
+    if (ring->gathered > ring->head) {
+        fprintf(stderr, "records up to ring position %lu were gathered from caller buffers, can't replay them\n",
+                (unsigned long)ring->gathered);
+        return 1;
+    }
+
+    for (pos = ring->head; pos < ring->tail; pos += rec) {
+        ring_copy_out(ring, pos, &hdr, sizeof(hdr));
+        rec = log_ring_rec_size(hdr.len);
+        if (rec > ring->tail - pos) {
+            fprintf(stderr, "no record to replay at ring position %lu\n", (unsigned long)pos);
+            return 1;
+        }
+        if (log_ring_post(res, ring, pos, rec))
+            return 1;
+    }
+    if (log_ring_flush(res, ring) || rdma_drain(res))
+        return 1;
+    return 0;
+}
+
+/* log_ring_reserve_n, reading the consumer's head back while the ring is
+ * full. Fails if the head stays put for SPIN_WAIT_TIMEOUT_MS. */
+static int ring_reserve_wait(struct resources *res, struct log_ring *ring, uint32_t len, uint32_t nlsns,
+                             uint64_t *pos, uint64_t *lsn)
+{
+    struct spin_wait w;
+    uint64_t head = ring->head;
+    int rc;
+
+    spin_wait_init(&w, RING_SPACE_SPINS);
+    while ((rc = log_ring_reserve_n(ring, len, nlsns, pos, lsn)) == 1) {
+        // Queued records can't be consumed until they are posted
+        if (log_ring_flush(res, ring))
+            return 1;
+        if (log_ring_sync_head(res, ring))
+            return 1;
+        if (ring->head != head) {
+            head = ring->head;
+            spin_wait_reset(&w);
+        } else if (spin_wait(&w)) {
+            fprintf(stderr, "ring full for %d ms, consumer stuck at %lu\n", SPIN_WAIT_TIMEOUT_MS,
+                    (unsigned long)ring->head);
+            return 1;
+        }
+    }
+    if (rc < 0) {
+        fprintf(stderr, "record of %u bytes does not fit in a %lu byte ring\n", len, (unsigned long)ring->size);
+        return 1;
+    }
+    return 0;
+}
+
+static int ring_append(struct resources *res, struct log_ring *ring, const void *payload, uint32_t len, uint32_t flag,
+                       uint32_t count)
+{
+    uint64_t pos, lsn;
+
+    if (ring_reserve_wait(res, ring, len, count ? count : 1, &pos, &lsn))
+        return 1;
+
+    ring_fill(ring, pos, lsn, payload, len, flag, count);
+    return log_ring_post(res, ring, pos, log_ring_rec_size(len));
+}
+
+int log_ring_append(struct resources *res, struct log_ring *ring, const void *payload, uint32_t len, uint32_t flag)
+{
+    return ring_append(res, ring, payload, len, flag, 0);
+}
+
+/* Append a sealed log_pack batch of count records. */
+int log_ring_append_batch(struct resources *res, struct log_ring *ring, const void *payload, uint32_t len,
+                          uint32_t count)
+{
+    return ring_append(res, ring, payload, len, RING_REC_BATCH, count);
+}
+
+uint64_t log_ring_iov_len(const struct iovec *iov, int iovcnt)
+{
+    uint64_t len = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    return len;
+}
+
+/* The gather list of one record, in the order its bytes go out: entries
+ * before split for the write up to the end of the data area, the rest
+ * for the one that wraps to its start. */
+struct ring_gather {
+    struct ibv_sge sge[RDMA_MAX_SGE + 4]; // Payload, plus header and trailer, each maybe cut at the wrap
+    int n;
+    int split;
+    uint64_t done;  // Record bytes added so far
+    uint64_t first; // Record bytes before the wrap
+};
+
+static void gather_add(struct ring_gather *g, const void *addr, uint64_t len, uint32_t lkey)
+{
+    if (!len)
+        return;
+    // A piece that runs across the wrap goes out in both writes
+    if (g->done < g->first && g->done + len > g->first) {
+        uint64_t k = g->first - g->done;
+
+        gather_add(g, addr, k, lkey);
+        addr = (const char *)addr + k;
+        len -= k;
+    }
+    g->sge[g->n].addr = (uintptr_t)addr;
+    g->sge[g->n].length = (uint32_t)len;
+    g->sge[g->n].lkey = lkey;
+    g->n++;
+    g->done += len;
+    if (g->done == g->first)
+        g->split = g->n;
+}
+
+// Ring bytes: they wrap where the record does, so no piece is cut twice
+static void gather_ring(struct ring_gather *g, struct log_ring *ring, uint64_t pos, uint64_t n, uint32_t lkey)
+{
+    uint64_t off = pos & (ring->size - 1);
+    uint64_t first = (n < ring->size - off) ? n : ring->size - off;
+
+    gather_add(g, ring->data + off, first, lkey);
+    gather_add(g, ring->data, n - first, lkey);
+}
+
+static void gather_queue(struct log_ring *ring, size_t offset, uint64_t length, uint64_t cookie,
+                         const struct ibv_sge *sge, int n)
+{
+    struct rdma_seg *seg = &ring->batch[ring->nsegs++];
+
+    memcpy(&ring->sges[ring->nsges], sge, n * sizeof(*sge));
+    seg->offset = offset;
+    seg->length = length;
+    seg->cookie = cookie;
+    seg->sgl = &ring->sges[ring->nsges];
+    seg->nsge = n;
+    ring->nsges += n;
+}
+
+/* Frame a record whose payload is the concatenation of iov at pos, as
+ * reserved with log_ring_reserve, and queue it like log_ring_post. The
+ * payload is gathered from the caller's buffers by the write itself,
+ * registered through the MR cache;
+ * payloads small enough to go inline, or in more pieces than a WR can
+ * gather, are copied into the ring instead. */
+int log_ring_postv(struct resources *res, struct log_ring *ring, uint64_t pos, uint64_t lsn,
+                   const struct iovec *iov, int iovcnt, uint32_t flag)
+{
+    struct ring_rec_hdr hdr;
+    struct ring_rec_trailer tr;
+    struct ring_gather g;
+    struct mr_cache_entry *pins[RDMA_MAX_SGE];
+    int npins = 0;
+    int rc = 0;
+    size_t base = ring->data - res->buf;
+    uint64_t len = log_ring_iov_len(iov, iovcnt);
+    uint64_t rec = log_ring_rec_size((uint32_t)len);
+    uint64_t off = pos & (ring->size - 1);
+    int copy = len <= res->max_inline || iovcnt > RDMA_MAX_SGE;
+
+    hdr.len = (uint32_t)len;
+    hdr.type = flag;
+    hdr.count = 0;
+    hdr.lsn = lsn;
+    tr.crc = crc32c(0, &hdr, RING_REC_CRC_HDR);
+    for (int i = 0; i < iovcnt; i++)
+        tr.crc = crc32c(tr.crc, iov[i].iov_base, iov[i].iov_len);
+    tr.mark = rec_mark(lsn);
+
+    memset(&g, 0, sizeof(g));
+    g.first = (rec < ring->size - off) ? rec : ring->size - off;
+    g.split = -1;
+    if (!copy) {
+        gather_ring(&g, ring, pos, sizeof(hdr), res->mr->lkey);
+        for (int i = 0; i < iovcnt; i++) {
+            uint32_t lkey;
+
+            if (rdma_mr_get(res, iov[i].iov_base, iov[i].iov_len, &lkey, &pins[npins])) {
+                fprintf(stderr, "Xlog piece of %zu bytes at %p can't be registered\n", iov[i].iov_len,
+                        iov[i].iov_base);
+                rc = 1;
+                goto postv_out;
+            }
+            npins++;
+            gather_add(&g, iov[i].iov_base, iov[i].iov_len, lkey);
+        }
+        gather_ring(&g, ring, pos + sizeof(hdr) + len, rec - sizeof(hdr) - len, res->mr->lkey);
+        copy = g.split > (int)res->max_sge || g.n - g.split > (int)res->max_sge;
+    }
+
+    if (copy) {
+        uint64_t p = pos + sizeof(hdr);
+
+        for (int i = 0; i < iovcnt; i++) {
+            ring_copy_in(ring, p, iov[i].iov_base, iov[i].iov_len);
+            p += iov[i].iov_len;
+        }
+    }
+    ring_copy_in(ring, pos + rec - sizeof(tr), &tr, sizeof(tr));
+    ring_copy_in(ring, pos, &hdr, sizeof(hdr));
+    if (copy) {
+        rc = log_ring_post(res, ring, pos, rec);
+        goto postv_out;
+    }
+
+    if (ring->nsges + g.n > RING_MAX_SGE && log_ring_flush(res, ring)) {
+        rc = 1;
+        goto postv_out;
+    }
+    // As in log_ring_post, the wrapped remainder goes out ahead of the header
+    if (g.split < g.n)
+        gather_queue(ring, base, rec - g.first, pos, &g.sge[g.split], g.n - g.split);
+    gather_queue(ring, base + off, g.first, pos + rec, g.sge, g.split);
+    ring->gathered = pos + rec;
+    if (++ring->nrecs >= ring->batch_size)
+        rc = log_ring_flush(res, ring);
+
+postv_out:
+    // Queued, the MRs are the MR cache's quiesce hook's to look after
+    while (npins)
+        rdma_mr_put(res, pins[--npins]);
+    return rc;
+}
+
+/* log_ring_append for a payload in caller buffers, see log_ring_postv. */
+int log_ring_appendv(struct resources *res, struct log_ring *ring, const struct iovec *iov, int iovcnt,
+                     uint32_t flag)
+{
+    uint64_t len = log_ring_iov_len(iov, iovcnt);
+    uint64_t pos, lsn;
+
+    if (len > UINT32_MAX) {
+        fprintf(stderr, "record of %lu bytes is too large\n", (unsigned long)len);
+        return 1;
+    }
+    if (ring_reserve_wait(res, ring, (uint32_t)len, 1, &pos, &lsn))
+        return 1;
+    return log_ring_postv(res, ring, pos, lsn, iov, iovcnt, flag);
+}
+
+/* Wait until the consumer reports lsn (the value ring->lsn had after its
+ * append) received, or durable if `durable` is set. Queued records are
+ * posted first. Spins on the watermark, reaping send completions so a
+ * failed write ends the wait, and yields the CPU once the spin budget is
+ * spent. */
+int log_ring_wait_for_lsn(struct resources *res, struct log_ring *ring, uint64_t lsn, int durable)
+{
+    volatile uint64_t *mark = durable ? &ring->ctrl->durable_lsn : &ring->ctrl->received_lsn;
+    struct spin_wait w;
+
+    if (ring->nsegs && log_ring_flush(res, ring))
+        return 1;
+
+    spin_wait_init(&w, SPIN_WAIT_SPINS);
+    while (__atomic_load_n(mark, __ATOMIC_ACQUIRE) < lsn) {
+        if (rdma_reap(res) || res->failed_status != IBV_WC_SUCCESS)
+            return 1;
+        if (spin_wait(&w)) {
+            fprintf(stderr, "LSN %lu not %s after %d ms, consumer is at %lu\n", (unsigned long)lsn,
+                    durable ? "durable" : "received", SPIN_WAIT_TIMEOUT_MS, (unsigned long)*mark);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Look at the record at pos, which may lie ahead of head as long as every
+ * record before it has been found already: expect is the LSN it must carry
+ * (its position on a shared ring). Returns 1 with the record described in
+ * *v, 0 if it hasn't fully landed and -1 if it isn't the record expected.
+ * Nothing is copied or checked against the CRC; the ring stays untouched. */
+int log_ring_peek(struct log_ring *ring, uint64_t pos, uint64_t expect, struct ring_rec_view *v)
+{
+    struct ring_rec_hdr *slot = (struct ring_rec_hdr *)(ring->data + (pos & (ring->size - 1)));
+    struct ring_rec_trailer *tr;
+
+    if (!__atomic_load_n(&slot->type, __ATOMIC_ACQUIRE))
+        return 0;
+
+    ring_copy_out(ring, pos, &v->hdr, sizeof(v->hdr));
+    v->size = log_ring_rec_size(v->hdr.len);
+    if (v->size > ring->size)
+        return 0; // Length not fully landed; the mark check below can't be trusted yet
+    tr = (struct ring_rec_trailer *)(ring->data + ((pos + v->size - sizeof(*tr)) & (ring->size - 1)));
+    if (__atomic_load_n(&tr->mark, __ATOMIC_ACQUIRE) != rec_mark(v->hdr.lsn))
+        return 0;
+
+    if (v->hdr.lsn != expect) {
+        fprintf(stderr, "ring record at position %lu has %s %lu, expected %lu\n", (unsigned long)pos,
+                ring->shared ? "position" : "LSN", (unsigned long)v->hdr.lsn, (unsigned long)expect);
+        return -1;
+    }
+    v->pos = pos;
+    v->crc = tr->crc;
+    return 1;
+}
+
+/* The last LSN a record covers: a RING_REC_BATCH takes count of them. */
+uint64_t log_ring_last_lsn(const struct ring_rec_view *v)
+{
+    return v->hdr.lsn + (v->hdr.type == RING_REC_BATCH && v->hdr.count ? v->hdr.count - 1 : 0);
+}
+
+/* A peeked record's payload in one piece: where it lies in the ring, or
+ * copied into buf (of at least hdr.len bytes) if it wraps. NULL if it wraps
+ * and buf is NULL. */
+const void *log_ring_payload(struct log_ring *ring, const struct ring_rec_view *v, void *buf)
+{
+    uint64_t off = (v->pos + sizeof(v->hdr)) & (ring->size - 1);
+
+    if (off + v->hdr.len <= ring->size)
+        return ring->data + off;
+    if (buf)
+        ring_copy_out(ring, v->pos + sizeof(v->hdr), buf, v->hdr.len);
+    return buf;
+}
+
+/* Check a peeked record's payload against its CRC; 0 if it matches. Only
+ * reads v and the payload, so any thread may do it. */
+int log_ring_verify(const struct ring_rec_view *v, const void *payload)
+{
+    uint32_t crc = crc32c(crc32c(0, &v->hdr, RING_REC_CRC_HDR), payload, v->hdr.len);
+
+    if (crc != v->crc) {
+        fprintf(stderr, "torn or corrupt ring record at LSN %lu: CRC %08x, expected %08x\n",
+                (unsigned long)v->hdr.lsn, crc, v->crc);
+        return 1;
+    }
+    return 0;
+}
+
+/* Take the peeked record at head: zero it and publish the new head. On a
+ * shared ring the LSN is handed out here, in the order the positions were
+ * reserved. */
+void log_ring_release(struct log_ring *ring, const struct ring_rec_view *v)
+{
+    if (ring->shared)
+        ring->lsn++;
+    else
+        ring->lsn = log_ring_last_lsn(v);
+    log_ring_zero(ring, v->pos, v->size);
+    ring->head += v->size;
+    __atomic_store_n(&ring->ctrl->head, ring->head, __ATOMIC_RELEASE);
+}
+
+/* Returns 1 and copies out the next record, 0 if nothing has landed yet and
+ * -1 if the record does not fit in `cap` bytes or fails its checks. The
+ * trailer is aligned and never straddles the end of the data area. A
+ * RING_REC_BATCH comes out packed, ring->lsn moving past all its LSNs. On
+ * a shared ring the record must carry its own position. */
+int log_ring_consume(struct log_ring *ring, void *out, uint32_t cap, uint32_t *len, uint32_t *flag)
+{
+    struct ring_rec_view v;
+    int rc = log_ring_peek(ring, ring->head, ring->shared ? ring->head : ring->lsn + 1, &v);
+
+    if (rc <= 0)
+        return rc;
+
+    *flag = v.hdr.type;
+    *len = v.hdr.len;
+    if (*len > cap) {
+        fprintf(stderr, "ring record of %u bytes exceeds buffer of %u\n", *len, cap);
+        return -1;
+    }
+    if (*len)
+        ring_copy_out(ring, ring->head + sizeof(v.hdr), out, *len);
+    if (log_ring_verify(&v, out))
+        return -1;
+
+    log_ring_release(ring, &v);
+    return 1;
+}
+
+/* Whether the producer has announced records past pos (head, or how far a
+ * pipelined consumer has looked) with an immediate. The last segment of
+ * every flush is a record header whose cookie is the ring position just
+ * past it. */
+int log_ring_notified(const struct resources *res, uint64_t pos)
+{
+    return __atomic_load_n(&res->imm_pos, __ATOMIC_ACQUIRE) > pos;
+}
+
+/* Push the consumer's watermarks to the producer if either moved: the last
+ * LSN taken and durable_lsn, which is ring->lsn when nothing is persisted.
+ * The local ctrl doubles as the source of the (inline) write; both values
+ * only grow, so a later one going out instead is harmless. */
+int log_ring_ack(struct resources *res, struct log_ring *ring, uint64_t durable_lsn)
+{
+    size_t off = (char *)ring->ctrl - res->buf + offsetof(struct ring_ctrl, received_lsn);
+
+    if (ring->lsn == ring->acked_lsn && durable_lsn == ring->acked_durable)
+        return 0;
+
+    ring->ctrl->received_lsn = ring->lsn;
+    ring->ctrl->durable_lsn = durable_lsn;
+    if (rdma_write(res, off, 2 * sizeof(uint64_t))) {
+        fprintf(stderr, "failed to acknowledge LSN %lu\n", (unsigned long)ring->lsn);
+        return 1;
+    }
+    ring->acked_lsn = ring->lsn;
+    ring->acked_durable = durable_lsn;
+    return 0;
+}
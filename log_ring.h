@@ -0,0 +1,163 @@
+#ifndef LOG_RING_H
+#define LOG_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include "rdma.h"
+
+/*
+ * Single-producer/single-consumer log ring laid over the registered buffer.
+ *
+ * Region layout (identical on both sides, so local and remote offsets match):
+ *   [ struct ring_ctrl | data area of `size` bytes (power of two) ]
+ *
+ * head and tail are monotonically increasing byte positions; the physical
+ * offset is pos & (size - 1). A record is framed as
+ *
+ *   [ ring_rec_hdr | payload, padded to RING_ALIGN | ring_rec_trailer ]
+ *
+ * and may span the end of the data area. The header carries the length,
+ * type, count and LSN, the trailer a CRC32C over all but the LSN and the
+ * payload, followed by a validity mark derived from the LSN (which leaves
+ * the LSN to be filled in after the CRC, see log_stage.h). The consumer only takes a record once
+ * the mark matches, so a write that has landed partially (or a slot still
+ * holding zeroes) reads as not there yet, and a record whose CRC doesn't
+ * match after that is torn or corrupt. The consumer zeroes what it consumed
+ * and publishes ctrl->head, which the producer pulls back with an RDMA READ
+ * when it runs out of space.
+ *
+ * The consumer reports progress the same way in reverse: it writes the
+ * last LSN it took and the last one it made durable into its own ring_ctrl
+ * and RDMA-writes those two words to the same offset in the producer's
+ * region. log_ring_wait_for_lsn() watches them, so a synchronous commit
+ * costs one write each way and no TCP round trip.
+ *
+ * The producer queues the segments of up to batch_size records and posts
+ * them as one chained ibv_post_send. With RDMA_WRITE_IMM in flush_flags the
+ * last write of each flush carries the new tail as immediate data, so the
+ * consumer learns about arrivals from its CQ instead of scanning flags.
+ *
+ * log_ring_postv() takes the payload as an iovec of caller buffers, such as
+ * pages in a buffer cache, which the device's MR cache registers on first
+ * use (see mr_cache.h). Only the header and trailer are framed in the ring;
+ * the write gathers the payload from where it lies, so a large record moves
+ * without a CPU copy. The buffers must stay unchanged until the record has
+ * landed, and as the ring does not hold its payload, such a record can't be
+ * replayed after a failover. Before the cache evicts an MR, its quiesce
+ * hook has to post the ring's queued writes; log_quorum installs one.
+ *
+ * A consumer may also split taking a record up: log_ring_peek() finds the
+ * records past head as they land, without touching them, any thread can
+ * check one's CRC with log_ring_verify(), and log_ring_release() takes
+ * them at head in ring order. Released space is zeroed as usual; until
+ * then the producer can't reuse it, so a peeked record stays put.
+ */
+
+#define RING_CTRL_SIZE 64
+#define RING_ALIGN 8
+
+#define RING_MAX_BATCH (2 * RDMA_MAX_BATCH) // Segments, a record may need two
+#define RING_MAX_SGE (4 * RDMA_MAX_SGE)     // Gather entries queued between doorbells
+#define RING_SPACE_SPINS 100 // Head reads before a full ring starts yielding, each is a round trip
+
+#define RING_REC_VALID 1  // Record carries a payload
+#define RING_REC_EOS   2  // End of stream, no payload
+#define RING_REC_BATCH 3  // Several records packed into one, see log_pack.h
+
+#define RING_REC_MARK 0x52454321u // "REC!", xor'ed with the low LSN bits
+#define RING_REC_CRC_HDR offsetof(struct ring_rec_hdr, lsn) // Header bytes under the CRC
+
+struct ring_ctrl {
+    volatile uint64_t head;         // Consumer position, written by the logstore
+    uint64_t size;                  // Data area size
+    volatile uint64_t received_lsn; // Consumer watermarks, pushed into the producer's ctrl
+    volatile uint64_t durable_lsn;
+    volatile uint64_t tail;         // Shared log: next free position, claimed with fetch-and-add
+    char pad[RING_CTRL_SIZE - 5 * sizeof(uint64_t)];
+};
+
+struct ring_rec_hdr {
+    uint32_t len;   // Payload length in bytes
+    uint16_t type;  // RING_REC_*, 0 while the slot is empty
+    uint16_t count; // LSNs a RING_REC_BATCH covers, from lsn on; 0 for other types
+    uint64_t lsn;   // Numbered from 1 per ring, end of stream included
+};
+
+struct ring_rec_trailer {
+    uint32_t crc;  // CRC32C of the header up to lsn and the payload
+    uint32_t mark; // RING_REC_MARK ^ low LSN bits (never 0) once the record is complete
+};
+
+// A record found by log_ring_peek, not taken yet
+struct ring_rec_view {
+    uint64_t pos;  // Where it starts
+    uint64_t size; // Framed, as log_ring_rec_size
+    struct ring_rec_hdr hdr;
+    uint32_t crc;  // From the trailer
+};
+
+struct log_ring {
+    struct ring_ctrl *ctrl;
+    char *data;
+    uint64_t size;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t lsn;   // Producer: last LSN handed out; consumer: last LSN taken
+    struct rdma_seg batch[RING_MAX_BATCH];
+    int nsegs;
+    int nrecs;
+    int batch_size; // Records per doorbell
+    int flush_flags; // Passed to rdma_write_batch on every flush
+    uint64_t acked_lsn;     // Consumer: watermarks in the last push
+    uint64_t acked_durable;
+    int shared;             // Records carry their position instead of an LSN, see log_shared.h
+    struct ibv_sge sges[RING_MAX_SGE]; // Gather lists of the queued segments that have one
+    int nsges;
+    uint64_t gathered;      // End of the last record posted from caller buffers
+};
+
+size_t log_ring_region_size(uint64_t ring_size);
+int log_ring_init(struct log_ring *ring, char *region, size_t region_size);
+uint64_t log_ring_rec_size(uint32_t len);
+
+// Producer side (compute node)
+int log_ring_reserve(struct log_ring *ring, uint32_t len, uint64_t *pos, uint64_t *lsn);
+int log_ring_reserve_n(struct log_ring *ring, uint32_t len, uint32_t nlsns, uint64_t *pos, uint64_t *lsn);
+void log_ring_fill(struct log_ring *ring, uint64_t pos, uint64_t lsn, const void *payload, uint32_t len, uint32_t flag);
+void log_ring_fill_batch(struct log_ring *ring, uint64_t pos, uint64_t lsn, uint32_t count, const void *payload,
+                         uint32_t len);
+void log_ring_clone(struct log_ring *dst, const struct log_ring *src, uint64_t pos, uint64_t n);
+void log_ring_set_batch(struct log_ring *ring, int batch_size);
+int log_ring_post(struct resources *res, struct log_ring *ring, uint64_t pos, uint64_t length);
+int log_ring_flush(struct resources *res, struct log_ring *ring);
+int log_ring_sync_head(struct resources *res, struct log_ring *ring);
+int log_ring_replay(struct resources *res, struct log_ring *ring);
+int log_ring_append(struct resources *res, struct log_ring *ring, const void *payload, uint32_t len, uint32_t flag);
+int log_ring_append_batch(struct resources *res, struct log_ring *ring, const void *payload, uint32_t len,
+                          uint32_t count);
+uint64_t log_ring_iov_len(const struct iovec *iov, int iovcnt);
+int log_ring_postv(struct resources *res, struct log_ring *ring, uint64_t pos, uint64_t lsn,
+                   const struct iovec *iov, int iovcnt, uint32_t flag);
+int log_ring_appendv(struct resources *res, struct log_ring *ring, const struct iovec *iov, int iovcnt,
+                     uint32_t flag);
+int log_ring_wait_for_lsn(struct resources *res, struct log_ring *ring, uint64_t lsn, int durable);
+
+// Staged producers (log_stage.c): fill concurrently, LSNs are sealed in order by the flusher
+void log_ring_stage_fill(struct log_ring *ring, uint64_t pos, const void *payload, uint32_t len, uint32_t flag);
+uint64_t log_ring_stage_seal(struct log_ring *ring, uint64_t pos);
+void log_ring_zero(struct log_ring *ring, uint64_t pos, uint64_t n);
+
+// Consumer side (logstore)
+int log_ring_consume(struct log_ring *ring, void *out, uint32_t cap, uint32_t *len, uint32_t *flag);
+int log_ring_notified(const struct resources *res, uint64_t pos);
+int log_ring_ack(struct resources *res, struct log_ring *ring, uint64_t durable_lsn);
+
+// Pipelined consumer: find records ahead of head, check them anywhere, release them in order
+int log_ring_peek(struct log_ring *ring, uint64_t pos, uint64_t expect, struct ring_rec_view *v);
+uint64_t log_ring_last_lsn(const struct ring_rec_view *v);
+const void *log_ring_payload(struct log_ring *ring, const struct ring_rec_view *v, void *buf);
+int log_ring_verify(const struct ring_rec_view *v, const void *payload);
+void log_ring_release(struct log_ring *ring, const struct ring_rec_view *v);
+
+#endif // LOG_RING_H
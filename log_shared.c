@@ -0,0 +1,99 @@
+#include "log_shared.h"
+#include "spin_wait.h"
+#include <stdio.h>
+#include <string.h>
+
+#define SHARED_WAIT_SPINS 100 // Head reads before a waiter starts yielding, each is a round trip
+
+/* Point a connected writer at the logstore's shared region. Stripes write
+ * into the same region as their leader, so they move along with it. */
+int log_shared_open(struct log_shared *sh, struct resources *res)
+{
+    const struct cm_con_data_t *remote = &res->remote_props;
+
+    memset(sh, 0, sizeof(*sh));
+    if (!remote->shared_size) {
+        fprintf(stderr, "Logstore offers no shared log\n");
+        return 1;
+    }
+    if (remote->shared_size != res->buf_size) {
+        fprintf(stderr, "Shared log size mismatch: local %u, remote %u\n", res->buf_size, remote->shared_size);
+        return 1;
+    }
+    for (int i = 0; i < res->nstripes; i++) {
+        res->stripe[i]->remote_props.addr += remote->shared_off;
+        res->stripe[i]->remote_props.rkey = remote->shared_rkey;
+    }
+    res->remote_props.addr += remote->shared_off;
+    res->remote_props.rkey = remote->shared_rkey;
+
+    if (log_ring_init(&sh->ring, res->buf, res->buf_size) != 0)
+        return 1;
+    sh->ring.shared = 1;
+    log_ring_set_batch(&sh->ring, RING_MAX_BATCH / 2);
+    sh->res = res;
+    return 0;
+}
+
+/* Read the logstore's head back until it reaches pos. */
+static int shared_wait_head(struct log_shared *sh, uint64_t pos)
+{
+    struct spin_wait w;
+
+    spin_wait_init(&w, SHARED_WAIT_SPINS);
+    while (sh->ring.head < pos) {
+        if (log_ring_sync_head(sh->res, &sh->ring))
+            return 1;
+        sh->head_reads++;
+        if (sh->ring.head < pos && spin_wait(&w)) {
+            fprintf(stderr, "Shared log head stuck at %lu, waiting for %lu\n", (unsigned long)sh->ring.head,
+                    (unsigned long)pos);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Reserve room for n records with one fetch-and-add, then write them
+ * behind one doorbell. */
+int log_shared_append(struct log_shared *sh, const void *const *payloads, const uint32_t *lens, int n)
+{
+    struct log_ring *ring = &sh->ring;
+    uint64_t bytes = 0, pos;
+
+    for (int i = 0; i < n; i++)
+        bytes += log_ring_rec_size(lens[i]);
+    if (bytes > ring->size) {
+        fprintf(stderr, "%lu bytes of records do not fit in a %lu byte shared log\n", (unsigned long)bytes,
+                (unsigned long)ring->size);
+        return 1;
+    }
+
+    if (rdma_fetch_add(sh->res, offsetof(struct ring_ctrl, tail), bytes, &pos)) {
+        fprintf(stderr, "failed to reserve %lu bytes in the shared log\n", (unsigned long)bytes);
+        return 1;
+    }
+    sh->reserves++;
+    // What sat there a ring ago must have been taken first
+    if (pos + bytes > ring->size && shared_wait_head(sh, pos + bytes - ring->size))
+        return 1;
+
+    for (int i = 0; i < n; i++) {
+        uint64_t rec = log_ring_rec_size(lens[i]);
+
+        log_ring_fill(ring, pos, pos, payloads[i], lens[i], RING_REC_VALID);
+        if (log_ring_post(sh->res, ring, pos, rec))
+            return 1;
+        pos += rec;
+    }
+    sh->end = pos;
+    sh->records += n;
+    return log_ring_flush(sh->res, ring);
+}
+
+/* Wait until the logstore has published every record up to position end,
+ * e.g. sh->end after an append. */
+int log_shared_wait(struct log_shared *sh, uint64_t end)
+{
+    return shared_wait_head(sh, end);
+}
@@ -0,0 +1,51 @@
+#ifndef LOG_SHARED_H
+#define LOG_SHARED_H
+
+#include <stdint.h>
+#include "rdma.h"
+#include "log_ring.h"
+
+/*
+ * One log, many writers: lock-free appends from several compute nodes into
+ * a single region on the logstore (writer side).
+ *
+ * A logstore started with -G keeps a shared log region next to the
+ * per-connection ones, laid out like a log ring, and offers it in every
+ * handshake (shared_off, shared_rkey, shared_size). A writer connecting
+ * with CM_FLAG_SHARED points its connection at that region instead of its
+ * own and appends without involving the logstore CPU:
+ *
+ *   1. reserve: an RDMA FETCH_AND_ADD of the framed size on ctrl->tail
+ *      returns the position the range starts at, unique among writers;
+ *   2. write: the records are framed at that position in a local mirror
+ *      of the region and RDMA-written to the same offset.
+ *
+ * Framing is the log ring's, except that the header's lsn field holds the
+ * record's position, which the validity mark is derived from: a writer
+ * can't know the LSN its record will get. The logstore takes the record at
+ * its head once the mark matches, so records are published in reservation
+ * order and numbered from 1 then. A range that has been reserved but not
+ * yet written holds back everything behind it.
+ *
+ * Taking a record moves ctrl->head, which writers read back: to learn that
+ * their records are published, and before writing a range that runs more
+ * than a ring past head, which has to wait for the space to be freed. One
+ * fetch-and-add covers everything passed to log_shared_append, so batching
+ * amortizes its round trip. A writer that dies between reserving and
+ * writing stalls the log; reserved ranges are not reclaimed.
+ */
+
+struct log_shared {
+    struct resources *res;
+    struct log_ring ring; // Local mirror of the region; head as last read back
+    uint64_t end;         // Just past this writer's last record
+    uint64_t records;
+    uint64_t reserves;    // Fetch-and-adds issued
+    uint64_t head_reads;  // Reads of the logstore's head
+};
+
+int log_shared_open(struct log_shared *sh, struct resources *res);
+int log_shared_append(struct log_shared *sh, const void *const *payloads, const uint32_t *lens, int n);
+int log_shared_wait(struct log_shared *sh, uint64_t end);
+
+#endif // LOG_SHARED_H
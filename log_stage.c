@@ -0,0 +1,250 @@
+#include "log_stage.h"
+#include "stats.h"
+#include "spin_wait.h"
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+
+/* Turn the LSN watermarks the consumer wrote into our ring_ctrl back into
+ * ring positions. A flush only counts once all of it is acknowledged. */
+static void stage_acks(struct log_stage *st)
+{
+    struct ring_ctrl *ctrl = st->ring->ctrl;
+    uint64_t received = __atomic_load_n(&ctrl->received_lsn, __ATOMIC_ACQUIRE);
+    uint64_t durable = __atomic_load_n(&ctrl->durable_lsn, __ATOMIC_ACQUIRE);
+
+    while (st->mark_recv < st->mark_tail && st->marks[st->mark_recv % STAGE_MARKS].lsn <= received)
+        __atomic_store_n(&st->received, st->marks[st->mark_recv++ % STAGE_MARKS].end, __ATOMIC_RELEASE);
+    while (st->mark_dur < st->mark_recv && st->marks[st->mark_dur % STAGE_MARKS].lsn <= durable)
+        __atomic_store_n(&st->durable, st->marks[st->mark_dur++ % STAGE_MARKS].end, __ATOMIC_RELEASE);
+}
+
+/* Post everything sealed as one write, split in two where it wraps. */
+static int stage_flush(struct log_stage *st)
+{
+    struct log_ring *ring = st->ring;
+    size_t base = ring->data - st->res->buf;
+    uint64_t off = st->flushed & (ring->size - 1);
+    uint64_t length = st->sealed - st->flushed;
+    uint64_t first = (length < ring->size - off) ? length : ring->size - off;
+    struct rdma_seg segs[2];
+    struct spin_wait w;
+    int n = 0;
+
+    memset(segs, 0, sizeof(segs));
+    // Every flush needs a mark to be acknowledged against; the consumer acks as it goes
+    spin_wait_init(&w, 0);
+    while (st->mark_tail - st->mark_dur == STAGE_MARKS) {
+        if (rdma_reap(st->res) || st->res->failed_status != IBV_WC_SUCCESS)
+            return 1;
+        stage_acks(st);
+        if (st->mark_tail - st->mark_dur == STAGE_MARKS && spin_wait(&w)) {
+            fprintf(stderr, "%d flushes still unacknowledged after %d ms\n", STAGE_MARKS, SPIN_WAIT_TIMEOUT_MS);
+            return 1;
+        }
+    }
+
+    segs[n].offset = base + off;
+    segs[n].length = first;
+    segs[n].cookie = st->flushed + first;
+    n++;
+    if (length > first) {
+        segs[n].offset = base;
+        segs[n].length = length - first;
+        segs[n].cookie = st->sealed;
+        n++;
+    }
+    // Signal every flush: the flusher tells an idle link from its completions
+    if (rdma_write_batch(st->res, segs, n, ring->flush_flags | RDMA_SIGNAL_LAST)) {
+        fprintf(stderr, "failed to flush %lu staged bytes\n", (unsigned long)length);
+        return 1;
+    }
+
+    st->marks[st->mark_tail % STAGE_MARKS].lsn = ring->lsn;
+    st->marks[st->mark_tail % STAGE_MARKS].end = st->sealed;
+    st->mark_tail++;
+    st->flushed = st->sealed;
+    st->flushes++;
+    return 0;
+}
+
+/* Pull the consumer's head back and hand the space it released to the
+ * producers, zeroed. Fails once the head has not moved for
+ * SPIN_WAIT_TIMEOUT_MS of reclaims, w counting them. */
+static int stage_reclaim(struct log_stage *st, struct spin_wait *w)
+{
+    struct log_ring *ring = st->ring;
+
+    if (log_ring_sync_head(st->res, ring))
+        return 1;
+    if (ring->head > st->head) {
+        log_ring_zero(ring, st->head, ring->head - st->head);
+        __atomic_store_n(&st->head, ring->head, __ATOMIC_RELEASE);
+        __atomic_store_n(&st->space_wanted, 0, __ATOMIC_RELAXED);
+        spin_wait_reset(w);
+    } else if (spin_wait(w)) {
+        fprintf(stderr, "ring full for %d ms, consumer stuck at %lu\n", SPIN_WAIT_TIMEOUT_MS,
+                (unsigned long)ring->head);
+        return 1;
+    }
+    return 0;
+}
+
+static void *stage_flusher(void *arg)
+{
+    struct log_stage *st = (struct log_stage *)arg;
+    struct spin_wait reclaim;
+    int spins = 0;
+
+    stats_thread("flusher");
+    spin_wait_init(&reclaim, RING_SPACE_SPINS);
+    for (;;) {
+        uint64_t tail = __atomic_load_n(&st->tail, __ATOMIC_ACQUIRE);
+        int stopping = __atomic_load_n(&st->stop, __ATOMIC_ACQUIRE);
+        int progress = 0;
+
+        // Seal the filled prefix; a record still being filled holds back everything after it
+        while (st->sealed < tail && st->sealed - st->flushed < STAGE_MAX_BATCH) {
+            uint64_t rec = log_ring_stage_seal(st->ring, st->sealed);
+
+            if (!rec)
+                break;
+            st->sealed += rec;
+            progress = 1;
+        }
+
+        if (rdma_reap(st->res) || st->res->failed_status != IBV_WC_SUCCESS)
+            break;
+        stage_acks(st);
+
+        if (st->sealed > st->flushed) {
+            uint64_t pending = st->sealed - st->flushed;
+            uint64_t now = stats_now();
+            int idle = __atomic_load_n(&st->res->done_cookie, __ATOMIC_ACQUIRE) >= st->flushed;
+            int full = pending >= st->batch_bytes;
+
+            if (!st->held_since)
+                st->held_since = now;
+            if (idle || full || stopping || __atomic_load_n(&st->space_wanted, __ATOMIC_RELAXED) ||
+                now - st->held_since >= STAGE_MAX_DELAY_US * 1000ULL) {
+                if (full && st->batch_bytes < STAGE_MAX_BATCH)
+                    st->batch_bytes *= 2;
+                else if (idle && !full && st->batch_bytes > STAGE_MIN_BATCH)
+                    st->batch_bytes /= 2;
+                if (stage_flush(st))
+                    break;
+                st->held_since = 0;
+                progress = 1;
+            }
+        }
+
+        // Producers waiting for space see st->error if the consumer never releases it
+        if (__atomic_load_n(&st->space_wanted, __ATOMIC_ACQUIRE)) {
+            if (stage_reclaim(st, &reclaim))
+                break;
+        } else {
+            spin_wait_reset(&reclaim);
+        }
+
+        if (stopping && st->sealed == tail && st->flushed == st->sealed) {
+            if (rdma_drain(st->res))
+                break;
+            stage_acks(st);
+            return NULL;
+        }
+
+        if (progress)
+            spins = 0;
+        else if (++spins > SPIN_WAIT_SPINS)
+            sched_yield();
+    }
+
+    __atomic_store_n(&st->error, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Start the flusher on a ring the caller has stopped appending to directly.
+ * Until log_stage_stop, only the flusher may use res. */
+int log_stage_start(struct log_stage *st, struct resources *res, struct log_ring *ring)
+{
+    memset(st, 0, sizeof(*st));
+    st->res = res;
+    st->ring = ring;
+    st->tail = st->sealed = st->flushed = ring->tail;
+    st->received = st->durable = ring->tail;
+    st->head = ring->head;
+    st->batch_bytes = STAGE_MIN_BATCH;
+
+    if (log_ring_flush(res, ring))
+        return 1;
+    // Completion is recognised by the stamp's value, so free space must start out clean
+    log_ring_zero(ring, ring->tail, ring->size - (ring->tail - ring->head));
+
+    if (pthread_create(&st->thread, NULL, stage_flusher, st) != 0) {
+        fprintf(stderr, "failed to start the staging flusher\n");
+        return 1;
+    }
+    return 0;
+}
+
+/* Append from any thread. *end, if given, is the position to pass to
+ * log_stage_wait. Returns 0 on success, 1 on failure. */
+int log_stage_append(struct log_stage *st, const void *payload, uint32_t len, uint32_t flag, uint64_t *end)
+{
+    struct log_ring *ring = st->ring;
+    uint64_t rec = log_ring_rec_size(len);
+    uint64_t pos;
+    int spins = 0;
+
+    // Checked before reserving: a reservation is never given back
+    if (rec > ring->size) {
+        fprintf(stderr, "record of %u bytes does not fit in a %lu byte ring\n", len, (unsigned long)ring->size);
+        return 1;
+    }
+
+    pos = __atomic_fetch_add(&st->tail, rec, __ATOMIC_RELAXED);
+    while (pos + rec - __atomic_load_n(&st->head, __ATOMIC_ACQUIRE) > ring->size) {
+        if (__atomic_load_n(&st->error, __ATOMIC_ACQUIRE))
+            return 1;
+        if (!__atomic_load_n(&st->space_wanted, __ATOMIC_RELAXED))
+            __atomic_store_n(&st->space_wanted, 1, __ATOMIC_RELEASE);
+        if (++spins > SPIN_WAIT_SPINS)
+            sched_yield();
+    }
+
+    log_ring_stage_fill(ring, pos, payload, len, flag);
+    if (end)
+        *end = pos + rec;
+    return 0;
+}
+
+/* Wait until the consumer has taken, or with `durable` persisted, every
+ * record up to the position end. */
+int log_stage_wait(struct log_stage *st, uint64_t end, int durable)
+{
+    uint64_t *mark = durable ? &st->durable : &st->received;
+    struct spin_wait w;
+
+    spin_wait_init(&w, SPIN_WAIT_SPINS);
+    while (__atomic_load_n(mark, __ATOMIC_ACQUIRE) < end) {
+        if (__atomic_load_n(&st->error, __ATOMIC_ACQUIRE))
+            return 1;
+        if (spin_wait(&w)) {
+            fprintf(stderr, "position %lu not %s after %d ms\n", (unsigned long)end,
+                    durable ? "durable" : "received", SPIN_WAIT_TIMEOUT_MS);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Flush and drain what the producers staged and stop the flusher; every
+ * producer must be done appending. The ring is left ready for direct use. */
+int log_stage_stop(struct log_stage *st)
+{
+    __atomic_store_n(&st->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(st->thread, NULL);
+
+    st->ring->tail = st->tail;
+    return st->error;
+}
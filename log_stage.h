@@ -0,0 +1,73 @@
+#ifndef LOG_STAGE_H
+#define LOG_STAGE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "rdma.h"
+#include "log_ring.h"
+
+/*
+ * Multi-producer staging on top of a log ring (compute node side).
+ *
+ * Producer threads reserve ring space with one atomic fetch-add on the
+ * shared tail and fill their records in place, concurrently, CRC included.
+ * A single flusher thread walks the filled prefix in ring order, seals each
+ * record with the next LSN and posts everything sealed as one RDMA write
+ * (two if it wraps) - the group commit.
+ *
+ * Batching adapts to load: when no flush is in flight the flusher posts
+ * what it has right away, so an idle system pays no batching delay. While
+ * a flush is in flight it holds records back until batch_bytes have
+ * collected or STAGE_MAX_DELAY_US has passed, doubling batch_bytes when
+ * batches fill up and halving it when the link goes idle with little to
+ * send.
+ *
+ * Producers can wait for their record to be received or made durable by
+ * the logstore: the flusher maps the acknowledged LSNs back to ring
+ * positions, one mark per flush.
+ *
+ * The flusher is the only thread that touches res. Space that the consumer
+ * has released is zeroed locally before producers reuse it, so stale bytes
+ * can never pass for a completed record.
+ */
+
+#define STAGE_MIN_BATCH 512
+#define STAGE_MAX_BATCH (256 * 1024)
+#define STAGE_MAX_DELAY_US 50 // Longest a record waits for its batch to fill
+#define STAGE_MARKS 1024      // Flushes awaiting acknowledgement
+
+struct stage_mark {
+    uint64_t lsn; // Last LSN in the flush
+    uint64_t end; // Ring position the flush ends at
+};
+
+struct log_stage {
+    struct resources *res;
+    struct log_ring *ring;
+    pthread_t thread;
+
+    // Shared with producers, each on its own cache line
+    uint64_t tail __attribute__((aligned(64)));     // Next reservation
+    uint64_t head __attribute__((aligned(64)));     // Space below is zeroed and reusable
+    uint64_t received __attribute__((aligned(64))); // Positions the consumer has taken...
+    uint64_t durable;                               // ...and made durable
+    int space_wanted;
+    int stop;
+    int error;
+
+    // Flusher only
+    uint64_t sealed __attribute__((aligned(64)));   // Records below have their LSN
+    uint64_t flushed;                               // Posted up to here
+    uint64_t batch_bytes;
+    uint64_t held_since;                            // When sealed first ran ahead of flushed, ns
+    struct stage_mark marks[STAGE_MARKS];
+    uint64_t mark_tail, mark_recv, mark_dur;
+    uint64_t flushes;
+};
+
+int log_stage_start(struct log_stage *st, struct resources *res, struct log_ring *ring);
+int log_stage_append(struct log_stage *st, const void *payload, uint32_t len, uint32_t flag, uint64_t *end);
+int log_stage_wait(struct log_stage *st, uint64_t end, int durable);
+int log_stage_stop(struct log_stage *st);
+
+#endif // LOG_STAGE_H
@@ -0,0 +1,31 @@
+#ifndef LOGGING_H
+#define LOGGING_H
+
+#include <stdio.h>
+
+/*
+ * Compile-time log levels for chatter on stdout. Build with
+ * make LOG_LEVEL=n: messages above the level compile to nothing, so the
+ * per-operation and per-record ones cost nothing in a normal build.
+ * Errors go to stderr unconditionally and are not covered here.
+ */
+
+#define LVL_INFO  1 // Setup and teardown, once per connection
+#define LVL_DEBUG 2 // Per record and per operation
+#define LVL_TRACE 3 // Function entry
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LVL_INFO
+#endif
+
+#define pr_at(lvl, ...)                      \
+    do {                                     \
+        if ((lvl) <= LOG_LEVEL)              \
+            fprintf(stdout, __VA_ARGS__);    \
+    } while (0)
+
+#define pr_info(...)  pr_at(LVL_INFO, __VA_ARGS__)
+#define pr_debug(...) pr_at(LVL_DEBUG, __VA_ARGS__)
+#define pr_trace(...) pr_at(LVL_TRACE, __VA_ARGS__)
+
+#endif // LOGGING_H
@@ -1,48 +1,906 @@
+#define _GNU_SOURCE
 #include "rdma.h"
+#include "log_ring.h"
+#include "log_pack.h"
+#include "seg_store.h"
+#include "seg_index.h"
+#include "log_fetch.h"
+#include "log_pipe.h"
+#include "logging.h"
+#include "stats.h"
+#include "crc32c.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <getopt.h>
 
-#define NUM_XLOGS 10
-#define XLOG_SIZE 256
+#define XLOG_MAX_SIZE (64 * 1024) // Largest record taken from a ring
 #define CHECK_INTERVAL_US 1000 // Check every 1ms
+#define NOTIFY_WAIT_MS 10      // CQ wait when every connection announces with immediates
+#define CONSUME_BATCH 64       // Records taken from one connection per sweep
+#define DEFAULT_CONNS 64       // Log regions in the default pool
+#define MAX_POLLERS 64
+#define DEFAULT_FETCH_WINDOW (16UL << 20) // Log bytes served to one fetch connection
+#define FETCH_INDEXES 16 // Stored logs whose index is kept for the next fetch
+#define PIPE_DEPTH 256 // Records of one connection in the pipeline at once, a power of two
 
-struct xlog_entry {
-    uint32_t flag;
-    char data[XLOG_SIZE];
+enum conn_state {
+    CONN_WAIT_DATA,  // Sent our cm_con_data_t, collecting the peer's
+    CONN_WAIT_STRIPES, // Collecting the peer's data for each extra QP
+    CONN_WAIT_READY, // QP is RTS, waiting for the peer's ready byte
+    CONN_LIVE,       // Owned by a poller thread
 };
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+struct ls_conn;
+
+/* A record a poller found and handed to a worker. The worker fills in
+ * everything below v and sets done; the poller retires it from there. */
+struct rec_desc {
+    struct ls_conn *c;
+    struct ring_rec_view v;
+    const char *payload;  // In one piece: in the ring, or in buf if it wraps
+    struct log_unpack it; // A batch's records, expanded into buf
+    uint32_t crc;         // CRC32C of a RING_REC_VALID payload, for the segment store
+    int status;           // Nonzero if the record failed its checks
+    int done;
+    char *buf;            // XLOG_MAX_SIZE + LOG_PACK_MAX_RAW, allocated when first needed
+};
+
+struct ls_conn {
+    struct resources res;
+    struct log_ring ring;
+    struct seg_store store;
+    unsigned id;
+    enum conn_state state;
+    struct cm_con_data_t remote;
+    size_t remote_got;
+    int stripes_up;  // Extra QPs brought up so far
+    uint64_t lsn;
+    uint64_t lsn_base; // Store LSN the peer's ring LSNs count from
+    long received;
+    long batches;    // RING_REC_BATCH records among them
+    char *unpack;    // Expanded batch, allocated with the first compressed one
+    int notified;    // Peer announces batches with immediates, no need to scan
+    int fetch;       // Reads a stored log back instead of appending
+    int shared;      // Appends to the shared log, which poller 0 takes from
+    int window;      // Holds the fetch window
+    int resuming;    // Peer is failing its QPs over; the consumer waits for its replay
+    int resume_qps;  // QPs swapped for spares so far
+    int failovers;
+    int done;
+    struct rec_desc *descs; // Pipeline: PIPE_DEPTH records in flight, in ring order
+    uint64_t issued;        // Records handed to workers...
+    uint64_t retired;       // ...and taken off the ring since
+    uint64_t scan;          // Ring position the next record is looked for at
+    uint64_t scan_lsn;      // Last LSN handed on
+    struct ls_conn *next;
+    struct ls_conn *next_live; // In live_logs while its store is open
+};
+
+struct poller {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct ls_conn *incoming; // Handed over by the accept loop
+    struct ls_conn *conns;    // Owned by the poller
+    struct cq_engine recv_eng; // Immediates for this poller's connections
+    int index;
+};
+
+static struct resources dev;
+static struct poller pollers[MAX_POLLERS];
+static int num_pollers = 1;
+static const char *log_dir;
+static size_t seg_size = SEG_DEFAULT_SIZE;
+static int use_uring = 1;
+static size_t region_size;
+static size_t fetch_window = DEFAULT_FETCH_WINDOW;
+static int window_busy;
+// Fetches come back for the next window; only the accept loop touches these
+static struct fetch_index {
+    struct seg_index ix;
+    unsigned log;
+    int open;
+    uint64_t used; // Fetch count when last used, the least recent is replaced
+} fetch_indexes[FETCH_INDEXES];
+static uint64_t fetches;
+// Connections whose logs are still written, for fetches of them to stop at their durable LSN
+static struct ls_conn *live_logs;
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
+static int shared_log;
+static char *shared_region;      // Shared log, in the device buffer after the fetch window
+static struct log_ring shared_ring;
+static struct seg_store shared_store;
+static uint64_t shared_lsn_base;
+static int shared_failed;
+static struct log_pipe rec_pipe;
+static int num_workers;       // 0 takes records inline in the pollers
+static int stop;
+static int finished_conns;
+
+static void conn_close(struct ls_conn *c)
+{
+    if (log_dir && c->state == CONN_LIVE && !c->fetch && !c->shared) {
+        if (seg_store_close(&c->store) != 0)
+            fprintf(stderr, "Connection %u: failed to make Xlogs durable\n", c->id);
+        // Only now is the whole log durable
+        pthread_mutex_lock(&live_lock);
+        for (struct ls_conn **pc = &live_logs; *pc; pc = &(*pc)->next_live) {
+            if (*pc == c) {
+                *pc = c->next_live;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&live_lock);
+    }
+    if (c->window)
+        __atomic_store_n(&window_busy, 0, __ATOMIC_RELEASE);
+    resources_destroy(&c->res);
+    mem_pool_free(&dev.pool, c->res.buf);
+    free(c->unpack);
+    for (int i = 0; c->descs && i < PIPE_DEPTH; i++)
+        free(c->descs[i].buf);
+    free(c->descs);
+    free(c);
+}
+
+static struct ls_conn *conn_open(int sock, unsigned id)
+{
+    struct cm_con_data_t local;
+    struct ls_conn *c;
+    char *region;
+
+    region = (char *)mem_pool_alloc(&dev.pool);
+    if (!region) {
+        fprintf(stderr, "No free log region for connection %u, pool exhausted\n", id);
+        close(sock);
+        return NULL;
+    }
+
+    c = (struct ls_conn *)calloc(1, sizeof(*c));
+    if (!c) {
+        mem_pool_free(&dev.pool, region);
+        close(sock);
+        return NULL;
+    }
+    c->id = id;
+    c->state = CONN_WAIT_DATA;
+
+    resources_init(&c->res);
+    c->res.sock = sock;
+    c->res.buf = region;
+
+    // Regions are recycled, and the ring relies on consumed space being zero
+    memset(region, 0, region_size);
+    if (shared_region) {
+        c->res.shared_off = shared_region - region;
+        c->res.shared_rkey = dev.mr->rkey;
+        c->res.shared_size = region_size;
+    }
+    if (resources_attach(&c->res, &dev, region, region_size,
+                         dev.srq_depth ? &pollers[id % num_pollers].recv_eng : NULL) != 0 ||
+        log_ring_init(&c->ring, c->res.buf, c->res.buf_size) != 0 ||
+        conn_data_local(&c->res, &local) != 0) {
+        fprintf(stderr, "Failed to set up connection %u\n", id);
+        conn_close(c);
+        return NULL;
+    }
+
+    // Small enough to always fit in an empty socket buffer
+    if (write(sock, &local, sizeof(local)) != sizeof(local)) {
+        fprintf(stderr, "Failed to send connection data to connection %u\n", id);
+        conn_close(c);
+        return NULL;
+    }
+    return c;
+}
+
+/* The connection still appending to log `log`, NULL if none; the caller
+ * holds live_lock. */
+static struct ls_conn *log_writer(unsigned log)
+{
+    for (struct ls_conn *c = live_logs; c; c = c->next_live) {
+        if (c->res.remote_props.log_id == log)
+            return c;
+    }
+    return NULL;
+}
+
+/* How far stored log `log` can be read: the durable LSN of the connection
+ * still appending to it, all of it once none is. */
+static uint64_t log_durable_lsn(unsigned log)
+{
+    uint64_t durable = SEG_INDEX_ALL;
+    struct ls_conn *c;
+
+    pthread_mutex_lock(&live_lock);
+    if ((c = log_writer(log)))
+        durable = seg_store_durable_lsn(&c->store);
+    pthread_mutex_unlock(&live_lock);
+    return durable;
+}
+
+/* The index of stored log `log`, opened on its first fetch and kept for
+ * the next ones: a log read back window by window is walked once. */
+static struct seg_index *fetch_index(unsigned log, const char *dir)
+{
+    struct fetch_index *f = &fetch_indexes[0];
+    uint64_t durable = log_durable_lsn(log);
+
+    for (int i = 0; i < FETCH_INDEXES; i++) {
+        if (fetch_indexes[i].open && fetch_indexes[i].log == log) {
+            f = &fetch_indexes[i];
+            f->ix.durable_lsn = durable;
+            f->used = ++fetches;
+            return &f->ix;
+        }
+        if (!fetch_indexes[i].open || (f->open && fetch_indexes[i].used < f->used))
+            f = &fetch_indexes[i];
+    }
+    if (f->open) {
+        seg_index_close(&f->ix);
+        f->open = 0;
+    }
+    if (seg_index_open(&f->ix, dir, seg_size, 0, durable) != 0)
+        return NULL;
+    f->open = 1;
+    f->log = log;
+    f->used = ++fetches;
+    return &f->ix;
+}
+
+/* Load the log a fetch connection asked for into the window, the head of
+ * the device buffer, and tell the peer where it is. The peer only reads from then on;
+ * the connection lives until it closes. */
+static int conn_serve_fetch(struct ls_conn *c)
+{
+    struct log_fetch_reply reply;
+    struct seg_range range;
+    struct seg_index *ix;
+    struct stat sb;
+    char dir[512];
+
+    memset(&reply, 0, sizeof(reply));
+    snprintf(dir, sizeof(dir), "%s/log-%u", log_dir ? log_dir : "", c->res.remote_props.fetch_log);
+    if (!log_dir || !fetch_window || stat(dir, &sb) != 0) {
+        reply.status = FETCH_NO_LOG;
+    } else if (__atomic_exchange_n(&window_busy, 1, __ATOMIC_ACQ_REL)) {
+        reply.status = FETCH_BUSY;
+    } else {
+        c->window = 1;
+        if (!(ix = fetch_index(c->res.remote_props.fetch_log, dir)) ||
+            seg_index_load(ix, c->res.remote_props.fetch_lsn, dev.buf, fetch_window, &range) != 0) {
+            reply.status = FETCH_FAILED;
+        } else {
+            // Region addresses differ by transport, offsets between them don't
+            reply.rkey = dev.mr->rkey;
+            reply.offset = dev.buf - c->res.buf;
+            reply.bytes = range.bytes;
+            reply.first_lsn = range.first_lsn;
+            reply.last_lsn = range.last_lsn;
+            reply.more = range.more;
+        }
+    }
+
+    if (reply.status == FETCH_OK)
+        printf("Connection %u fetches log %u: LSN %lu to %lu, %lu bytes%s\n", c->id,
+               c->res.remote_props.fetch_log, (unsigned long)reply.first_lsn, (unsigned long)reply.last_lsn,
+               (unsigned long)reply.bytes, reply.more ? ", more to come" : "");
+    else
+        fprintf(stderr, "Connection %u: not serving log %u, status %u\n", c->id,
+                c->res.remote_props.fetch_log, reply.status);
+    return log_fetch_reply_send(c->res.sock, &reply);
+}
+
+/* Advance a handshake when its socket is readable. Returns 1 once the
+ * connection is live, 0 if more data is needed and -1 on failure. */
+static int conn_handshake(struct ls_conn *c)
+{
+    struct cm_con_data_t local;
+    ssize_t n;
+    char ready;
+
+    if (c->state == CONN_WAIT_DATA) {
+        int rc = conn_data_recv(c->res.sock, &c->remote, &c->remote_got);
+
+        if (rc <= 0)
+            return rc;
+
+        if (conn_data_apply(&c->res, &c->remote) != 0)
+            return -1;
+        if (c->res.remote_props.size != c->res.buf_size) {
+            fprintf(stderr, "Connection %u: log ring size mismatch: local %u, remote %u\n",
+                    c->id, c->res.buf_size, c->res.remote_props.size);
+            return -1;
+        }
+
+        // Extra QPs the peer stripes over all write into the same region
+        for (int i = 1; i < (int)c->res.remote_props.nqps && i < RDMA_MAX_QPS; i++) {
+            if (resources_add_stripe(&c->res, i) != 0 ||
+                conn_data_local(c->res.stripe[i - 1], &local) != 0 ||
+                write(c->res.sock, &local, sizeof(local)) != sizeof(local)) {
+                fprintf(stderr, "Connection %u: failed to set up QP %d\n", c->id, i);
+                return -1;
+            }
+        }
+        c->remote_got = 0;
+        c->state = CONN_WAIT_STRIPES;
+    }
+
+    if (c->state == CONN_WAIT_STRIPES) {
+        while (c->stripes_up < c->res.nstripes) {
+            int rc = conn_data_recv(c->res.sock, &c->remote, &c->remote_got);
+
+            if (rc <= 0)
+                return rc;
+            if (conn_data_apply(c->res.stripe[c->stripes_up], &c->remote) != 0)
+                return -1;
+            c->stripes_up++;
+            c->remote_got = 0;
+        }
+        if (c->res.nstripes)
+            printf("Connection %u stripes over %d QPs\n", c->id, c->res.nstripes + 1);
+        // Only peers that fail over themselves need spares on this side
+        if ((c->res.remote_props.flags & CM_FLAG_RECOVER) && resources_add_spare(&c->res) != 0)
+            return -1;
+        if (write(c->res.sock, "R", 1) != 1)
+            return -1;
+        c->state = CONN_WAIT_READY;
+        return 0;
+    }
+
+    n = read(c->res.sock, &ready, 1);
+    if (n <= 0)
+        return (n < 0 && errno == EAGAIN) ? 0 : -1;
+    return 1;
+}
+
+static int conn_go_live(struct ls_conn *c)
+{
+    struct poller *p = &pollers[c->id % num_pollers];
+
+    if (c->res.remote_props.fetch_lsn) {
+        c->fetch = 1;
+        if (conn_serve_fetch(c) != 0)
+            return 1;
+    } else if (c->res.remote_props.flags & CM_FLAG_SHARED) {
+        if (!shared_region) {
+            fprintf(stderr, "Connection %u: asks for a shared log, start with -G to offer one\n", c->id);
+            return 1;
+        }
+        c->shared = 1;
+    } else if (log_dir) {
+        uint32_t log = c->res.remote_props.log_id;
+        struct ls_conn *writer;
+        unsigned writer_id = 0;
+        char dir[512];
+
+        // Logs are named by the writer, so a restarted compute node finds its own again
+        if (!log) {
+            fprintf(stderr, "Connection %u: sends no log id, its Xlogs can't be persisted\n", c->id);
+            return 1;
+        }
+        // Only the accept loop adds writers, so the log can't be taken between here and going live
+        pthread_mutex_lock(&live_lock);
+        if ((writer = log_writer(log)))
+            writer_id = writer->id;
+        pthread_mutex_unlock(&live_lock);
+        if (writer) {
+            fprintf(stderr, "Connection %u: log %u is still being written by connection %u\n", c->id, log,
+                    writer_id);
+            return 1;
+        }
+        snprintf(dir, sizeof(dir), "%s/log-%u", log_dir, log);
+        if (seg_store_open(&c->store, dir, seg_size, use_uring) != 0) {
+            fprintf(stderr, "Failed to open segment store in %s\n", dir);
+            return 1;
+        }
+        c->lsn = seg_store_durable_lsn(&c->store);
+        c->lsn_base = c->lsn;
+    }
+    if (num_workers && !c->fetch && !c->shared &&
+        !(c->descs = (struct rec_desc *)calloc(PIPE_DEPTH, sizeof(*c->descs)))) {
+        // conn_close only closes the store of a live connection
+        if (log_dir)
+            seg_store_close(&c->store);
         return 1;
     }
+    c->state = CONN_LIVE;
+    if (log_dir && !c->fetch && !c->shared) {
+        pthread_mutex_lock(&live_lock);
+        c->next_live = live_logs;
+        live_logs = c;
+        pthread_mutex_unlock(&live_lock);
+    }
 
-    int port = atoi(argv[1]);
-    printf("LogStore starting on port %d\n", port);
+    printf("Connection %u established, polled by thread %d. Waiting for Xlogs...\n", c->id, p->index);
+    if (c->shared)
+        printf("Connection %u appends to the shared log\n", c->id);
+    else if (!c->fetch && (c->res.remote_props.flags & CM_FLAG_PACK))
+        printf("Connection %u packs its Xlogs into batches\n", c->id);
+    if (log_dir && !c->fetch && !c->shared)
+        printf("Connection %u appends to log %u\n", c->id, c->res.remote_props.log_id);
 
-    struct resources res;
-    struct sockaddr_in addr;
-    resources_init(&res);
+    pthread_mutex_lock(&p->lock);
+    c->next = p->incoming;
+    p->incoming = c;
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
 
-    config.tcp_port = port;
+/* Whether the peer sent something on the socket (1), went away (-1) or
+ * neither (0). */
+static int conn_peer_poll(struct ls_conn *c)
+{
+    char b;
+    ssize_t n = recv(c->res.sock, &b, 1, MSG_DONTWAIT | MSG_PEEK);
 
-    if (resources_create(&res) != 0) {
-        fprintf(stderr, "Failed to create RDMA resources\n");
+    if (n > 0)
         return 1;
+    return (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) ? -1 : 0;
+}
+
+/* A peer that went away without an end-of-stream record. */
+static int conn_peer_closed(struct ls_conn *c)
+{
+    return conn_peer_poll(c) < 0;
+}
+
+/* The peer fails its QPs over (rdma_reconnect): for each QP in turn take
+ * its new connection data, swap our spare in and answer with the spare's.
+ * Then wait for its go-ahead, which comes once it has replayed what we
+ * had not taken, or for another round; consuming stays off until then. Returns 1 once done, 0 if
+ * more is needed and -1 on failure. */
+static int conn_resume(struct ls_conn *c)
+{
+    struct cm_con_data_t local;
+    ssize_t n;
+    char ready;
+
+    if (!c->resuming) {
+        c->resuming = 1;
+        c->resume_qps = 0;
+        c->remote_got = 0;
     }
 
-    printf("Waiting for RDMA connection...\n");
+    while (c->resume_qps <= c->res.nstripes) {
+        struct resources *q = c->resume_qps ? c->res.stripe[c->resume_qps - 1] : &c->res;
+        int rc = conn_data_recv(c->res.sock, &c->remote, &c->remote_got);
 
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (rc <= 0)
+            return rc;
+        if (!(ntohs(c->remote.flags) & CM_FLAG_RECONNECT)) {
+            fprintf(stderr, "Connection %u: unexpected handshake data\n", c->id);
+            return -1;
+        }
+        if (rdma_qp_swap(q) != 0 || conn_data_apply(q, &c->remote) != 0 || conn_data_local(q, &local) != 0)
+            return -1;
+        local.flags |= htons(CM_FLAG_RECONNECT);
+        if (write(c->res.sock, &local, sizeof(local)) != sizeof(local))
+            return -1;
+        c->resume_qps++;
+        c->remote_got = 0;
+    }
+
+    // Either the go-ahead, or the next round if the replay failed on the new QPs too
+    n = recv(c->res.sock, &ready, 1, MSG_PEEK);
+    if (n <= 0)
+        return (n < 0 && errno == EAGAIN) ? 0 : -1;
+    if (ready != CM_RECONNECT_DONE) {
+        c->resume_qps = 0;
+        return 0;
+    }
+    if (read(c->res.sock, &ready, 1) != 1)
+        return -1;
+
+    c->resuming = 0;
+    c->failovers++;
+    // Our last acknowledgement may have gone down with the old QP
+    c->ring.acked_lsn = 0;
+    c->ring.acked_durable = 0;
+    printf("Connection %u failed over to spare QPs, resuming at LSN %lu\n", c->id, (unsigned long)c->ring.lsn + 1);
+    return 1;
+}
+
+/* Whether an immediate on any of the connection's QPs announced records
+ * past pos. Each QP only vouches for its own writes, but the ring's marks
+ * hold the consumer back until the record at pos is complete. */
+static int conn_notified(const struct ls_conn *c, uint64_t pos)
+{
+    if (log_ring_notified(&c->res, pos))
+        return 1;
+    for (int i = 0; i < c->res.nstripes; i++) {
+        if (log_ring_notified(c->res.stripe[i], pos))
+            return 1;
+    }
+    return 0;
+}
+
+/* Take one Xlog in LSN order: persist it if the store is on, with its
+ * CRC32C if a worker computed that already. */
+static int conn_apply(struct ls_conn *c, const void *xlog, uint32_t len, const uint32_t *crc)
+{
+    pr_debug("Connection %u: received Xlog %ld: %.*s\n", c->id, c->received, (int)len, (const char *)xlog);
+    c->received++;
+    c->lsn++;
+    if (log_dir && (crc ? seg_store_append_crc(&c->store, c->lsn, xlog, len, *crc)
+                        : seg_store_append(&c->store, c->lsn, xlog, len)) != 0) {
+        fprintf(stderr, "Connection %u: failed to persist Xlog at LSN %lu\n", c->id, (unsigned long)c->lsn);
+        return 1;
+    }
+    return 0;
+}
+
+/* Take the records of an expanded batch, which must hold exactly the LSNs
+ * up to last. */
+static int conn_apply_unpacked(struct ls_conn *c, struct log_unpack *it, uint64_t last)
+{
+    const void *xlog;
+    uint32_t n;
+    int rc;
+
+    while ((rc = log_unpack_next(it, &xlog, &n)) > 0) {
+        if (conn_apply(c, xlog, n, NULL) != 0)
+            return 1;
+    }
+    if (rc < 0 || c->lsn != c->lsn_base + last) {
+        fprintf(stderr, "Connection %u: malformed batch ending at LSN %lu\n", c->id, (unsigned long)last);
+        return 1;
+    }
+    c->batches++;
+    return 0;
+}
+
+/* A batch is only expanded now that it has been taken off the ring, and
+ * must hold exactly the LSNs the ring moved past. */
+static int conn_apply_batch(struct ls_conn *c, const char *batch, uint32_t len)
+{
+    struct log_unpack it;
+
+    if (!c->unpack && !(c->unpack = (char *)malloc(LOG_PACK_MAX_RAW)))
+        return 1;
+    if (log_unpack_open(&it, batch, len, c->unpack, LOG_PACK_MAX_RAW) != 0)
+        return 1;
+    return conn_apply_unpacked(c, &it, c->ring.lsn);
+}
+
+static void conn_finished(struct ls_conn *c)
+{
+    if (c->batches)
+        printf("Connection %u: all %ld Xlogs received successfully, in %ld batches.\n", c->id, c->received,
+               c->batches);
+    else
+        printf("Connection %u: all %ld Xlogs received successfully.\n", c->id, c->received);
+    c->done = 1;
+}
+
+/* Worker side of the pipeline: check a record, expand it if it is a batch
+ * and checksum it for the segment store, off the poller's thread. */
+static void rec_work(void *arg)
+{
+    struct rec_desc *d = (struct rec_desc *)arg;
+    struct log_ring *ring = &d->c->ring;
+    int rc = 0;
+
+    if (!(d->payload = (const char *)log_ring_payload(ring, &d->v, d->buf)) || d->v.hdr.type == RING_REC_BATCH) {
+        if (!d->buf && !(d->buf = (char *)malloc(XLOG_MAX_SIZE + LOG_PACK_MAX_RAW)))
+            rc = 1;
+        else if (!d->payload)
+            d->payload = (const char *)log_ring_payload(ring, &d->v, d->buf);
+    }
+    if (!rc)
+        rc = log_ring_verify(&d->v, d->payload);
+    if (!rc && d->v.hdr.type == RING_REC_BATCH)
+        rc = log_unpack_open(&d->it, d->payload, d->v.hdr.len, d->buf + XLOG_MAX_SIZE, LOG_PACK_MAX_RAW);
+    else if (!rc && log_dir)
+        d->crc = crc32c(0, d->payload, d->v.hdr.len);
+    d->status = rc;
+    __atomic_store_n(&d->done, 1, __ATOMIC_RELEASE);
+}
+
+/* Retirement: take the records workers are done with off the ring, in
+ * order, persisting them on the way. The first one not done yet holds
+ * back everything behind it. Returns how many were taken. */
+static int conn_retire(struct ls_conn *c)
+{
+    int taken = 0;
+
+    while (c->retired < c->issued && !c->done) {
+        struct rec_desc *d = &c->descs[c->retired & (PIPE_DEPTH - 1)];
+        int rc = 0;
+
+        if (!__atomic_load_n(&d->done, __ATOMIC_ACQUIRE))
+            break;
+        if (d->status)
+            rc = 1;
+        else if (d->v.hdr.type == RING_REC_EOS)
+            conn_finished(c);
+        else if (d->v.hdr.type == RING_REC_BATCH)
+            rc = conn_apply_unpacked(c, &d->it, log_ring_last_lsn(&d->v));
+        else
+            rc = conn_apply(c, d->payload, d->v.hdr.len, log_dir ? &d->crc : NULL);
+        if (rc) {
+            c->done = 1;
+            break;
+        }
+        log_ring_release(&c->ring, &d->v);
+        c->retired++;
+        taken++;
+    }
+    return taken;
+}
+
+/* Wait for the workers to finish with the connection's records, which
+ * point into its ring, before it is closed. */
+static void conn_drain(struct ls_conn *c)
+{
+    for (uint64_t i = c->retired; i < c->issued; i++) {
+        while (!__atomic_load_n(&c->descs[i & (PIPE_DEPTH - 1)].done, __ATOMIC_ACQUIRE))
+            sched_yield();
+    }
+}
+
+/* Detection: hand up to CONSUME_BATCH records that have landed past what
+ * the workers have so far to them, as long as the connection has room in
+ * the pipeline and the poller's queues do. Returns how many records moved
+ * on, handed over or retired. */
+static int conn_pipeline(struct ls_conn *c, struct poller *p)
+{
+    int moved = conn_retire(c);
+    int found;
+
+    for (found = 0; found < CONSUME_BATCH && !c->done; found++) {
+        struct rec_desc *d = &c->descs[c->issued & (PIPE_DEPTH - 1)];
+        int rc;
+
+        if (c->issued - c->retired == PIPE_DEPTH) {
+            STATS_ADD(pipe_stalls, 1);
+            break;
+        }
+        // Nothing past the last announced position is known to have landed
+        if (c->notified && !conn_notified(c, c->scan))
+            break;
+
+        rc = log_ring_peek(&c->ring, c->scan, c->scan_lsn + 1, &d->v);
+        if (rc > 0 && d->v.hdr.len > XLOG_MAX_SIZE) {
+            fprintf(stderr, "ring record of %u bytes exceeds buffer of %u\n", d->v.hdr.len, XLOG_MAX_SIZE);
+            rc = -1;
+        }
+        if (rc < 0)
+            c->done = 1;
+        if (rc <= 0)
+            break;
+
+        d->c = c;
+        d->status = 0;
+        // End of stream has nothing to check and is the last record
+        d->done = d->v.hdr.type == RING_REC_EOS;
+        if (!d->done && log_pipe_submit(&rec_pipe, p->index, d)) {
+            STATS_ADD(pipe_stalls, 1);
+            break;
+        }
+        c->issued++;
+        c->scan += d->v.size;
+        c->scan_lsn = log_ring_last_lsn(&d->v);
+        if (d->v.hdr.type == RING_REC_EOS)
+            break;
+    }
+    return moved + found + conn_retire(c);
+}
+
+/* Consume up to CONSUME_BATCH records, through the workers if there are
+ * any; returns how many were taken. */
+static int conn_consume(struct ls_conn *c, struct poller *p)
+{
+    char xlog[XLOG_MAX_SIZE];
+    uint32_t len, flag;
+    int taken;
+
+    // Nothing to take: a fetch only reads, a shared log writer writes elsewhere
+    if (c->fetch || c->shared) {
+        if (conn_peer_closed(c)) {
+            printf("Connection %u: %s\n", c->id, c->fetch ? "log fetch finished" : "left the shared log");
+            c->done = 1;
+        }
+        return 0;
+    }
+
+    if (!c->notified && conn_notified(c, c->ring.head)) {
+        printf("Connection %u announces Xlogs with immediates, no longer scanning\n", c->id);
+        c->notified = 1;
+    }
+    if (c->descs)
+        return conn_pipeline(c, p);
+
+    for (taken = 0; taken < CONSUME_BATCH; taken++) {
+        int rc;
+
+        // Nothing past the last announced position is known to have landed
+        if (c->notified && !conn_notified(c, c->ring.head))
+            break;
+
+        rc = log_ring_consume(&c->ring, xlog, sizeof(xlog), &len, &flag);
+
+        if (rc < 0) {
+            c->done = 1;
+            break;
+        }
+        if (rc == 0)
+            break;
+        if (flag == RING_REC_EOS) {
+            conn_finished(c);
+            break;
+        }
+
+        if (flag == RING_REC_BATCH ? conn_apply_batch(c, xlog, len) : conn_apply(c, xlog, len, NULL)) {
+            c->done = 1;
+            break;
+        }
+    }
+    return taken;
+}
+
+/* Take up to CONSUME_BATCH records off the shared log, in the order their
+ * ranges were reserved, and number them from the store's last LSN on.
+ * Writers learn what was taken from the head alone, so nothing is acked.
+ * Returns how many were taken. */
+static int shared_consume(void)
+{
+    char xlog[XLOG_MAX_SIZE];
+    uint32_t len, flag;
+    int taken;
+
+    for (taken = 0; taken < CONSUME_BATCH && !shared_failed; taken++) {
+        uint64_t lsn;
+        int rc = log_ring_consume(&shared_ring, xlog, sizeof(xlog), &len, &flag);
+
+        if (rc == 0)
+            break;
+        if (rc > 0 && flag != RING_REC_VALID) {
+            fprintf(stderr, "Shared log: unexpected record type %u\n", flag);
+            rc = -1;
+        }
+        lsn = shared_lsn_base + shared_ring.lsn;
+        if (rc > 0 && log_dir && seg_store_append(&shared_store, lsn, xlog, len) != 0) {
+            fprintf(stderr, "Shared log: failed to persist Xlog at LSN %lu\n", (unsigned long)lsn);
+            rc = -1;
+        }
+        // The writers stall behind the head from here on
+        if (rc < 0) {
+            fprintf(stderr, "Shared log: stopped at position %lu\n", (unsigned long)shared_ring.head);
+            shared_failed = 1;
+            break;
+        }
+        pr_debug("Shared log: Xlog at LSN %lu: %.*s\n", (unsigned long)lsn, (int)len, xlog);
+    }
+    return taken;
+}
+
+/* Tell the compute node how far its ring has been taken and persisted. */
+static int conn_ack(struct ls_conn *c)
+{
+    uint64_t durable = c->ring.lsn;
+
+    if (log_dir) {
+        uint64_t store = seg_store_durable_lsn(&c->store);
+
+        durable = store > c->lsn_base ? store - c->lsn_base : 0;
+    }
+    return log_ring_ack(&c->res, &c->ring, durable);
+}
+
+static void *poller_thread(void *arg)
+{
+    struct poller *p = (struct poller *)arg;
+    char name[16];
+
+    snprintf(name, sizeof(name), "poller-%d", p->index);
+    stats_thread(name);
+    // With a pipeline the pollers take the first cores, the workers the next
+    if (num_workers)
+        log_pipe_pin(p->index);
+
+    while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE) || p->conns || p->incoming) {
+        struct ls_conn **pc, *c;
+        int scanning = 0;
+        int busy = 0;
+
+        pthread_mutex_lock(&p->lock);
+        while ((c = p->incoming)) {
+            p->incoming = c->next;
+            c->next = p->conns;
+            p->conns = c;
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        // Writers to the shared log don't announce, so it is always scanned
+        if (p->index == 0 && shared_region) {
+            busy |= shared_consume();
+            scanning = 1;
+        }
+
+        for (pc = &p->conns; (c = *pc);) {
+            int taken = c->resuming ? 0 : conn_consume(c, p);
+            int in_flight = c->issued != c->retired;
+            int peer = 0;
+
+            busy |= taken || in_flight;
+            if (!taken && !c->done)
+                peer = c->resuming ? 1 : conn_peer_poll(c);
+            // Records the workers still have point into the ring, which the failover may rewrite
+            if (peer > 0 && c->res.spare_qp && !in_flight) {
+                if (conn_resume(c) < 0) {
+                    fprintf(stderr, "Connection %u: failover to spare QPs failed\n", c->id);
+                    c->done = 1;
+                }
+            } else if (peer < 0) {
+                // Whatever the peer wrote before closing has landed; its immediates may still be queued
+                if (dev.srq_depth)
+                    rdma_reap_recv(&dev, &p->recv_eng, 0);
+                taken = conn_consume(c, p);
+                busy |= taken;
+                if (!taken && !c->done && c->issued == c->retired) {
+                    fprintf(stderr, "Connection %u closed by peer after %ld Xlogs\n", c->id, c->received);
+                    c->done = 1;
+                }
+            }
+            // A QP that errored is left to the peer's failover if it can do one
+            if (!c->done && !c->fetch && !c->shared && !c->resuming &&
+                !(c->res.spare_qp && c->res.failed_status != IBV_WC_SUCCESS) && conn_ack(c) != 0)
+                c->done = 1;
+            if (c->done) {
+                *pc = c->next;
+                conn_drain(c);
+                conn_close(c);
+                __atomic_add_fetch(&finished_conns, 1, __ATOMIC_RELEASE);
+                continue;
+            }
+            // Group commits finish on their own, so an owed durable ack needs rechecking too
+            scanning |= c->fetch || c->shared || c->resuming || !c->notified || c->ring.acked_durable < c->ring.lsn;
+            pc = &c->next;
+        }
+
+        // Completions from every connection land on the shared CQ
+        if (dev.nconns)
+            rdma_reap(&dev);
+
+        if (!dev.srq_depth) {
+            if (!busy)
+                usleep(CHECK_INTERVAL_US);
+            continue;
+        }
+
+        /* Immediates keep the SRQ draining even for scanned connections.
+         * When idle, sleep on the CQ: an arrival wakes us right away, and
+         * connections still being scanned are rechecked every interval. */
+        if (busy)
+            rdma_reap_recv(&dev, &p->recv_eng, 0);
+        else
+            rdma_reap_recv(&dev, &p->recv_eng, scanning || !p->conns ? CHECK_INTERVAL_US / 1000 : NOTIFY_WAIT_MS);
+    }
+    return NULL;
+}
+
+static int listen_socket(int port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int sockfd;
+
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (sockfd < 0) {
         fprintf(stderr, "Failed to create socket\n");
-        return 1;
+        return -1;
     }
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
@@ -51,44 +909,250 @@ int main(int argc, char *argv[]) {
 
     if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         fprintf(stderr, "Failed to bind to port\n");
-        return 1;
+        close(sockfd);
+        return -1;
     }
 
-    if (listen(sockfd, 1) < 0) {
+    if (listen(sockfd, SOMAXCONN) < 0) {
         fprintf(stderr, "Failed to listen on socket\n");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+int main(int argc, char *argv[]) {
+    struct epoll_event ev, events[64];
+    unsigned next_id = 0;
+    int max_conns = 0;
+    int usage = 0;
+    int opt;
+
+    // Pollers sleep on their receive CQ once connections announce with immediates
+    config.cq_mode = CQ_MODE_HYBRID;
+
+    while ((opt = getopt(argc, argv, "P:H:D:S:UW:Gt:w:n:c:T:M:")) != -1) {
+        switch (opt) {
+        case 'D':
+            log_dir = optarg;
+            break;
+        case 'S':
+            seg_size = (size_t)atol(optarg) << 20;
+            break;
+        case 'U':
+            use_uring = 0;
+            break;
+        case 'W':
+            fetch_window = (size_t)atol(optarg) << 20;
+            break;
+        case 'G':
+            shared_log = 1;
+            break;
+        case 'P':
+            config.pool_size = (size_t)atol(optarg) << 20;
+            break;
+        case 'H':
+            if (mem_pool_parse_page(optarg, &config.hugepage_size))
+                return 1;
+            break;
+        case 't':
+            num_pollers = atoi(optarg);
+            break;
+        case 'w':
+            num_workers = atoi(optarg);
+            break;
+        case 'n':
+            max_conns = atoi(optarg);
+            break;
+        case 'c':
+            if (cq_mode_parse(optarg, &config.cq_mode))
+                return 1;
+            break;
+        case 'T':
+            if (transport_parse(optarg, &config.transport))
+                return 1;
+            break;
+        case 'M':
+            config.mtu = atoi(optarg);
+            break;
+        default:
+            usage = 1;
+            break;
+        }
+    }
+
+    if (usage || argc - optind != 1 || num_pollers < 1 || num_pollers > MAX_POLLERS || num_workers < 0 ||
+        num_workers > PIPE_MAX_WORKERS || fetch_window > UINT32_MAX) {
+        fprintf(stderr, "Usage: %s [-P pool_mb] [-H none|2m|1g] [-D log_dir [-S segment_mb] [-U] [-W window_mb]]\n"
+                "          [-G] [-t poller_threads] [-w worker_threads] [-n exit_after_conns] [-c busy|event|hybrid]\n"
+                "          [-T verbs|shm] [-M mtu] <port>\n", argv[0]);
+        fprintf(stderr, "  -D persists received xlogs to segment files, -U disables io_uring\n");
+        fprintf(stderr, "  -W sizes the window stored logs are fetched back through by RDMA READ (default %lu, 0 disables)\n",
+                DEFAULT_FETCH_WINDOW >> 20);
+        fprintf(stderr, "  -G offers a shared log that compute nodes started with -G append to together\n");
+        fprintf(stderr, "  -w checks and persists records on that many worker threads, the pollers only finding them;\n"
+                "     pollers and workers are then pinned to a core each\n");
+        fprintf(stderr, "  -c sets how pollers wait for immediate notifications (default hybrid)\n");
+        return 1;
+    }
+
+    int port = atoi(argv[optind]);
+    printf("LogStore starting on port %d\n", port);
+    // Readable with rdma_stats <pid> while running
+    if (stats_open() == 0)
+        atexit(stats_close);
+    stats_thread("accept");
+
+    // Every connection gets one pool chunk as its log region
+    region_size = log_ring_region_size(RDMA_BUFFER_SIZE);
+    config.tcp_port = port;
+    config.chunk_size = (region_size + 4095) & ~(size_t)4095;
+    if (config.pool_size < DEFAULT_CONNS * config.chunk_size)
+        config.pool_size = DEFAULT_CONNS * config.chunk_size;
+    // The device buffer, the pool's reserved head, holds the fetch window, then the shared log
+    if (!log_dir)
+        fetch_window = 0;
+    if (fetch_window || shared_log) {
+        config.buf_size = fetch_window + (shared_log ? config.chunk_size : 0);
+        config.pool_size += config.buf_size;
+    }
+    config.cq_depth = 4096;
+    config.srq_depth = DEFAULT_SRQ_DEPTH;
+    config.num_qps = RDMA_MAX_QPS; // Accept as many as a compute node asks for
+    config.spare_qps = 1;          // Take failovers from compute nodes that keep spares
+    config.pack = 1;               // ...and packed batches from those that send them
+
+    if (log_dir && mkdir(log_dir, 0755) && errno != EEXIST) {
+        fprintf(stderr, "Failed to create %s: %s\n", log_dir, strerror(errno));
         return 1;
     }
 
-    res.sock = accept(sockfd, NULL, NULL);
-    if (res.sock < 0) {
-        fprintf(stderr, "Failed to accept connection\n");
+    resources_init(&dev);
+    if (resources_create_device(&dev) != 0) {
+        fprintf(stderr, "Failed to create RDMA resources\n");
         return 1;
     }
 
-    if (connect_qp(&res) != 0) {
-        fprintf(stderr, "Failed to connect QPs\n");
+    if (shared_log) {
+        shared_region = dev.buf + fetch_window;
+        memset(shared_region, 0, region_size);
+        if (log_ring_init(&shared_ring, shared_region, region_size) != 0)
+            return 1;
+        shared_ring.shared = 1;
+        if (log_dir) {
+            char dir[512];
+
+            snprintf(dir, sizeof(dir), "%s/shared", log_dir);
+            if (seg_store_open(&shared_store, dir, seg_size, use_uring) != 0) {
+                fprintf(stderr, "Failed to open segment store in %s\n", dir);
+                return 1;
+            }
+            shared_lsn_base = seg_store_durable_lsn(&shared_store);
+        }
+        printf("Offering a shared log of %lu bytes\n", (unsigned long)shared_ring.size);
+    }
+
+    if (num_workers) {
+        if (log_pipe_start(&rec_pipe, num_pollers, num_workers, num_pollers, rec_work) != 0)
+            return 1;
+        printf("Pipeline: %d poller(s) hand records to %d worker(s)\n", num_pollers, num_workers);
+    }
+
+    for (int i = 0; i < num_pollers; i++) {
+        pollers[i].index = i;
+        pthread_mutex_init(&pollers[i].lock, NULL);
+        // Room for every SRQ receive, however the connections are spread
+        if (dev.srq_depth && resources_create_cq(&dev, &pollers[i].recv_eng, dev.srq_depth + 1)) {
+            fprintf(stderr, "Failed to create receive CQ for poller thread %d\n", i);
+            return 1;
+        }
+        if (pthread_create(&pollers[i].thread, NULL, poller_thread, &pollers[i])) {
+            fprintf(stderr, "Failed to start poller thread %d\n", i);
+            return 1;
+        }
+    }
+
+    int sockfd = listen_socket(port);
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (sockfd < 0 || epfd < 0) {
+        fprintf(stderr, "Failed to set up the accept loop\n");
         return 1;
     }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev);
+
+    printf("Waiting for RDMA connections...\n");
 
-    printf("RDMA connection established. Waiting for Xlogs...\n");
+    while (!max_conns || __atomic_load_n(&finished_conns, __ATOMIC_ACQUIRE) < max_conns) {
+        int n = epoll_wait(epfd, events, 64, 100);
 
-    struct xlog_entry *xlog_buffer = (struct xlog_entry *)res.buf;
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
 
-    int xlogs_received = 0;
-    while (xlogs_received < NUM_XLOGS) {
-        for (int i = 0; i < NUM_XLOGS; i++) {
-            if (xlog_buffer[i].flag == 1) {
-                printf("Received Xlog %d: %s\n", i, xlog_buffer[i].data);
-                xlog_buffer[i].flag = 0;  // Reset the flag
-                xlogs_received++;
+        for (int i = 0; i < n; i++) {
+            struct ls_conn *c = (struct ls_conn *)events[i].data.ptr;
+            int rc;
+
+            if (!c) {
+                int fd;
+
+                while ((fd = accept4(sockfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    c = conn_open(fd, next_id++);
+                    if (!c)
+                        continue;
+                    ev.events = EPOLLIN | EPOLLRDHUP;
+                    ev.data.ptr = c;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+                }
+                continue;
+            }
+
+            rc = conn_handshake(c);
+            if (rc == 0)
+                continue;
+
+            // Handshake over either way; a live connection's socket belongs to its poller
+            epoll_ctl(epfd, EPOLL_CTL_DEL, c->res.sock, NULL);
+            if (rc < 0 || conn_go_live(c) != 0) {
+                fprintf(stderr, "Handshake with connection %u failed\n", c->id);
+                conn_close(c);
             }
         }
-        usleep(CHECK_INTERVAL_US);
     }
 
-    printf("All Xlogs received successfully.\n");
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < num_pollers; i++) {
+        pthread_join(pollers[i].thread, NULL);
+        if (dev.srq_depth)
+            cq_engine_destroy(&pollers[i].recv_eng);
+    }
+    if (num_workers) {
+        log_pipe_stop(&rec_pipe);
+        for (int i = 0; i < num_workers; i++)
+            printf("Worker %d checked %lu records\n", i, (unsigned long)rec_pipe.workers[i].items);
+    }
+
+    for (int i = 0; i < FETCH_INDEXES; i++) {
+        if (fetch_indexes[i].open) {
+            seg_index_print(stdout, &fetch_indexes[i].ix);
+            seg_index_close(&fetch_indexes[i].ix);
+        }
+    }
+
+    if (shared_region) {
+        printf("Shared log: %lu Xlogs published\n", (unsigned long)shared_ring.lsn);
+        if (log_dir && seg_store_close(&shared_store) != 0)
+            fprintf(stderr, "Shared log: failed to make Xlogs durable\n");
+    }
 
-    resources_destroy(&res);
+    close(epfd);
+    close(sockfd);
+    resources_destroy(&dev);
 
+    stats_print(stdout, stats_page());
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,219 @@
+#include "lz4_block.h"
+#include <string.h>
+
+#ifdef HAVE_LIBLZ4
+#include <lz4.h>
+
+const char *lz4_impl(void)
+{
+    return "liblz4";
+}
+
+uint32_t lz4_compress(const void *src, uint32_t len, void *dst, uint32_t cap)
+{
+    int n = LZ4_compress_default((const char *)src, (char *)dst, (int)len, (int)cap);
+
+    return n > 0 ? (uint32_t)n : 0;
+}
+
+int lz4_decompress(const void *src, uint32_t len, void *dst, uint32_t cap)
+{
+    int n = LZ4_decompress_safe((const char *)src, (char *)dst, (int)len, (int)cap);
+
+    return n < 0 ? -1 : n;
+}
+
+#else
+
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // A block always ends in at least this many literals
+#define LZ4_MFLIMIT 12      // ...and no match starts closer than this to its end
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_SKIP_TRIGGER 6  // Misses in a row before the search step grows by one
+
+const char *lz4_impl(void)
+{
+    return "builtin";
+}
+
+static uint32_t load32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+/* First byte from p on that differs from the one as far back as r, or
+ * limit. */
+static const uint8_t *match_end(const uint8_t *p, const uint8_t *r, const uint8_t *limit)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (p + 8 <= limit) {
+        uint64_t a, b;
+
+        memcpy(&a, p, 8);
+        memcpy(&b, r, 8);
+        if (a != b)
+            return p + (__builtin_ctzll(a ^ b) >> 3);
+        p += 8;
+        r += 8;
+    }
+#endif
+    while (p < limit && *p == *r) {
+        p++;
+        r++;
+    }
+    return p;
+}
+
+// The bytes that follow a length nibble of 15
+static uint8_t *put_len(uint8_t *op, const uint8_t *oend, uint32_t len)
+{
+    for (; len >= 255; len -= 255) {
+        if (op == oend)
+            return NULL;
+        *op++ = 255;
+    }
+    if (op == oend)
+        return NULL;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/* One sequence: nlit literals, then a match of mlen bytes off back, or
+ * nothing for the last one (off 0). NULL once out of room. */
+static uint8_t *put_seq(uint8_t *op, const uint8_t *oend, const uint8_t *lit, uint32_t nlit, uint32_t off,
+                        uint32_t mlen)
+{
+    uint8_t *token = op;
+
+    if (op == oend)
+        return NULL;
+    op++;
+    *token = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15 && !(op = put_len(op, oend, nlit - 15)))
+        return NULL;
+    if ((uint32_t)(oend - op) < nlit)
+        return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!off)
+        return op;
+
+    if (oend - op < 2)
+        return NULL;
+    *op++ = (uint8_t)off;
+    *op++ = (uint8_t)(off >> 8);
+    mlen -= LZ4_MIN_MATCH;
+    *token |= mlen < 15 ? mlen : 15;
+    if (mlen >= 15 && !(op = put_len(op, oend, mlen - 15)))
+        return NULL;
+    return op;
+}
+
+uint32_t lz4_compress(const void *src, uint32_t len, void *dst, uint32_t cap)
+{
+    const uint8_t *base = (const uint8_t *)src;
+    const uint8_t *ip = base, *anchor = base, *iend = base + len;
+    uint8_t *op = (uint8_t *)dst;
+    const uint8_t *oend = op + cap;
+    uint32_t table[1 << LZ4_HASH_BITS]; // Last position of each hashed 4-byte sequence
+    uint32_t misses = 0;
+
+    memset(table, 0, sizeof(table));
+    while (len > LZ4_MFLIMIT && ip <= iend - LZ4_MFLIMIT) {
+        uint32_t seq = load32(ip);
+        uint32_t h = hash4(seq);
+        const uint8_t *ref = base + table[h];
+        const uint8_t *end;
+
+        table[h] = (uint32_t)(ip - base);
+        if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || load32(ref) != seq) {
+            ip += 1 + (misses++ >> LZ4_SKIP_TRIGGER);
+            continue;
+        }
+        misses = 0;
+
+        // Take in matching bytes the search stepped over, then run the match forward
+        while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+        }
+        end = match_end(ip + LZ4_MIN_MATCH, ref + LZ4_MIN_MATCH, iend - LZ4_LAST_LITERALS);
+        op = put_seq(op, oend, anchor, (uint32_t)(ip - anchor), (uint32_t)(ip - ref), (uint32_t)(end - ip));
+        if (!op)
+            return 0;
+        ip = anchor = end;
+        // Cheap extra probe into what the match covered
+        table[hash4(load32(ip - 2))] = (uint32_t)(ip - 2 - base);
+    }
+
+    op = put_seq(op, oend, anchor, (uint32_t)(iend - anchor), 0, 0);
+    return op ? (uint32_t)(op - (uint8_t *)dst) : 0;
+}
+
+static int get_len(const uint8_t **ip, const uint8_t *iend, uint32_t *len)
+{
+    uint32_t b;
+
+    do {
+        if (*ip == iend)
+            return 1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz4_decompress(const void *src, uint32_t len, void *dst, uint32_t cap)
+{
+    const uint8_t *ip = (const uint8_t *)src, *iend = ip + len;
+    uint8_t *op = (uint8_t *)dst, *oend = op + cap;
+
+    while (ip < iend) {
+        uint32_t token = *ip++;
+        uint32_t n = token >> 4;
+        uint32_t off;
+
+        if (n == 15 && get_len(&ip, iend, &n))
+            return -1;
+        if (n > (uint32_t)(iend - ip) || n > (uint32_t)(oend - op))
+            return -1;
+        memcpy(op, ip, n);
+        ip += n;
+        op += n;
+        if (ip == iend)
+            break; // The last sequence has no match
+
+        if (iend - ip < 2)
+            return -1;
+        off = ip[0] | (uint32_t)ip[1] << 8;
+        ip += 2;
+        if (!off || off > (uint32_t)(op - (uint8_t *)dst))
+            return -1;
+        n = token & 15;
+        if (n == 15 && get_len(&ip, iend, &n))
+            return -1;
+        n += LZ4_MIN_MATCH;
+        if (n > (uint32_t)(oend - op))
+            return -1;
+        if (off >= n) {
+            memcpy(op, op - off, n);
+            op += n;
+        } else {
+            // Overlapping: the match repeats the last off bytes
+            for (; n; n--, op++)
+                *op = *(op - off);
+        }
+    }
+    return (int)(op - (uint8_t *)dst);
+}
+
+#endif // HAVE_LIBLZ4
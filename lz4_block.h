@@ -0,0 +1,24 @@
+#ifndef LZ4_BLOCK_H
+#define LZ4_BLOCK_H
+
+#include <stdint.h>
+
+/*
+ * LZ4 block format codec, for compressing log batches on the wire.
+ *
+ * The in-tree compressor is the greedy single-probe one of the reference
+ * implementation at its default level: a 4K-entry hash table of 4-byte
+ * sequences, matches up to 64 KiB back, and a step that grows over
+ * incompressible stretches. The decompressor checks every length and
+ * offset against both buffers, so a corrupt block fails instead of
+ * overrunning. Build with make LZ4=1 to use the system liblz4 instead;
+ * the blocks are the same either way.
+ */
+
+const char *lz4_impl(void);
+// Compressed size, or 0 if it would not fit in cap bytes
+uint32_t lz4_compress(const void *src, uint32_t len, void *dst, uint32_t cap);
+// Size of the expanded data, or -1 if src is not a valid block or does not fit in cap
+int lz4_decompress(const void *src, uint32_t len, void *dst, uint32_t cap);
+
+#endif // LZ4_BLOCK_H
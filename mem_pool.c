@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+#include "mem_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+int mem_pool_parse_page(const char *name, size_t *page_size)
+{
+    if (!strcasecmp(name, "none") || !strcmp(name, "0"))
+        *page_size = 0;
+    else if (!strcasecmp(name, "2m"))
+        *page_size = HUGEPAGE_2MB;
+    else if (!strcasecmp(name, "1g"))
+        *page_size = HUGEPAGE_1GB;
+    else {
+        fprintf(stderr, "unknown hugepage size '%s' (none, 2m or 1g)\n", name);
+        return 1;
+    }
+    return 0;
+}
+
+/* NUMA node the HCA hangs off, -1 if unknown. */
+int mem_pool_dev_numa_node(struct ibv_device *dev)
+{
+    char path[IBV_SYSFS_PATH_MAX + 32];
+    FILE *f;
+    int node = -1;
+
+    snprintf(path, sizeof(path), "%s/device/numa_node", dev->ibdev_path);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    if (fscanf(f, "%d", &node) != 1)
+        node = -1;
+    fclose(f);
+    return node;
+}
+
+static int log2_size(size_t v)
+{
+    int n = 0;
+
+    while (v >>= 1)
+        n++;
+    return n;
+}
+
+static void *pool_map(struct mem_pool *pool, int fd, size_t size, size_t page_size)
+{
+    void *p;
+
+    if (fd >= 0) {
+        if (ftruncate(fd, size))
+            return NULL;
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        pool->page_size = 0;
+        return p == MAP_FAILED ? NULL : p;
+    }
+
+    if (page_size) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (log2_size(page_size) << MAP_HUGE_SHIFT), -1, 0);
+        if (p != MAP_FAILED) {
+            pool->page_size = page_size;
+            return p;
+        }
+        fprintf(stderr, "hugetlb mmap of %zu bytes with %zu byte pages failed (%s), using regular pages\n",
+                size, page_size, strerror(errno));
+    }
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    pool->page_size = 0;
+    // Let THP back the pool where it can
+    if (page_size)
+        madvise(p, size, MADV_HUGEPAGE);
+    return p;
+}
+
+int mem_pool_create(struct mem_pool *pool, struct ibv_pd *pd, int fd, size_t size, size_t reserved,
+                    size_t chunk_size, size_t page_size, int numa_node, size_t max_mr_size, int access)
+{
+    size_t align;
+    size_t off;
+    int i;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->numa_node = -1;
+
+    if (fd >= 0)
+        page_size = 0;
+    align = page_size ? page_size : (size_t)sysconf(_SC_PAGESIZE);
+
+    if (!chunk_size)
+        chunk_size = MEM_POOL_DEFAULT_CHUNK;
+    reserved = (reserved + chunk_size - 1) / chunk_size * chunk_size;
+    if (size < reserved)
+        size = reserved;
+    size = (size + align - 1) / align * align;
+
+    pool->base = (char *)pool_map(pool, fd, size, page_size);
+    if (!pool->base) {
+        fprintf(stderr, "failed to mmap %zu byte memory pool: %s\n", size, strerror(errno));
+        return 1;
+    }
+    pool->size = size;
+    pool->reserved = reserved;
+    pool->chunk_size = chunk_size;
+
+    // Bind before anything faults the pages in
+    if (numa_node >= 0 && numa_node < 64) {
+        unsigned long mask = 1UL << numa_node;
+
+        if (syscall(SYS_mbind, pool->base, size, MPOL_BIND, &mask, sizeof(mask) * 8 + 1, 0))
+            fprintf(stderr, "mbind to NUMA node %d failed: %s\n", numa_node, strerror(errno));
+        else
+            pool->numa_node = numa_node;
+    }
+
+    // Each MR covers a whole number of chunks so no chunk straddles two
+    pool->mr_span = size;
+    if (max_mr_size && max_mr_size < size) {
+        size_t unit = chunk_size > align ? chunk_size : align;
+
+        pool->mr_span = max_mr_size / unit * unit;
+        if (pool->mr_span < reserved || !pool->mr_span) {
+            fprintf(stderr, "device max_mr_size %zu can't hold the %zu byte reserved region\n", max_mr_size, reserved);
+            goto mem_pool_create_err;
+        }
+    }
+    pool->nmrs = (size + pool->mr_span - 1) / pool->mr_span;
+    if (pool->nmrs > MEM_POOL_MAX_MRS) {
+        fprintf(stderr, "memory pool of %zu bytes needs %d MRs, max %d\n", size, pool->nmrs, MEM_POOL_MAX_MRS);
+        goto mem_pool_create_err;
+    }
+
+    pool->registered = pd != NULL;
+    for (i = 0, off = 0; i < pool->nmrs; i++, off += pool->mr_span) {
+        size_t len = (size - off < pool->mr_span) ? size - off : pool->mr_span;
+
+        if (!pd) {
+            pool->mrs[i] = (struct ibv_mr *)calloc(1, sizeof(struct ibv_mr));
+            if (!pool->mrs[i])
+                goto mem_pool_create_err;
+            pool->mrs[i]->addr = pool->base + off;
+            pool->mrs[i]->length = len;
+            continue;
+        }
+
+        pool->mrs[i] = ibv_reg_mr(pd, pool->base + off, len, access);
+        if (!pool->mrs[i]) {
+            fprintf(stderr, "ibv_reg_mr of %zu bytes at offset %zu failed with access=0x%x\n", len, off, access);
+            goto mem_pool_create_err;
+        }
+    }
+
+    pool->nchunks = (size - reserved) / chunk_size;
+    if (pool->nchunks) {
+        pool->next = (uint32_t *)malloc(pool->nchunks * sizeof(uint32_t));
+        if (!pool->next) {
+            fprintf(stderr, "failed to allocate free list for %u chunks\n", pool->nchunks);
+            goto mem_pool_create_err;
+        }
+        for (uint32_t c = 0; c < pool->nchunks; c++)
+            pool->next[c] = (c + 1 < pool->nchunks) ? c + 2 : 0;
+        pool->free_head = 1;
+    }
+
+    fprintf(stdout, "Memory pool: %zu bytes, %s pages, NUMA node %d, %d MR(s), %u chunks of %zu bytes\n",
+            size, pool->page_size == HUGEPAGE_1GB ? "1GB" : pool->page_size == HUGEPAGE_2MB ? "2MB" : "regular",
+            pool->numa_node, pool->nmrs, pool->nchunks, chunk_size);
+    return 0;
+
+mem_pool_create_err:
+    mem_pool_destroy(pool);
+    return 1;
+}
+
+int mem_pool_destroy(struct mem_pool *pool)
+{
+    int rc = 0;
+
+    for (int i = 0; i < pool->nmrs; i++) {
+        if (!pool->registered)
+            free(pool->mrs[i]);
+        else if (pool->mrs[i] && ibv_dereg_mr(pool->mrs[i])) {
+            fprintf(stderr, "failed to deregister pool MR %d\n", i);
+            rc = 1;
+        }
+        pool->mrs[i] = NULL;
+    }
+    pool->nmrs = 0;
+
+    if (pool->base) {
+        munmap(pool->base, pool->size);
+        pool->base = NULL;
+    }
+
+    free(pool->next);
+    pool->next = NULL;
+    return rc;
+}
+
+/* Treiber stack over chunk indices; the tag in the upper half of free_head
+ * defeats ABA between concurrent alloc and free. */
+void *mem_pool_alloc(struct mem_pool *pool)
+{
+    uint64_t old = __atomic_load_n(&pool->free_head, __ATOMIC_ACQUIRE);
+    uint64_t new;
+    uint32_t idx;
+
+    do {
+        idx = (uint32_t)old;
+        if (!idx)
+            return NULL;
+        new = (((old >> 32) + 1) << 32) | __atomic_load_n(&pool->next[idx - 1], __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&pool->free_head, &old, new, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    return pool->base + pool->reserved + (size_t)(idx - 1) * pool->chunk_size;
+}
+
+void mem_pool_free(struct mem_pool *pool, void *chunk)
+{
+    uint32_t idx = ((char *)chunk - pool->base - pool->reserved) / pool->chunk_size;
+    uint64_t old = __atomic_load_n(&pool->free_head, __ATOMIC_RELAXED);
+    uint64_t new;
+
+    do {
+        __atomic_store_n(&pool->next[idx], (uint32_t)old, __ATOMIC_RELAXED);
+        new = (((old >> 32) + 1) << 32) | (idx + 1);
+    } while (!__atomic_compare_exchange_n(&pool->free_head, &old, new, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+struct ibv_mr *mem_pool_mr(struct mem_pool *pool, const void *addr)
+{
+    size_t off = (const char *)addr - pool->base;
+
+    if ((const char *)addr < pool->base || off >= pool->size)
+        return NULL;
+    return pool->mrs[off / pool->mr_span];
+}
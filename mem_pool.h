@@ -0,0 +1,53 @@
+#ifndef MEM_POOL_H
+#define MEM_POOL_H
+
+#include <infiniband/verbs.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Registered memory pool. One mmap'd area, optionally hugepage backed and
+ * bound to the HCA's NUMA node, registered as one or more MRs (each at most
+ * the device's max_mr_size). The first `reserved` bytes are handed to the
+ * caller as a contiguous region inside the first MR; the rest is split into
+ * chunk_size chunks served from a lock-free free list.
+ *
+ * With an fd the pool maps that file shared instead, so another process can
+ * map the same memory; with no PD it is left unregistered and described by
+ * placeholder MRs (zero keys) so callers can treat every pool alike.
+ */
+
+#define MEM_POOL_MAX_MRS 16
+#define MEM_POOL_DEFAULT_CHUNK (64 * 1024)
+
+#define HUGEPAGE_2MB (2UL << 20)
+#define HUGEPAGE_1GB (1UL << 30)
+
+struct mem_pool {
+    char *base;
+    size_t size;         // Mapped bytes, multiple of page_size
+    size_t page_size;    // 0 for regular pages, else the hugepage size used
+    size_t reserved;     // Leading bytes kept out of the free list
+    size_t chunk_size;
+    uint32_t nchunks;
+    int numa_node;       // Node the memory is bound to, -1 if unbound
+    struct ibv_mr *mrs[MEM_POOL_MAX_MRS];
+    size_t mr_span;      // Bytes covered by each MR
+    int nmrs;
+    int registered;      // mrs came from ibv_reg_mr
+    uint32_t *next;      // Free list links, chunk index + 1, 0 terminates
+    uint64_t free_head;  // (ABA tag << 32) | (chunk index + 1)
+};
+
+int mem_pool_parse_page(const char *name, size_t *page_size);
+int mem_pool_dev_numa_node(struct ibv_device *dev);
+
+int mem_pool_create(struct mem_pool *pool, struct ibv_pd *pd, int fd, size_t size, size_t reserved,
+                    size_t chunk_size, size_t page_size, int numa_node, size_t max_mr_size, int access);
+int mem_pool_destroy(struct mem_pool *pool);
+
+void *mem_pool_alloc(struct mem_pool *pool);
+void mem_pool_free(struct mem_pool *pool, void *chunk);
+struct ibv_mr *mem_pool_mr(struct mem_pool *pool, const void *addr);
+
+#endif // MEM_POOL_H
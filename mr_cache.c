@@ -0,0 +1,330 @@
+#include "mr_cache.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+static uint32_t next_prio(struct mr_cache *c)
+{
+    // xorshift32; priorities only need to look random to keep the treap balanced
+    c->seed ^= c->seed << 13;
+    c->seed ^= c->seed >> 17;
+    c->seed ^= c->seed << 5;
+    return c->seed;
+}
+
+static void node_update(struct mr_cache_entry *t)
+{
+    t->max_end = t->end;
+    if (t->left && t->left->max_end > t->max_end)
+        t->max_end = t->left->max_end;
+    if (t->right && t->right->max_end > t->max_end)
+        t->max_end = t->right->max_end;
+}
+
+// Nodes starting below key go to *l, the rest to *r
+static void tree_split(struct mr_cache_entry *t, uintptr_t key, struct mr_cache_entry **l, struct mr_cache_entry **r)
+{
+    if (!t) {
+        *l = *r = NULL;
+    } else if (t->start < key) {
+        tree_split(t->right, key, &t->right, r);
+        node_update(t);
+        *l = t;
+    } else {
+        tree_split(t->left, key, l, &t->left);
+        node_update(t);
+        *r = t;
+    }
+}
+
+// Every node of l starts at or below every node of r
+static struct mr_cache_entry *tree_merge(struct mr_cache_entry *l, struct mr_cache_entry *r)
+{
+    if (!l || !r)
+        return l ? l : r;
+    if (l->prio > r->prio) {
+        l->right = tree_merge(l->right, r);
+        node_update(l);
+        return l;
+    }
+    r->left = tree_merge(l, r->left);
+    node_update(r);
+    return r;
+}
+
+static void tree_insert(struct mr_cache *c, struct mr_cache_entry *e)
+{
+    struct mr_cache_entry *l, *r;
+
+    e->left = e->right = NULL;
+    node_update(e);
+    tree_split(c->root, e->start, &l, &r);
+    c->root = tree_merge(tree_merge(l, e), r);
+}
+
+// Among nodes with the same start, which is all t holds, unlink e
+static struct mr_cache_entry *tree_unlink(struct mr_cache_entry *t, struct mr_cache_entry *e)
+{
+    if (!t)
+        return NULL;
+    if (t == e)
+        return tree_merge(t->left, t->right);
+    t->left = tree_unlink(t->left, e);
+    t->right = tree_unlink(t->right, e);
+    node_update(t);
+    return t;
+}
+
+static void tree_remove(struct mr_cache *c, struct mr_cache_entry *e)
+{
+    struct mr_cache_entry *l, *mid, *r;
+
+    tree_split(c->root, e->start, &l, &r);
+    tree_split(r, e->start + 1, &mid, &r);
+    c->root = tree_merge(tree_merge(l, tree_unlink(mid, e)), r);
+}
+
+// Some node covering [a, b)
+static struct mr_cache_entry *tree_find(struct mr_cache_entry *t, uintptr_t a, uintptr_t b)
+{
+    struct mr_cache_entry *e;
+
+    if (!t || t->max_end < b)
+        return NULL;
+    if ((e = tree_find(t->left, a, b)))
+        return e;
+    if (t->start <= a && t->end >= b)
+        return t;
+    return t->start > a ? NULL : tree_find(t->right, a, b);
+}
+
+// Some node overlapping [a, b)
+static struct mr_cache_entry *tree_overlap(struct mr_cache_entry *t, uintptr_t a, uintptr_t b)
+{
+    struct mr_cache_entry *e;
+
+    if (!t || t->max_end <= a)
+        return NULL;
+    if ((e = tree_overlap(t->left, a, b)))
+        return e;
+    if (t->start < b && t->end > a)
+        return t;
+    return t->start >= b ? NULL : tree_overlap(t->right, a, b);
+}
+
+static void lru_unlink(struct mr_cache *c, struct mr_cache_entry *e)
+{
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        c->lru_head = e->lru_next;
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        c->lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push(struct mr_cache *c, struct mr_cache_entry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = c->lru_head;
+    if (c->lru_head)
+        c->lru_head->lru_prev = e;
+    else
+        c->lru_tail = e;
+    c->lru_head = e;
+}
+
+static int entry_release(struct mr_cache *c, struct mr_cache_entry *e)
+{
+    int rc = 0;
+
+    tree_remove(c, e);
+    lru_unlink(c, e);
+    c->bytes -= e->end - e->start;
+    if (c->pd)
+        rc = ibv_dereg_mr(e->mr) ? 1 : 0;
+    else
+        free(e->mr);
+    free(e);
+    return rc;
+}
+
+static int cache_quiesce(struct mr_cache *c)
+{
+    if (c->quiesce && c->quiesce(c->quiesce_arg)) {
+        fprintf(stderr, "MR cache: writes still in flight, can't release MRs\n");
+        return 1;
+    }
+    return 0;
+}
+
+/* Make room for `need` more bytes, least recently used first. */
+static int cache_evict(struct mr_cache *c, size_t need)
+{
+    struct mr_cache_entry *e = c->lru_tail;
+    int quiesced = 0;
+
+    while (e && c->bytes + need > c->budget) {
+        struct mr_cache_entry *prev = e->lru_prev;
+
+        if (!e->pins) {
+            if (!quiesced && cache_quiesce(c))
+                return 1;
+            quiesced = 1;
+            if (entry_release(c, e))
+                return 1;
+            c->stats.evictions++;
+            STATS_ADD(mr_evictions, 1);
+        }
+        e = prev;
+    }
+    if (c->bytes + need > c->budget)
+        c->stats.overruns++;
+    return 0;
+}
+
+int mr_cache_init(struct mr_cache *c, struct ibv_pd *pd, size_t budget, int odp)
+{
+    memset(c, 0, sizeof(*c));
+    c->pd = pd;
+    c->budget = budget;
+    c->odp = pd && odp;
+    c->access = IBV_ACCESS_LOCAL_WRITE | (c->odp ? IBV_ACCESS_ON_DEMAND : 0);
+    c->seed = 0x9e3779b9u;
+    return pthread_mutex_init(&c->lock, NULL) ? 1 : 0;
+}
+
+/* Deregister everything. No write may gather from the cache any more. */
+void mr_cache_destroy(struct mr_cache *c)
+{
+    while (c->lru_head)
+        entry_release(c, c->lru_head);
+    pthread_mutex_destroy(&c->lock);
+}
+
+void mr_cache_set_quiesce(struct mr_cache *c, int (*quiesce)(void *arg), void *arg)
+{
+    pthread_mutex_lock(&c->lock);
+    c->quiesce = quiesce;
+    c->quiesce_arg = arg;
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* An entry whose MR covers [addr, addr + length), registering the pages on
+ * a miss. The entry stays registered until mr_cache_put; NULL on failure. */
+struct mr_cache_entry *mr_cache_get(struct mr_cache *c, const void *addr, size_t length)
+{
+    static size_t page;
+    uintptr_t a = (uintptr_t)addr, b = a + length;
+    struct mr_cache_entry *e;
+    uint64_t t0, reg_ns;
+
+    if (!page)
+        page = (size_t)sysconf(_SC_PAGESIZE);
+
+    pthread_mutex_lock(&c->lock);
+    c->stats.lookups++;
+    STATS_ADD(mr_lookups, 1);
+    e = tree_find(c->root, a, b);
+    if (e) {
+        c->stats.hits++;
+        lru_unlink(c, e);
+        lru_push(c, e);
+        e->pins++;
+        pthread_mutex_unlock(&c->lock);
+        return e;
+    }
+
+    e = (struct mr_cache_entry *)calloc(1, sizeof(*e));
+    if (!e)
+        goto mr_cache_get_fail;
+    e->start = a & ~(uintptr_t)(page - 1);
+    e->end = (b + page - 1) & ~(uintptr_t)(page - 1);
+    // ODP MRs pin nothing, so there is nothing to keep under the budget
+    if (c->budget && !c->odp && cache_evict(c, e->end - e->start))
+        goto mr_cache_get_fail;
+
+    t0 = stats_now();
+    if (c->pd) {
+        e->mr = ibv_reg_mr(c->pd, (void *)e->start, e->end - e->start, c->access);
+        if (!e->mr)
+            fprintf(stderr, "MR cache: ibv_reg_mr of %lu bytes failed: %s\n", (unsigned long)(e->end - e->start),
+                    strerror(errno));
+    } else if ((e->mr = (struct ibv_mr *)calloc(1, sizeof(*e->mr)))) {
+        e->mr->addr = (void *)e->start;
+        e->mr->length = e->end - e->start;
+    }
+    if (!e->mr)
+        goto mr_cache_get_fail;
+    // Timed once, so the cache's figure and the stats page's agree
+    reg_ns = stats_now() - t0;
+    c->stats.regs++;
+    c->stats.reg_ns += reg_ns;
+    STATS_ADD(mr_regs, 1);
+    STATS_ADD(mr_reg_ns, reg_ns);
+
+    e->prio = next_prio(c);
+    e->pins = 1;
+    tree_insert(c, e);
+    lru_push(c, e);
+    c->bytes += e->end - e->start;
+    if (c->bytes > c->peak)
+        c->peak = c->bytes;
+    pthread_mutex_unlock(&c->lock);
+    return e;
+
+mr_cache_get_fail:
+    pthread_mutex_unlock(&c->lock);
+    free(e);
+    return NULL;
+}
+
+void mr_cache_put(struct mr_cache *c, struct mr_cache_entry *e)
+{
+    pthread_mutex_lock(&c->lock);
+    e->pins--;
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Drop every MR overlapping [addr, addr + length), e.g. before the memory
+ * is unmapped or freed. Waits for writes through the quiesce hook first,
+ * so none may be in use (pinned) meanwhile. */
+int mr_cache_invalidate(struct mr_cache *c, const void *addr, size_t length)
+{
+    uintptr_t a = (uintptr_t)addr, b = a + length;
+    struct mr_cache_entry *e;
+    int quiesced = 0;
+    int rc = 0;
+
+    pthread_mutex_lock(&c->lock);
+    while (!rc && (e = tree_overlap(c->root, a, b))) {
+        if (e->pins) {
+            fprintf(stderr, "MR cache: invalidating %p, which is still in use\n", (void *)e->start);
+            rc = 1;
+            break;
+        }
+        if (!quiesced && (rc = cache_quiesce(c)))
+            break;
+        quiesced = 1;
+        rc = entry_release(c, e);
+        c->stats.invalidations++;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return rc;
+}
+
+void mr_cache_print(FILE *out, const struct mr_cache *c)
+{
+    const struct mr_cache_stats *st = &c->stats;
+
+    fprintf(out, "MR cache: %lu lookups, %.1f%% hits, %lu registrations at %.1f us each, %lu evictions, "
+            "%lu invalidations, %lu over budget; %lu bytes registered, peak %lu%s\n",
+            (unsigned long)st->lookups, st->lookups ? 100.0 * st->hits / st->lookups : 0.0,
+            (unsigned long)st->regs, st->regs ? st->reg_ns / 1e3 / st->regs : 0.0, (unsigned long)st->evictions,
+            (unsigned long)st->invalidations, (unsigned long)st->overruns, (unsigned long)c->bytes,
+            (unsigned long)c->peak, c->odp ? ", on demand" : "");
+}
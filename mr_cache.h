@@ -0,0 +1,85 @@
+#ifndef MR_CACHE_H
+#define MR_CACHE_H
+
+#include <infiniband/verbs.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Registration cache for caller memory that writes gather from.
+ *
+ * ibv_reg_mr pins the pages and costs tens of microseconds, far too much
+ * per write, so a buffer is registered the first time a write gathers from
+ * it and the MR kept for the next. Entries cover whole pages and sit in an
+ * interval tree (a treap on the start address, each node holding the
+ * largest end in its subtree), which finds an MR covering a range in
+ * O(log n). Ranges may overlap: a miss registers just the pages it needs.
+ *
+ * Registered bytes are held under a budget, pinned memory being what the
+ * kernel limits (RLIMIT_MEMLOCK). A miss that would go over it evicts the
+ * least recently used entries first. Writes posted or merely queued may
+ * still gather from an MR, so eviction first calls the owner's quiesce
+ * hook, which must post whatever it has queued and wait for every write to
+ * complete. Entries in use by a caller (between mr_cache_get and
+ * mr_cache_put) are never evicted; if only those are left the budget is
+ * overrun rather than failing the write.
+ *
+ * Memory must be invalidated before it is unmapped or freed, or the cache
+ * keeps a stale MR that a later buffer at the same address would be
+ * written from: the pinned pages, not the new ones. With ODP (the device
+ * supports IBV_ACCESS_ON_DEMAND for RC sends and config.mr_odp is set)
+ * MRs pin nothing and follow the mapping, so the budget does not apply;
+ * invalidating still releases them.
+ *
+ * Without a PD (shm) the MRs are placeholders, as the pool's are.
+ */
+
+struct mr_cache_entry {
+    uintptr_t start;  // Registered range, whole pages
+    uintptr_t end;
+    struct ibv_mr *mr;
+    int pins;         // Callers between get and put
+    uint32_t prio;    // Treap heap order
+    uintptr_t max_end; // Largest end in this subtree
+    struct mr_cache_entry *left, *right;
+    struct mr_cache_entry *lru_prev, *lru_next; // Most recently used first
+};
+
+struct mr_cache_stats {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t regs;        // Registrations, one per miss
+    uint64_t reg_ns;      // Time spent in them
+    uint64_t evictions;
+    uint64_t invalidations;
+    uint64_t overruns;    // Misses that went over the budget, nothing being evictable
+};
+
+struct mr_cache {
+    struct ibv_pd *pd;
+    int access;           // For ibv_reg_mr, IBV_ACCESS_ON_DEMAND included with ODP
+    int odp;
+    size_t budget;        // Registered bytes kept, 0 for no limit
+    size_t bytes;         // Registered now
+    size_t peak;
+    uint32_t seed;
+    struct mr_cache_entry *root;
+    struct mr_cache_entry *lru_head, *lru_tail;
+    int (*quiesce)(void *arg); // No write may gather from an MR once this returns 0
+    void *quiesce_arg;
+    pthread_mutex_t lock;
+    struct mr_cache_stats stats;
+};
+
+int mr_cache_init(struct mr_cache *c, struct ibv_pd *pd, size_t budget, int odp);
+void mr_cache_destroy(struct mr_cache *c);
+void mr_cache_set_quiesce(struct mr_cache *c, int (*quiesce)(void *arg), void *arg);
+
+struct mr_cache_entry *mr_cache_get(struct mr_cache *c, const void *addr, size_t length);
+void mr_cache_put(struct mr_cache *c, struct mr_cache_entry *e);
+int mr_cache_invalidate(struct mr_cache *c, const void *addr, size_t length);
+void mr_cache_print(FILE *out, const struct mr_cache *c);
+
+#endif // MR_CACHE_H
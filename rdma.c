@@ -1,4 +1,6 @@
 #include "rdma.h"
+#include "logging.h"
+#include "stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,6 +17,7 @@
 #include <sys/resource.h>
 #include <errno.h>
 #include <infiniband/verbs.h>
+#include <pthread.h>
 
 // Add this define
 #ifndef ibv_link_layer_str
@@ -37,7 +40,32 @@ struct config_t config = {
     NULL,  /* dev_name */
     19875, /* tcp_port */
     1,     /* ib_port */
-    -1     /* gid_idx */
+    -1,    /* gid_idx */
+    0,     /* buf_size */
+    DEFAULT_QUEUE_DEPTH,     /* queue_depth */
+    DEFAULT_SIGNAL_INTERVAL, /* signal_interval */
+    CQ_MODE_BUSY,            /* cq_mode */
+    DEFAULT_INLINE_SIZE,     /* inline_size */
+    0,                       /* pool_size */
+    MEM_POOL_DEFAULT_CHUNK,  /* chunk_size */
+    0,                       /* hugepage_size */
+    -1,                      /* numa_node */
+    0,                       /* cq_depth */
+    0,                       /* srq_depth */
+    NULL,                    /* transport */
+    0,                       /* mtu */
+    0x12,                    /* ack_timeout */
+    6,                       /* retry_cnt */
+    7,                       /* rnr_retry */
+    1,                       /* num_qps */
+    { 0 },                   /* qp_ports */
+    0,                       /* num_ports */
+    0,                       /* spare_qps */
+    0,                       /* pack */
+    0,                       /* shared_log */
+    DEFAULT_MR_BUDGET,       /* mr_budget */
+    0,                       /* mr_odp */
+    0                        /* log_id */
 };
 
 
@@ -58,7 +86,7 @@ void print_port_info(struct ibv_context *context, int port_num) {
 
 int sock_connect(const char *servername, int port)
 {
-    fprintf(stdout, "Entering function: %s\n", __func__);
+    pr_trace("Entering function: %s\n", __func__);
 	struct addrinfo *resolved_addr = NULL;
 	struct addrinfo *iterator;
 	char service[6];
@@ -124,16 +152,156 @@ sock_connect_exit:
 	return sockfd;
 }
 
+/* Post a chain of send WRs with one doorbell. Waits for CQEs first if the
+ * chain would overrun the send queue; unsignaled WRs only leave the queue
+ * when a later signaled one completes. */
+static int post_chain(struct resources *res, struct ibv_send_wr *wrs, int count)
+{
+    struct ibv_send_wr *bad_wr = NULL;
+    int rc;
+
+    while (res->sq_posted - res->sq_retired + count > res->sq_depth) {
+        if (poll_completion(res))
+            return 1;
+    }
+
+    rc = res->ops->post_send(res, wrs, &bad_wr);
+    if (rc) {
+        fprintf(stderr, "ibv_post_send failed with error: %d\n", rc);
+        return rc;
+    }
+
+    res->sq_posted += count;
+#if RDMA_STATS
+    STATS_ADD(doorbells, 1);
+    STATS_ADD(posts, count);
+    STATS_HIST(batch, count, STATS_BATCH_BUCKETS);
+    for (struct ibv_send_wr *wr = wrs; wr; wr = wr->next) {
+        for (int i = 0; i < wr->num_sge; i++)
+            STATS_ADD(bytes, wr->sg_list[i].length);
+    }
+#endif
+    return 0;
+}
+
+/* Number each WR and pick the ones that need a CQE. Signaled WRs are
+ * stamped so their completion can be timed. */
+static void seq_chain(struct resources *res, struct ibv_send_wr *wrs, int count, int flags)
+{
+#if RDMA_STATS
+    uint64_t now = stats_now();
+#endif
+
+    for (int i = 0; i < count; i++) {
+        uint64_t seq = res->sq_posted + i + 1;
+
+        wrs[i].wr_id = seq;
+        wrs[i].next = (i + 1 < count) ? &wrs[i + 1] : NULL;
+        if (seq % res->signal_interval == 0 || (i + 1 == count && (flags & RDMA_SIGNAL_LAST))) {
+            wrs[i].send_flags |= IBV_SEND_SIGNALED;
+            res->sq_signaled = seq;
+#if RDMA_STATS
+            res->wr_posted[seq % res->sq_depth] = now;
+#endif
+        }
+    }
+}
+
+static int write_batch(struct resources *res, const struct rdma_seg *segs, int count, int flags)
+{
+    struct ibv_send_wr wr[RDMA_MAX_BATCH];
+    struct ibv_sge sge[RDMA_MAX_BATCH];
+    int chunk = res->sq_depth / 2;
+    int done, n;
+
+    if (chunk > RDMA_MAX_BATCH)
+        chunk = RDMA_MAX_BATCH;
+
+    for (done = 0; done < count; done += n) {
+        n = (count - done < chunk) ? count - done : chunk;
+
+        memset(wr, 0, n * sizeof(wr[0]));
+        for (int i = 0; i < n; i++) {
+            const struct rdma_seg *seg = &segs[done + i];
+
+            wr[i].opcode = IBV_WR_RDMA_WRITE;
+            if (seg->sgl) {
+                wr[i].sg_list = (struct ibv_sge *)seg->sgl;
+                wr[i].num_sge = seg->nsge;
+            } else {
+                sge[i].addr = (uintptr_t)res->buf + seg->offset;
+                sge[i].length = seg->length;
+                sge[i].lkey = res->mr->lkey;
+                wr[i].sg_list = &sge[i];
+                wr[i].num_sge = 1;
+            }
+            // The HCA copies inline data at post time, skipping the DMA read of buf
+            if (seg->length <= res->max_inline)
+                wr[i].send_flags = IBV_SEND_INLINE;
+            wr[i].wr.rdma.remote_addr = res->remote_props.addr + seg->offset;
+            wr[i].wr.rdma.rkey = res->remote_props.rkey;
+        }
+
+        // RC delivers in order, so the immediate vouches for every write before it
+        if (done + n == count && (flags & RDMA_WRITE_IMM)) {
+            wr[n - 1].opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+            wr[n - 1].imm_data = htonl((uint32_t)segs[count - 1].cookie);
+        }
+
+        seq_chain(res, wr, n, (done + n == count) ? flags : 0);
+        for (int i = 0; i < n; i++)
+            res->wr_cookie[wr[i].wr_id % res->sq_depth] = segs[done + i].cookie;
+        if (post_chain(res, wr, n))
+            return 1;
+        if (segs[done + n - 1].cookie > res->posted_cookie)
+            __atomic_store_n(&res->posted_cookie, segs[done + n - 1].cookie, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+int rdma_write_batch(struct resources *res, const struct rdma_seg *segs, int count, int flags) {
+    // A striped connection hands each batch to the next QP; the peer reorders by ring position
+    if (res->nstripes) {
+        unsigned k = res->next_stripe++ % (res->nstripes + 1);
+
+        if (k)
+            res = res->stripe[k - 1];
+    }
+    return write_batch(res, segs, count, flags);
+}
+
+/* Single writes always go out on the leader, so successive writes to the
+ * same words (acknowledgements) can't overtake each other. */
 int rdma_write(struct resources *res, size_t offset, size_t length) {
-    struct ibv_send_wr wr, *bad_wr = NULL;
+    struct rdma_seg seg = { offset, length, 0 };
+
+    return write_batch(res, &seg, 1, 0);
+}
+
+/* Post one signaled WR and wait for its completion. */
+static int post_wait(struct resources *res, struct ibv_send_wr *wr)
+{
+    seq_chain(res, wr, 1, RDMA_SIGNAL_LAST);
+    res->wr_cookie[wr->wr_id % res->sq_depth] = 0;
+    if (post_chain(res, wr, 1))
+        return 1;
+
+    while (res->sq_retired < wr->wr_id) {
+        if (poll_completion(res))
+            return 1;
+    }
+    return 0;
+}
+
+/* Synchronous: returns once the data has landed in the local buffer. */
+int rdma_read(struct resources *res, size_t offset, size_t length) {
+    struct ibv_send_wr wr;
     struct ibv_sge sge;
 
     memset(&wr, 0, sizeof(wr));
-    wr.wr_id = 0;
-    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.opcode = IBV_WR_RDMA_READ;
     wr.sg_list = &sge;
     wr.num_sge = 1;
-    wr.send_flags = IBV_SEND_SIGNALED;
     wr.wr.rdma.remote_addr = res->remote_props.addr + offset;
     wr.wr.rdma.rkey = res->remote_props.rkey;
 
@@ -141,12 +309,399 @@ int rdma_write(struct resources *res, size_t offset, size_t length) {
     sge.length = length;
     sge.lkey = res->mr->lkey;
 
-    return ibv_post_send(res->qp, &wr, &bad_wr);
+    return post_wait(res, &wr);
+}
+
+/* Asynchronous READ of any remote range into buf + offset, signaled: its
+ * completion raises done_cookie to cookie. RC completes READs in order, so
+ * done_cookie tells how far a stream of them has landed. */
+int rdma_read_post(struct resources *res, size_t offset, uint64_t remote_addr, uint32_t rkey, size_t length,
+                   uint64_t cookie)
+{
+    struct ibv_send_wr wr;
+    struct ibv_sge sge;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.opcode = IBV_WR_RDMA_READ;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.wr.rdma.remote_addr = remote_addr;
+    wr.wr.rdma.rkey = rkey;
+
+    sge.addr = (uintptr_t)res->buf + offset;
+    sge.length = length;
+    sge.lkey = res->mr->lkey;
+
+    seq_chain(res, &wr, 1, RDMA_SIGNAL_LAST);
+    res->wr_cookie[wr.wr_id % res->sq_depth] = cookie;
+    if (post_chain(res, &wr, 1))
+        return 1;
+    if (cookie > res->posted_cookie)
+        __atomic_store_n(&res->posted_cookie, cookie, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Synchronous 64-bit fetch-and-add on the remote word at offset; the old
+ * value lands at the same offset locally and in *old. */
+int rdma_fetch_add(struct resources *res, size_t offset, uint64_t add, uint64_t *old) {
+    struct ibv_send_wr wr;
+    struct ibv_sge sge;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.opcode = IBV_WR_ATOMIC_FETCH_AND_ADD;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.wr.atomic.remote_addr = res->remote_props.addr + offset;
+    wr.wr.atomic.rkey = res->remote_props.rkey;
+    wr.wr.atomic.compare_add = add;
+
+    sge.addr = (uintptr_t)res->buf + offset;
+    sge.length = sizeof(uint64_t);
+    sge.lkey = res->mr->lkey;
+
+    if (post_wait(res, &wr))
+        return 1;
+    *old = *(volatile uint64_t *)(res->buf + offset);
+    return 0;
+}
+
+static int mr_quiesce_drain(void *arg)
+{
+    return rdma_drain((struct resources *)arg);
+}
+
+/* The device's MR cache, created on first use. Until its owner installs
+ * a quiesce hook that also posts queued writes, an eviction only drains
+ * the device's own QPs. */
+struct mr_cache *rdma_mr_cache(struct resources *res)
+{
+    struct resources *dev = res->parent ? res->parent : res;
+    struct mr_cache *c = dev->mr_cache;
+
+    if (c)
+        return c;
+    c = (struct mr_cache *)malloc(sizeof(*c));
+    if (!c || mr_cache_init(c, dev->pd, config.mr_budget, config.mr_odp && dev->odp)) {
+        fprintf(stderr, "failed to set up the MR cache\n");
+        free(c);
+        return NULL;
+    }
+    mr_cache_set_quiesce(c, mr_quiesce_drain, dev);
+    if (config.mr_odp && !c->odp)
+        fprintf(stderr, "Device can't register on demand for RC sends, pinning caller memory\n");
+    dev->mr_cache = c;
+    return c;
+}
+
+static int mr_covers(const struct ibv_mr *mr, const void *addr, size_t length)
+{
+    return mr && (const char *)addr >= (const char *)mr->addr &&
+           length <= mr->length - (size_t)((const char *)addr - (const char *)mr->addr);
+}
+
+/* Local key for gathering [addr, addr + length) into a write: the pool's
+ * MR if it lies in the pool, else one from the MR cache, registered now if
+ * need be. *pin is then the cache entry, to be handed back with
+ * rdma_mr_put once the write is posted (or queued), NULL for the pool. */
+int rdma_mr_get(struct resources *res, const void *addr, size_t length, uint32_t *lkey,
+                struct mr_cache_entry **pin)
+{
+    struct resources *dev = res->parent ? res->parent : res;
+    struct ibv_mr *mr = mem_pool_mr(&dev->pool, addr);
+    struct mr_cache *c;
+
+    *pin = NULL;
+    if (mr_covers(mr, addr, length)) {
+        *lkey = mr->lkey;
+        return 0;
+    }
+    if (!(c = rdma_mr_cache(res)) || !(*pin = mr_cache_get(c, addr, length)))
+        return 1;
+    *lkey = (*pin)->mr->lkey;
+    return 0;
+}
+
+void rdma_mr_put(struct resources *res, struct mr_cache_entry *pin)
+{
+    struct resources *dev = res->parent ? res->parent : res;
+
+    if (pin)
+        mr_cache_put(dev->mr_cache, pin);
+}
+
+/* Caller memory is about to be unmapped or freed: drop its MRs. */
+int rdma_mem_invalidate(struct resources *res, const void *addr, size_t length)
+{
+    struct resources *dev = res->parent ? res->parent : res;
+
+    return dev->mr_cache ? mr_cache_invalidate(dev->mr_cache, addr, length) : 0;
+}
+
+/* Wait until every posted send WR has completed. If the last one went out
+ * unsignaled, a zero-length signaled write is posted behind it. */
+int rdma_drain(struct resources *res)
+{
+    for (int i = 0; i < res->nstripes; i++) {
+        if (rdma_drain(res->stripe[i]))
+            return 1;
+    }
+
+    if (res->sq_signaled < res->sq_posted) {
+        struct ibv_send_wr wr;
+
+        memset(&wr, 0, sizeof(wr));
+        wr.opcode = IBV_WR_RDMA_WRITE;
+        wr.num_sge = 0;
+        wr.wr.rdma.remote_addr = res->remote_props.addr;
+        wr.wr.rdma.rkey = res->remote_props.rkey;
+
+        seq_chain(res, &wr, 1, RDMA_SIGNAL_LAST);
+        res->wr_cookie[wr.wr_id % res->sq_depth] = 0;
+        if (post_chain(res, &wr, 1))
+            return 1;
+    }
+
+    while (res->sq_retired < res->sq_posted) {
+        if (poll_completion(res))
+            return 1;
+    }
+    return 0;
+}
+
+static void atomic_max(uint64_t *p, uint64_t v)
+{
+    uint64_t cur = __atomic_load_n(p, __ATOMIC_RELAXED);
+
+    while (v > cur && !__atomic_compare_exchange_n(p, &cur, v, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+/* On a shared CQ, find the attached connection a CQE belongs to. */
+static struct resources *wc_owner(struct resources *dev, struct ibv_wc *wc)
+{
+    int n = __atomic_load_n(&dev->nconns, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < n; i++) {
+        struct resources *conn = __atomic_load_n(&dev->conns[i], __ATOMIC_ACQUIRE);
+
+        if (conn && ((conn->qp && conn->qp->qp_num == wc->qp_num) ||
+                     (conn->spare_qp && conn->spare_qp->qp_num == wc->qp_num)))
+            return conn;
+    }
+    return dev;
+}
+
+/* Position below which every QP of a striped connection has landed: the
+ * oldest completed cookie among QPs with writes in flight, or the newest
+ * posted one once all are idle. */
+static uint64_t stripe_landed(struct resources *lead)
+{
+    uint64_t landed = UINT64_MAX;
+    uint64_t top = 0;
+
+    for (int i = -1; i < lead->nstripes; i++) {
+        struct resources *m = i < 0 ? lead : lead->stripe[i];
+        uint64_t posted = __atomic_load_n(&m->posted_cookie, __ATOMIC_ACQUIRE);
+        uint64_t done = __atomic_load_n(&m->qp_done, __ATOMIC_ACQUIRE);
+
+        if (posted > top)
+            top = posted;
+        if (__atomic_load_n(&m->sq_retired, __ATOMIC_ACQUIRE) < __atomic_load_n(&m->sq_posted, __ATOMIC_ACQUIRE) &&
+            done < landed)
+            landed = done;
+    }
+    return landed == UINT64_MAX ? top : landed;
+}
+
+/* Widen a 32-bit immediate to the 64-bit cookie it was cut from; cookies
+ * never jump by 2^32 between two notifications. */
+static uint64_t imm_extend(uint64_t prev, uint32_t imm)
+{
+    uint64_t pos = (prev & ~(uint64_t)0xffffffff) | imm;
+
+    if (pos < prev)
+        pos += (uint64_t)1 << 32;
+    return pos;
+}
+
+/* Whether wc completes a sequenced WR off res's send queue. The opcode of
+ * an error CQE is undefined, so those go by the QP and the wr_id: send WRs
+ * are numbered from 1 (seq_chain), SRQ receives carry 0. */
+static int wc_is_send(const struct resources *res, const struct ibv_wc *wc)
+{
+    if (wc->status == IBV_WC_SUCCESS)
+        return !(wc->opcode & IBV_WC_RECV);
+    return res->qp && wc->qp_num == res->qp->qp_num && wc->wr_id &&
+           wc->wr_id <= __atomic_load_n(&res->sq_posted, __ATOMIC_ACQUIRE);
+}
+
+/* Map a CQE back to the caller's cookie. A signaled send completion retires
+ * its WR and every unsignaled WR posted before it; the first error is kept
+ * so the caller can tell which append failed. The CQ may be shared, so the
+ * owning connection's counters are only ever raised atomically. */
+static int handle_wc(struct resources *dev, struct ibv_wc *wc)
+{
+    struct resources *res = dev->nconns ? wc_owner(dev, wc) : dev;
+    struct resources *lead = res->leader ? res->leader : res;
+    uint64_t cookie = 0;
+
+    // Flushed off a QP that has since been swapped out; its WRs were written off
+    if (res->spare_qp && wc->qp_num == res->spare_qp->qp_num)
+        return 0;
+
+    if (wc_is_send(res, wc))
+        cookie = res->wr_cookie[wc->wr_id % res->sq_depth];
+
+    if (wc->status != IBV_WC_SUCCESS) {
+        if (res->failed_status == IBV_WC_SUCCESS) {
+            res->failed_status = wc->status;
+            res->failed_wr_id = wc->wr_id;
+            res->failed_cookie = cookie;
+            fprintf(stderr, "got bad completion for wr_id %lu (cookie %lu) with status: 0x%x (%s), vendor syndrome: 0x%x\n",
+                    (unsigned long)wc->wr_id, (unsigned long)cookie, wc->status,
+                    ibv_wc_status_str(wc->status), wc->vendor_err);
+        }
+        if (lead != res && lead->failed_status == IBV_WC_SUCCESS) {
+            lead->failed_wr_id = wc->wr_id;
+            lead->failed_cookie = cookie;
+            lead->failed_status = wc->status;
+        }
+        return 1;
+    }
+
+    if (!(wc->opcode & IBV_WC_RECV)) {
+#if RDMA_STATS
+        STATS_HIST(latency, stats_now() - res->wr_posted[wc->wr_id % res->sq_depth], STATS_LAT_BUCKETS);
+#endif
+        atomic_max(&res->qp_done, cookie);
+        atomic_max(&res->sq_retired, wc->wr_id);
+        if (lead->nstripes)
+            atomic_max(&lead->done_cookie, stripe_landed(lead));
+        else
+            atomic_max(&res->done_cookie, cookie);
+    } else if (wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+        // A QP's receives complete in order on one CQ, so only one thread writes this
+        __atomic_store_n(&res->imm_pos, imm_extend(res->imm_pos, ntohl(wc->imm_data)), __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/* Put count zero-length receives back on the SRQ; a write-with-immediate
+ * consumes one without touching its (absent) buffer. */
+static int srq_post(struct resources *dev, int count)
+{
+    struct ibv_recv_wr wr[CQ_POLL_BATCH];
+    struct ibv_recv_wr *bad_wr = NULL;
+    int n, rc;
+
+    for (; count > 0; count -= n) {
+        n = count < CQ_POLL_BATCH ? count : CQ_POLL_BATCH;
+        memset(wr, 0, n * sizeof(wr[0]));
+        for (int i = 0; i + 1 < n; i++)
+            wr[i].next = &wr[i + 1];
+
+        rc = dev->ops->post_srq_recv(dev, wr, &bad_wr);
+        if (rc) {
+            fprintf(stderr, "ibv_post_srq_recv failed with error: %d\n", rc);
+            return rc;
+        }
+    }
+    return 0;
+}
+
+static int handle_wcs(struct resources *res, struct ibv_wc *wc, int n)
+{
+    int recvs = 0;
+    int rc = 0;
+
+    STATS_ADD(polls, 1);
+    STATS_ADD(polls_empty, n == 0);
+    STATS_ADD(cqes, n);
+    for (int i = 0; i < n; i++) {
+        if (handle_wc(res, &wc[i]))
+            rc = 1;
+        else if (wc[i].opcode & IBV_WC_RECV)
+            recvs++;
+    }
+    if (recvs && res->srq_depth && srq_post(res, recvs))
+        rc = 1;
+    return rc;
+}
+
+/* Drain whatever completions are ready without waiting. */
+int rdma_reap(struct resources *res)
+{
+    struct ibv_wc wc[CQ_POLL_BATCH];
+    int n;
+
+    struct resources *dev = res->parent ? res->parent : res;
+
+    n = cq_engine_poll(&dev->cq_eng, wc, CQ_POLL_BATCH);
+    if (n < 0) {
+        fprintf(stderr, "poll CQ failed\n");
+        return 1;
+    }
+    return handle_wcs(dev, wc, n);
+}
+
+/* Wait up to timeout_ms on a per-thread receive CQ of dev's connections and
+ * handle what arrived; 0 only polls. Returns the number of CQEs, -1 on error. */
+int rdma_reap_recv(struct resources *dev, struct cq_engine *eng, int timeout_ms)
+{
+    struct ibv_wc wc[CQ_POLL_BATCH];
+    int n;
+
+    if (timeout_ms)
+        n = cq_engine_wait(eng, wc, CQ_POLL_BATCH, timeout_ms);
+    else
+        n = cq_engine_poll(eng, wc, CQ_POLL_BATCH);
+    if (n < 0) {
+        fprintf(stderr, "poll receive CQ failed\n");
+        return -1;
+    }
+    handle_wcs(dev, wc, n);
+    return n;
+}
+
+/* Reap at least one CQE, waiting up to MAX_POLL_CQ_TIMEOUT ms in the
+ * configured CQ mode. On a shared CQ another thread may reap this
+ * connection's CQEs, so wait in short slices and let the caller recheck its
+ * counters in between. */
+int poll_completion(struct resources *res)
+{
+    struct ibv_wc wc[CQ_POLL_BATCH];
+    struct resources *dev = res->parent ? res->parent : res;
+    int n;
+
+    if (res->failed_status != IBV_WC_SUCCESS)
+        return 1;
+
+    if (res->parent) {
+        n = cq_engine_wait(&dev->cq_eng, wc, CQ_POLL_BATCH, 1);
+        if (n > 0) {
+            res->idle_ms = 0;
+            return handle_wcs(dev, wc, n) || res->failed_status != IBV_WC_SUCCESS;
+        }
+        if (n == 0 && ++res->idle_ms < MAX_POLL_CQ_TIMEOUT)
+            return 0;
+    } else {
+        n = cq_engine_wait(&dev->cq_eng, wc, CQ_POLL_BATCH, MAX_POLL_CQ_TIMEOUT);
+    }
+
+    if (n < 0) {
+        fprintf(stderr, "poll CQ failed\n");
+        return 1;
+    }
+    if (n == 0) {
+        fprintf(stderr, "completion wasn't found in the CQ after timeout\n");
+        return 1;
+    }
+    return handle_wcs(dev, wc, n);
 }
 
 static int sock_sync_data(int sock, int xfer_size, char *local_data, char *remote_data)
 {
-    fprintf(stdout, "Entering function: %s\n", __func__);
+    pr_trace("Entering function: %s\n", __func__);
     int rc;
     int read_bytes = 0;
     int total_read_bytes = 0;
@@ -171,7 +726,7 @@ static int sock_sync_data(int sock, int xfer_size, char *local_data, char *remot
 
 int post_send(struct resources *res, int opcode)
 {
-    fprintf(stdout, "Entering function: %s\n", __func__);
+    pr_trace("Entering function: %s\n", __func__);
     struct ibv_send_wr sr;
     struct ibv_sge sge;
     struct ibv_send_wr *bad_wr = NULL;
@@ -195,45 +750,19 @@ int post_send(struct resources *res, int opcode)
         sr.wr.rdma.rkey = res->remote_props.rkey;
     }
 
-    rc = ibv_post_send(res->qp, &sr, &bad_wr);
-    //-----------Debug-----------------
-
-    if (rc) {
-        fprintf(stderr, "failed to post SR, error: %d\n", rc);
-    } else {
-        fprintf(stdout, "SR was posted successfully\n");
-        fprintf(stdout, "RDMA operation details:\n");
-        fprintf(stdout, "  opcode: %d\n", opcode);
-        fprintf(stdout, "  send_flags: 0x%x\n", sr.send_flags);
-        fprintf(stdout, "  addr: 0x%lx\n", (unsigned long)sge.addr);
-        fprintf(stdout, "  length: %u\n", sge.length);
-        fprintf(stdout, "  lkey: 0x%x\n", sge.lkey);
-        if (opcode != IBV_WR_SEND) {
-            fprintf(stdout, "  remote_addr: 0x%lx\n", (unsigned long)sr.wr.rdma.remote_addr);
-            fprintf(stdout, "  rkey: 0x%x\n", sr.wr.rdma.rkey);
-        }
-    }
-
-    //-----------Debug-----------------
+    rc = res->ops->post_send(res, &sr, &bad_wr);
     if (rc) {
         fprintf(stderr, "ibv_post_send failed with error: %d\n", rc);
+        return rc;
     }
-    else {
-        switch (opcode) {
-        case IBV_WR_SEND:
-            fprintf(stdout, "Send Request was posted\n");
-            break;
-        case IBV_WR_RDMA_READ:
-            fprintf(stdout, "RDMA Read Request was posted\n");
-            break;
-        case IBV_WR_RDMA_WRITE:
-            fprintf(stdout, "RDMA Write Request was posted\n");
-            break;
-        default:
-            fprintf(stdout, "Unknown Request was posted\n");
-            break;
-        }
-    }
+    STATS_ADD(doorbells, 1);
+    STATS_ADD(posts, 1);
+    STATS_ADD(bytes, sge.length);
+
+    pr_debug("SR was posted: opcode %d, send_flags 0x%x, addr 0x%lx, length %u, lkey 0x%x\n", opcode,
+             sr.send_flags, (unsigned long)sge.addr, sge.length, sge.lkey);
+    if (opcode != IBV_WR_SEND)
+        pr_debug("  remote_addr: 0x%lx, rkey: 0x%x\n", (unsigned long)sr.wr.rdma.remote_addr, sr.wr.rdma.rkey);
     return rc;
 }
 
@@ -242,16 +771,19 @@ int post_send(struct resources *res, int opcode)
 
 void resources_init(struct resources *res)
 {
-    fprintf(stdout, "Entering function: %s\n", __func__);
+    pr_trace("Entering function: %s\n", __func__);
     memset(res, 0, sizeof *res);
     res->sock = -1;
+    res->cq_eng.epfd = -1;
+    pthread_mutex_init(&res->conn_lock, NULL);
 }
 
 
 
-int resources_create(struct resources *res)
+/* ---- verbs transport ---- */
+
+static int verbs_open_device(struct resources *res)
 {
-    fprintf(stdout, "Entering function: %s\n", __func__);
     struct rlimit rlim;
     if (getrlimit(RLIMIT_NOFILE, &rlim) == 0) {
         fprintf(stdout, "Current file descriptor limit: %lu\n", (unsigned long)rlim.rlim_cur);
@@ -259,12 +791,9 @@ int resources_create(struct resources *res)
         fprintf(stderr, "Failed to get resource limits: %s\n", strerror(errno));
     }
     struct ibv_device **dev_list = NULL;
-    struct ibv_qp_init_attr qp_init_attr;
     struct ibv_device *ib_dev = NULL;
-    size_t size;
+    struct ibv_device_attr_ex attr_ex;
     int i;
-    int mr_flags = 0;
-    int cq_size = 0;
     int num_devices;
     int rc = 0;
 
@@ -272,13 +801,13 @@ int resources_create(struct resources *res)
     if (!dev_list) {
         fprintf(stderr, "failed to get IB devices list\n");
         rc = 1;
-        goto resources_create_exit;
+        goto verbs_open_device_exit;
     }
 
     if (!num_devices) {
         fprintf(stderr, "found %d device(s)\n", num_devices);
         rc = 1;
-        goto resources_create_exit;
+        goto verbs_open_device_exit;
     }
 
     for (i = 0; i < num_devices; i++) {
@@ -295,61 +824,43 @@ int resources_create(struct resources *res)
     if (!ib_dev) {
         fprintf(stderr, "IB device %s wasn't found\n", config.dev_name);
         rc = 1;
-        goto resources_create_exit;
+        goto verbs_open_device_exit;
     }
 
     res->ib_ctx = ibv_open_device(ib_dev);
     if (!res->ib_ctx) {
         fprintf(stderr, "failed to open device %s\n", config.dev_name);
         rc = 1;
-        goto resources_create_exit;
+        goto verbs_open_device_exit;
     }
 
     if (ibv_query_port(res->ib_ctx, config.ib_port, &res->port_attr)) {
         fprintf(stderr, "ibv_query_port on port %u failed\n", config.ib_port);
         rc = 1;
-        goto resources_create_exit;
+        goto verbs_open_device_exit;
     }
 
     print_port_info(res->ib_ctx, config.ib_port);
 
-    res->pd = ibv_alloc_pd(res->ib_ctx);
-    if (!res->pd) {
-        fprintf(stderr, "ibv_alloc_pd failed\n");
-        rc = 1;
-        goto resources_create_exit;
-    }
-
-    cq_size = 10;
-    res->cq = ibv_create_cq(res->ib_ctx, cq_size, NULL, NULL, 0);
-    if (!res->cq) {
-        fprintf(stderr, "failed to create CQ with %u entries\n", cq_size);
+    if (ibv_query_device(res->ib_ctx, &res->device_attr)) {
+        fprintf(stderr, "ibv_query_device failed\n");
         rc = 1;
-        goto resources_create_exit;
+        goto verbs_open_device_exit;
     }
 
-    size = MSG_SIZE;
-    res->buf = (char *)malloc(size);
-    if (!res->buf) {
-        fprintf(stderr, "failed to malloc %zu bytes to memory buffer\n", size);
+    res->pd = ibv_alloc_pd(res->ib_ctx);
+    if (!res->pd) {
+        fprintf(stderr, "ibv_alloc_pd failed\n");
         rc = 1;
-        goto resources_create_exit;
+        goto verbs_open_device_exit;
     }
 
-    memset(res->buf, 0, size);
-
-    //store the buffer size
-    res->buf_size = (uint32_t)size;
-
-    fprintf(stdout, "Buffer initialized to zero, size: %zu bytes\n", size);
-
-    mr_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
-
-    // Add this debug print
-    fprintf(stdout, "Registering MR with size: %zu bytes\n", size);
-
-    
-    res->mr = ibv_reg_mr(res->pd, res->buf, size, mr_flags);
+    // Caller memory can then be registered without pinning it, see mr_cache.h
+    memset(&attr_ex, 0, sizeof(attr_ex));
+    if (!ibv_query_device_ex(res->ib_ctx, NULL, &attr_ex) &&
+        (attr_ex.odp_caps.general_caps & IBV_ODP_SUPPORT) &&
+        (attr_ex.odp_caps.per_transport_caps.rc_odp_caps & IBV_ODP_SUPPORT_SEND))
+        res->odp = 1;
 
     if (res->port_attr.state != IBV_PORT_ACTIVE) {
         fprintf(stderr, "Port is not in active state (state: %d - %s)\n", 
@@ -358,126 +869,122 @@ int resources_create(struct resources *res)
         fprintf(stderr, "This may be normal for RoCE environments. Continuing...\n");
     }
 
-    if (!res->mr) {
-        fprintf(stderr, "ibv_reg_mr failed with mr_flags=0x%x\n", mr_flags);
-        rc = 1;
-        goto resources_create_exit;
-    }
-
-    memset(&qp_init_attr, 0, sizeof(qp_init_attr));
-    qp_init_attr.qp_type = IBV_QPT_RC;
-    qp_init_attr.sq_sig_all = 1;
-    qp_init_attr.send_cq = res->cq;
-    qp_init_attr.recv_cq = res->cq;
-    qp_init_attr.cap.max_send_wr = 10;
-    qp_init_attr.cap.max_recv_wr = 10;
-    qp_init_attr.cap.max_send_sge = 1;
-    qp_init_attr.cap.max_recv_sge = 1;
-
-    fprintf(stdout, "Creating QP with max_send_wr: %d, max_recv_wr: %d\n", 
-        qp_init_attr.cap.max_send_wr, qp_init_attr.cap.max_recv_wr);
-
-
-    res->qp = ibv_create_qp(res->pd, &qp_init_attr);
-    if (!res->qp) {
-        fprintf(stderr, "failed to create QP\n");
-        rc = 1;
-        goto resources_create_exit;
-    }
-
-resources_create_exit:
+verbs_open_device_exit:
+    // The opened context stays valid once the list is gone
+    if (dev_list)
+        ibv_free_device_list(dev_list);
     if (rc) {
-        if (res->qp) {
-            ibv_destroy_qp(res->qp);
-            res->qp = NULL;
-        }
-        if (res->mr) {
-            ibv_dereg_mr(res->mr);
-            res->mr = NULL;
-        }
-        if (res->buf) {
-            free(res->buf);
-            res->buf = NULL;
-        }
-        if (res->cq) {
-            ibv_destroy_cq(res->cq);
-            res->cq = NULL;
-        }
-        if (res->pd) {
-            ibv_dealloc_pd(res->pd);
-            res->pd = NULL;
-        }
         if (res->ib_ctx) {
             ibv_close_device(res->ib_ctx);
             res->ib_ctx = NULL;
         }
-        if (dev_list) {
-            ibv_free_device_list(dev_list);
-            dev_list = NULL;
-        }
     }
     return rc;
 }
 
-int resources_destroy(struct resources *res)
+static void verbs_close_device(struct resources *res)
 {
-    fprintf(stdout, "Entering function: %s\n", __func__);
-    int rc = 0;
-
-    if (res->qp)
-        if (ibv_destroy_qp(res->qp)) {
-            fprintf(stderr, "failed to destroy QP\n");
-            rc = 1;
-        }
+    if (res->srq && ibv_destroy_srq(res->srq))
+        fprintf(stderr, "failed to destroy SRQ\n");
+    res->srq = NULL;
 
-    if (res->mr)
-        if (ibv_dereg_mr(res->mr)) {
-            fprintf(stderr, "failed to deregister MR\n");
-            rc = 1;
-        }
+    if (res->pd && ibv_dealloc_pd(res->pd))
+        fprintf(stderr, "failed to deallocate PD\n");
+    res->pd = NULL;
 
-    if (res->buf)
-        free(res->buf);
+    if (res->ib_ctx && ibv_close_device(res->ib_ctx))
+        fprintf(stderr, "failed to close device context\n");
+    res->ib_ctx = NULL;
+}
 
-    if (res->cq)
-        if (ibv_destroy_cq(res->cq)) {
-            fprintf(stderr, "failed to destroy CQ\n");
-            rc = 1;
-        }
+static int verbs_pool_create(struct resources *res, size_t size, size_t reserved, int access)
+{
+    int numa_node = config.numa_node >= 0 ? config.numa_node : mem_pool_dev_numa_node(res->ib_ctx->device);
 
-    if (res->pd)
-        if (ibv_dealloc_pd(res->pd)) {
-            fprintf(stderr, "failed to deallocate PD\n");
-            rc = 1;
-        }
+    return mem_pool_create(&res->pool, res->pd, -1, size, reserved, config.chunk_size,
+                           config.hugepage_size, numa_node, res->device_attr.max_mr_size, access);
+}
 
-    if (res->ib_ctx)
-        if (ibv_close_device(res->ib_ctx)) {
-            fprintf(stderr, "failed to close device context\n");
-            rc = 1;
-        }
+static int verbs_cq_create(struct resources *res, struct cq_engine *eng, int cqe, enum cq_mode mode)
+{
+    return cq_engine_init(eng, res->ib_ctx, cqe, mode);
+}
 
-    if (res->sock >= 0)
-        if (close(res->sock)) {
-            fprintf(stderr, "failed to close socket\n");
-            rc = 1;
-        }
+static int verbs_srq_create(struct resources *res, uint32_t depth)
+{
+    struct ibv_srq_init_attr srq_attr;
+
+    memset(&srq_attr, 0, sizeof(srq_attr));
+    srq_attr.attr.max_wr = depth;
+    if (srq_attr.attr.max_wr > (uint32_t)res->device_attr.max_srq_wr)
+        srq_attr.attr.max_wr = res->device_attr.max_srq_wr;
+    srq_attr.attr.max_sge = 1;
+
+    res->srq = ibv_create_srq(res->pd, &srq_attr);
+    if (!res->srq) {
+        // Plain writes still work; only write-with-immediate peers need receives
+        fprintf(stderr, "ibv_create_srq failed, immediate notifications disabled\n");
+        return 0;
+    }
+    res->srq_depth = srq_attr.attr.max_wr;
+    return 0;
+}
 
-    return rc;
+static int verbs_post_srq_recv(struct resources *res, struct ibv_recv_wr *wr, struct ibv_recv_wr **bad_wr)
+{
+    return ibv_post_srq_recv(res->srq, wr, bad_wr);
+}
+
+static int verbs_qp_create(struct resources *res, struct ibv_qp_init_attr *qp_init_attr)
+{
+    res->qp = ibv_create_qp(res->pd, qp_init_attr);
+    // Providers reject inline sizes they can't honour; back off until one sticks
+    while (!res->qp && qp_init_attr->cap.max_inline_data) {
+        qp_init_attr->cap.max_inline_data /= 2;
+        res->qp = ibv_create_qp(res->pd, qp_init_attr);
+    }
+    if (!res->qp)
+        return 1;
+
+    // ibv_create_qp reports back the inline size actually granted
+    res->max_inline = qp_init_attr->cap.max_inline_data;
+    return 0;
+}
+
+static int verbs_qp_destroy(struct resources *res)
+{
+    return ibv_destroy_qp(res->qp);
+}
+
+static int verbs_qp_reset(struct resources *res, struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+
+    (void)res;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RESET;
+    return ibv_modify_qp(qp, &attr, IBV_QP_STATE);
+}
+
+static int verbs_post_send(struct resources *res, struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr)
+{
+    return ibv_post_send(res->qp, wr, bad_wr);
 }
 
-static int modify_qp_to_init(struct ibv_qp *qp)
+static int modify_qp_to_init(struct ibv_qp *qp, int port, int atomics)
 {
-    fprintf(stdout, "Entering function: %s\n", __func__);
+    pr_trace("Entering function: %s\n", __func__);
     struct ibv_qp_attr attr;
     int flags;
     int rc;
 
     memset(&attr, 0, sizeof(attr));
     attr.qp_state = IBV_QPS_INIT;
-    attr.port_num = config.ib_port;
+    attr.port_num = port;
     attr.pkey_index = 0;
     attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+    if (atomics)
+        attr.qp_access_flags |= IBV_ACCESS_REMOTE_ATOMIC;
 
     flags = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS;
 
@@ -486,30 +993,30 @@ static int modify_qp_to_init(struct ibv_qp *qp)
         fprintf(stderr, "failed to modify QP state to INIT\n");
     return rc;
 }
-
-static int modify_qp_to_rtr(struct ibv_qp *qp, uint32_t remote_qpn, uint16_t dlid, uint8_t *dgid)
+static int modify_qp_to_rtr(struct ibv_qp *qp, int port, const struct conn_params *p, uint32_t remote_qpn,
+                            uint16_t dlid, uint8_t *dgid)
 {
-    fprintf(stdout, "Entering function: %s\n", __func__);
+    pr_trace("Entering function: %s\n", __func__);
     struct ibv_qp_attr attr;
     int flags;
     int rc;
 
     memset(&attr, 0, sizeof(attr));
     attr.qp_state = IBV_QPS_RTR;
-    attr.path_mtu = IBV_MTU_256;
+    attr.path_mtu = p->mtu;
     attr.dest_qp_num = remote_qpn;
     attr.rq_psn = 0;
-    attr.max_dest_rd_atomic = 1;
+    attr.max_dest_rd_atomic = p->dest_rd_atomic;
     attr.min_rnr_timer = 0x12;
     attr.ah_attr.is_global = 0;
     attr.ah_attr.dlid = dlid;
     attr.ah_attr.sl = 0;
     attr.ah_attr.src_path_bits = 0;
-    attr.ah_attr.port_num = config.ib_port;
+    attr.ah_attr.port_num = port;
 
     if (config.gid_idx >= 0) {
         attr.ah_attr.is_global = 1;
-        attr.ah_attr.port_num = config.ib_port;
+        attr.ah_attr.port_num = port;
         memcpy(&attr.ah_attr.grh.dgid, dgid, 16);
         attr.ah_attr.grh.flow_label = 0;
         attr.ah_attr.grh.hop_limit = 1;
@@ -539,20 +1046,20 @@ static int modify_qp_to_rtr(struct ibv_qp *qp, uint32_t remote_qpn, uint16_t dli
     return rc;
 }
 
-static int modify_qp_to_rts(struct ibv_qp *qp)
+static int modify_qp_to_rts(struct ibv_qp *qp, const struct conn_params *p)
 {
-    fprintf(stdout, "Entering function: %s\n", __func__);
+    pr_trace("Entering function: %s\n", __func__);
     struct ibv_qp_attr attr;
     int flags;
     int rc;
 
     memset(&attr, 0, sizeof(attr));
     attr.qp_state = IBV_QPS_RTS;
-    attr.timeout = 0x12;
-    attr.retry_cnt = 6;
-    attr.rnr_retry = 0;
+    attr.timeout = p->timeout;
+    attr.retry_cnt = p->retry_cnt;
+    attr.rnr_retry = p->rnr_retry; // 7 retries forever if the peer's SRQ momentarily runs dry
     attr.sq_psn = 0;
-    attr.max_rd_atomic = 1;
+    attr.max_rd_atomic = p->rd_atomic;
 
     flags = IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
             IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC;
@@ -566,55 +1073,540 @@ static int modify_qp_to_rts(struct ibv_qp *qp)
     return rc;
 }
 
-int connect_qp(struct resources *res)
+static int res_port(const struct resources *res)
+{
+    return res->ib_port ? res->ib_port : config.ib_port;
+}
+
+static int verbs_conn_local(struct resources *res, struct cm_con_data_t *local_con_data)
 {
-    fprintf(stdout, "Entering function: %s\n", __func__);
-    struct cm_con_data_t local_con_data;
-    struct cm_con_data_t remote_con_data;
-    struct cm_con_data_t tmp_con_data;
-    int rc = 0;
-    char temp_char;
     union ibv_gid my_gid;
+    int port = res_port(res);
+    int rc;
+
+    // A stripe on another port of the HCA has its own LID, MTU and link layer
+    if (port != config.ib_port && ibv_query_port(res->ib_ctx, port, &res->port_attr)) {
+        fprintf(stderr, "ibv_query_port on port %u failed\n", port);
+        return 1;
+    }
+
+    if (res->port_attr.link_layer == IBV_LINK_LAYER_ETHERNET && config.gid_idx < 0) {
+        fprintf(stdout, "Detected Ethernet link layer (RoCE). Using GID-based addressing.\n");
+        config.gid_idx = 0;  // You might need to adjust this value
+    }
 
     if (config.gid_idx >= 0) {
-        rc = ibv_query_gid(res->ib_ctx, config.ib_port, config.gid_idx, &my_gid);
+        rc = ibv_query_gid(res->ib_ctx, port, config.gid_idx, &my_gid);
         if (rc) {
-            fprintf(stderr, "could not get gid for port %d, index %d\n", config.ib_port, config.gid_idx);
+            fprintf(stderr, "could not get gid for port %d, index %d\n", port, config.gid_idx);
             return rc;
         }
     } else
         memset(&my_gid, 0, sizeof my_gid);
 
-    local_con_data.addr = htonll((uintptr_t)res->buf);
-    local_con_data.rkey = htonl(res->mr->rkey);
-    local_con_data.qp_num = htonl(res->qp->qp_num);
-    local_con_data.lid = htons(res->port_attr.lid);
-    memcpy(local_con_data.gid, &my_gid, 16);
-    local_con_data.size = htonl(res->buf_size);  // Add this line
+    local_con_data->lid = res->port_attr.lid;
+    memcpy(local_con_data->gid, &my_gid, 16);
+    return 0;
+}
+
+static int verbs_conn_apply(struct resources *res)
+{
+    struct cm_con_data_t *remote = &res->remote_props;
+
+    if (modify_qp_to_init(res->qp, res_port(res), res->device_attr.atomic_cap != IBV_ATOMIC_NONE)) {
+        fprintf(stderr, "change QP state to INIT failed\n");
+        return 1;
+    }
+
+    fprintf(stdout, "Modifying QP to RTR with remote QP: %u, remote LID: %u\n", remote->qp_num, remote->lid);
+    if (config.gid_idx >= 0) {
+        fprintf(stdout, "Using GID index: %d\n", config.gid_idx);
+        fprintf(stdout, "Remote GID: ");
+        for (int i = 0; i < 16; i++) {
+            fprintf(stdout, "%02x", remote->gid[i]);
+        }
+        fprintf(stdout, "\n");
+    }
+
+    if (modify_qp_to_rtr(res->qp, res_port(res), &res->params, remote->qp_num, remote->lid, remote->gid)) {
+        fprintf(stderr, "failed to modify QP state to RTR\n");
+        return 1;
+    }
+
+    if (modify_qp_to_rts(res->qp, &res->params)) {
+        fprintf(stderr, "failed to modify QP state to RTS\n");
+        return 1;
+    }
+
+    if (remote->lid == 65535) {
+        fprintf(stderr, "Invalid remote LID. This might indicate a RoCE v2 setup.\n");
+        fprintf(stderr, "Try setting GID index explicitly in the configuration.\n");
+    }
+    return 0;
+}
+
+const struct transport_ops verbs_transport = {
+    .name = "verbs",
+    .open_device = verbs_open_device,
+    .close_device = verbs_close_device,
+    .pool_create = verbs_pool_create,
+    .cq_create = verbs_cq_create,
+    .srq_create = verbs_srq_create,
+    .post_srq_recv = verbs_post_srq_recv,
+    .qp_create = verbs_qp_create,
+    .qp_destroy = verbs_qp_destroy,
+    .qp_reset = verbs_qp_reset,
+    .conn_local = verbs_conn_local,
+    .conn_apply = verbs_conn_apply,
+    .post_send = verbs_post_send,
+};
+
+int transport_parse(const char *name, const struct transport_ops **ops)
+{
+    if (!strcmp(name, verbs_transport.name))
+        *ops = &verbs_transport;
+    else if (!strcmp(name, shm_transport.name))
+        *ops = &shm_transport;
+    else {
+        fprintf(stderr, "unknown transport '%s' (verbs or shm)\n", name);
+        return 1;
+    }
+    return 0;
+}
+
+/* ---- transport-independent setup ---- */
+
+/* Open the device and set up everything connections can share: PD, CQ,
+ * SRQ and the registered pool. No QP is created. */
+int resources_create_device(struct resources *res)
+{
+    pr_trace("Entering function: %s\n", __func__);
+    size_t size;
+    int mr_flags = 0;
+    int cq_size = 0;
+    int rc = 0;
+
+    res->ops = config.transport ? config.transport : &verbs_transport;
+    fprintf(stdout, "Using %s transport\n", res->ops->name);
+
+    if (res->ops->open_device(res))
+        return 1;
+
+    res->sq_depth = config.queue_depth > 0 ? config.queue_depth : DEFAULT_QUEUE_DEPTH;
+    if (res->sq_depth > (uint32_t)res->device_attr.max_qp_wr)
+        res->sq_depth = res->device_attr.max_qp_wr;
+    if (res->sq_depth < 2)
+        res->sq_depth = 2;
+
+    // Keep a signaled WR inside every half queue so post_chain can always make progress
+    res->signal_interval = config.signal_interval > 0 ? config.signal_interval : 1;
+    if (res->signal_interval > res->sq_depth / 2)
+        res->signal_interval = res->sq_depth / 2;
+
+    cq_size = config.cq_depth > 0 ? config.cq_depth : res->sq_depth * (config.num_qps > 1 ? config.num_qps : 1) + 10;
+    if (cq_size > res->device_attr.max_cqe)
+        cq_size = res->device_attr.max_cqe;
+    if (res->ops->cq_create(res, &res->cq_eng, cq_size, config.cq_mode)) {
+        rc = 1;
+        goto resources_create_exit;
+    }
+    res->cq = res->cq_eng.cq;
+    fprintf(stdout, "CQ created with %d entries in %s mode\n", cq_size, cq_mode_str(config.cq_mode));
+
+    if (config.srq_depth > 0) {
+        if (res->ops->srq_create(res, config.srq_depth)) {
+            rc = 1;
+            goto resources_create_exit;
+        }
+        if (res->srq_depth) {
+            if (srq_post(res, res->srq_depth)) {
+                rc = 1;
+                goto resources_create_exit;
+            }
+            fprintf(stdout, "SRQ created with %u receives posted\n", res->srq_depth);
+        }
+    }
+
+    size = config.buf_size ? config.buf_size : MSG_SIZE;
+
+    //store the buffer size
+    res->buf_size = (uint32_t)size;
+
+    mr_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+    if (res->device_attr.atomic_cap != IBV_ATOMIC_NONE)
+        mr_flags |= IBV_ACCESS_REMOTE_ATOMIC;
+
+    fprintf(stdout, "Registering memory pool of %zu bytes (buffer %zu bytes)\n",
+        config.pool_size > size ? config.pool_size : size, size);
+
+    // The log buffer is the pool's reserved head, so it sits inside one MR
+    if (res->ops->pool_create(res, config.pool_size, size, mr_flags)) {
+        rc = 1;
+        goto resources_create_exit;
+    }
+    res->buf = res->pool.base;
+    res->mr = mem_pool_mr(&res->pool, res->buf);
+
+resources_create_exit:
+    if (rc) {
+        mem_pool_destroy(&res->pool);
+        res->mr = NULL;
+        res->buf = NULL;
+        cq_engine_destroy(&res->cq_eng);
+        res->cq = NULL;
+        res->ops->close_device(res);
+    }
+    return rc;
+}
+
+/* Another CQ on dev, e.g. a per-thread receive CQ for resources_attach. */
+int resources_create_cq(struct resources *dev, struct cq_engine *eng, int cqe)
+{
+    if (cqe > dev->device_attr.max_cqe)
+        cqe = dev->device_attr.max_cqe;
+    return dev->ops->cq_create(dev, eng, cqe, config.cq_mode);
+}
+
+// Gather entries to ask for: as many as the device takes, up to RDMA_MAX_SGE
+static uint32_t qp_max_sge(const struct resources *res)
+{
+    const struct resources *dev = res->parent ? res->parent : res;
+    int n = dev->device_attr.max_sge;
+
+    return n < 1 ? 1 : n > RDMA_MAX_SGE ? RDMA_MAX_SGE : (uint32_t)n;
+}
+
+static void qp_init_attr_fill(struct resources *res, struct ibv_qp_init_attr *qp_init_attr)
+{
+    memset(qp_init_attr, 0, sizeof(*qp_init_attr));
+    qp_init_attr->qp_type = IBV_QPT_RC;
+    qp_init_attr->sq_sig_all = 0;
+    qp_init_attr->send_cq = res->cq;
+    qp_init_attr->recv_cq = res->recv_eng ? res->recv_eng->cq : res->cq;
+    qp_init_attr->srq = res->srq;
+    qp_init_attr->cap.max_send_wr = res->sq_depth;
+    qp_init_attr->cap.max_recv_wr = res->srq_depth ? 0 : 10;
+    qp_init_attr->cap.max_send_sge = qp_max_sge(res);
+    qp_init_attr->cap.max_recv_sge = 1;
+    qp_init_attr->cap.max_inline_data = config.inline_size > 0 ? config.inline_size : 0;
+}
+
+static int create_qp(struct resources *res)
+{
+    struct ibv_qp_init_attr qp_init_attr;
+
+    res->wr_cookie = (uint64_t *)calloc(2 * (size_t)res->sq_depth, sizeof(uint64_t));
+    if (!res->wr_cookie) {
+        fprintf(stderr, "failed to allocate WR cookie table\n");
+        return 1;
+    }
+    res->wr_posted = res->wr_cookie + res->sq_depth;
+
+    qp_init_attr_fill(res, &qp_init_attr);
+
+    fprintf(stdout, "Creating QP with max_send_wr: %d, max_recv_wr: %d, signal interval: %u\n",
+        qp_init_attr.cap.max_send_wr, qp_init_attr.cap.max_recv_wr, res->signal_interval);
+
+
+    if (res->ops->qp_create(res, &qp_init_attr)) {
+        fprintf(stderr, "failed to create QP\n");
+        free(res->wr_cookie);
+        res->wr_cookie = NULL;
+        return 1;
+    }
+
+    // ibv_create_qp reports back what it granted, which may be more
+    res->max_sge = qp_init_attr.cap.max_send_sge < RDMA_MAX_SGE ? qp_init_attr.cap.max_send_sge : RDMA_MAX_SGE;
+    fprintf(stdout, "QP max_inline_data: %u (requested %d), max_send_sge: %u\n", res->max_inline,
+            config.inline_size, res->max_sge);
+
+    return 0;
+}
+
+int resources_create(struct resources *res)
+{
+    if (resources_create_device(res))
+        return 1;
+
+    if (create_qp(res)) {
+        resources_destroy(res);
+        resources_init(res);
+        return 1;
+    }
+    return 0;
+}
+
+/* Give conn its own QP over dev's PD, CQ and SRQ, with buf (which must come
+ * from dev's pool) as its registered buffer. Receive completions go to
+ * recv_eng if given, so each polling thread can own the immediates of its
+ * connections. */
+int resources_attach(struct resources *conn, struct resources *dev, char *buf, uint32_t size,
+                     struct cq_engine *recv_eng)
+{
+    conn->parent = dev;
+    conn->ops = dev->ops;
+    conn->ib_ctx = dev->ib_ctx;
+    conn->device_attr = dev->device_attr;
+    conn->port_attr = dev->port_attr;
+    conn->pd = dev->pd;
+    conn->cq = dev->cq;
+    conn->srq = dev->srq;
+    conn->srq_depth = dev->srq_depth;
+    conn->recv_eng = recv_eng;
+    conn->sq_depth = dev->sq_depth;
+    conn->signal_interval = dev->signal_interval;
+    conn->buf = buf;
+    conn->buf_size = size;
+    conn->mr = mem_pool_mr(&dev->pool, buf);
+    if (!conn->mr) {
+        fprintf(stderr, "buffer %p is not in the device pool\n", (void *)buf);
+        return 1;
+    }
+
+    if (create_qp(conn))
+        return 1;
+
+    pthread_mutex_lock(&dev->conn_lock);
+    for (int i = 0; i < RDMA_MAX_CONNS; i++) {
+        if (!dev->conns[i]) {
+            __atomic_store_n(&dev->conns[i], conn, __ATOMIC_RELEASE);
+            if (i >= dev->nconns)
+                __atomic_store_n(&dev->nconns, i + 1, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&dev->conn_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&dev->conn_lock);
+
+    fprintf(stderr, "too many connections on one device (max %d)\n", RDMA_MAX_CONNS);
+    conn->ops->qp_destroy(conn);
+    conn->qp = NULL;
+    free(conn->wr_cookie);
+    conn->wr_cookie = NULL;
+    return 1;
+}
+
+int resources_destroy(struct resources *res)
+{
+    pr_trace("Entering function: %s\n", __func__);
+    int rc = 0;
+
+    for (int i = 0; i < res->nstripes; i++) {
+        if (resources_destroy(res->stripe[i]))
+            rc = 1;
+        free(res->stripe[i]);
+    }
+    res->nstripes = 0;
+
+    if (res->qp)
+        if (res->ops->qp_destroy(res)) {
+            fprintf(stderr, "failed to destroy QP\n");
+            rc = 1;
+        }
+    if (res->spare_qp) {
+        res->qp = res->spare_qp;
+        res->spare_qp = NULL;
+        if (res->ops->qp_destroy(res)) {
+            fprintf(stderr, "failed to destroy spare QP\n");
+            rc = 1;
+        }
+    }
+
+    if (res->wr_cookie)
+        free(res->wr_cookie);
+
+    if (res->parent) {
+        // Attached connection: the device objects belong to the parent
+        struct resources *dev = res->parent;
+
+        pthread_mutex_lock(&dev->conn_lock);
+        for (int i = 0; i < dev->nconns; i++) {
+            if (dev->conns[i] == res)
+                __atomic_store_n(&dev->conns[i], NULL, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&dev->conn_lock);
+
+        if (res->sock >= 0 && close(res->sock)) {
+            fprintf(stderr, "failed to close socket\n");
+            rc = 1;
+        }
+        return rc;
+    }
+
+    if (res->mr_cache) {
+        mr_cache_destroy(res->mr_cache);
+        free(res->mr_cache);
+        res->mr_cache = NULL;
+    }
+    if (mem_pool_destroy(&res->pool))
+        rc = 1;
+
+    cq_engine_destroy(&res->cq_eng);
+
+    if (res->ops)
+        res->ops->close_device(res);
+
+    if (res->sock >= 0)
+        if (close(res->sock)) {
+            fprintf(stderr, "failed to close socket\n");
+            rc = 1;
+        }
+
+    return rc;
+}
+
+/* Fill in this side's connection data, in network byte order. */
+static enum ibv_mtu mtu_from_bytes(int bytes)
+{
+    if (bytes >= 4096)
+        return IBV_MTU_4096;
+    if (bytes >= 2048)
+        return IBV_MTU_2048;
+    if (bytes >= 1024)
+        return IBV_MTU_1024;
+    if (bytes >= 512)
+        return IBV_MTU_512;
+    return IBV_MTU_256;
+}
+
+int conn_data_local(struct resources *res, struct cm_con_data_t *local_con_data)
+{
+    struct cm_con_data_t local;
+    int rc;
+
+    memset(&local, 0, sizeof(local));
+    local.addr = (uintptr_t)res->buf;
+    local.rkey = res->mr->rkey;
+    local.qp_num = res->qp->qp_num;
+    local.size = res->buf_size;
+    rc = res->ops->conn_local(res, &local);
+    if (rc)
+        return rc;
+
+    // Offer the cap rather than the port MTU so both sides settle on the same path MTU
+    local.mtu = res->port_attr.active_mtu ? res->port_attr.active_mtu : IBV_MTU_256;
+    if (config.mtu && mtu_from_bytes(config.mtu) < local.mtu)
+        local.mtu = mtu_from_bytes(config.mtu);
+    local.rd_atom = res->device_attr.max_qp_rd_atom > 255 ? 255 : res->device_attr.max_qp_rd_atom;
+    local.init_rd_atom = res->device_attr.max_qp_init_rd_atom > 255 ? 255 : res->device_attr.max_qp_init_rd_atom;
+    local.timeout = config.ack_timeout;
+    local.retry_cnt = config.retry_cnt;
+    local.rnr_retry = config.rnr_retry;
+
+    memset(local_con_data, 0, sizeof(*local_con_data));
+    local_con_data->magic = htons(CM_MAGIC);
+    local_con_data->version = htons(CM_VERSION);
+    local_con_data->length = htons(sizeof(*local_con_data));
+    local_con_data->flags = htons((config.spare_qps ? CM_FLAG_RECOVER : 0) | (config.pack ? CM_FLAG_PACK : 0) |
+                                  (config.shared_log ? CM_FLAG_SHARED : 0));
+    local_con_data->addr = htonll(local.addr);
+    local_con_data->rkey = htonl(local.rkey);
+    local_con_data->qp_num = htonl(local.qp_num);
+    local_con_data->lid = htons(local.lid);
+    memcpy(local_con_data->gid, local.gid, 16);
+    local_con_data->size = htonl(local.size);  // Add this line
+    local_con_data->mtu = local.mtu;
+    local_con_data->rd_atom = local.rd_atom;
+    local_con_data->init_rd_atom = local.init_rd_atom;
+    local_con_data->timeout = local.timeout;
+    local_con_data->retry_cnt = local.retry_cnt;
+    local_con_data->rnr_retry = local.rnr_retry;
+    local_con_data->sq_depth = htonl(res->sq_depth);
+    local_con_data->recv_depth = htonl(res->srq_depth ? res->srq_depth : 10);
+    local_con_data->max_inline = htonl(res->max_inline);
+    local_con_data->nqps = htonl(config.num_qps > 1 ? config.num_qps : 1);
+    local_con_data->fetch_log = htonl(res->fetch_log);
+    local_con_data->fetch_lsn = htonll(res->fetch_lsn);
+    local_con_data->shared_off = (int64_t)htonll((uint64_t)res->shared_off);
+    local_con_data->shared_rkey = htonl(res->shared_rkey);
+    local_con_data->shared_size = htonl(res->shared_size);
+    local_con_data->log_id = htonl(config.log_id);
 
     fprintf(stdout, "Local QP information:\n");
-    fprintf(stdout, "  QP number: %u\n", res->qp->qp_num);
-    fprintf(stdout, "  LID: %u\n", res->port_attr.lid);
+    fprintf(stdout, "  QP number: %u\n", local.qp_num);
+    fprintf(stdout, "  LID: %u\n", local.lid);
     fprintf(stdout, "Local GID: ");
     for (int i = 0; i < 16; i++) {
-        fprintf(stdout, "%02x", my_gid.raw[i]);
+        fprintf(stdout, "%02x", local.gid[i]);
     }
     fprintf(stdout, "\n");
+    return 0;
+}
 
-    if (sock_sync_data(res->sock, sizeof(struct cm_con_data_t), (char *)&local_con_data, (char *)&tmp_con_data) < 0) {
-        fprintf(stderr, "failed to exchange connection data between sides\n");
-        rc = 1;
-        goto connect_qp_exit;
-    }
+/* Settle the parameters both QPs must agree on. Each side offers its own
+ * limits: the path MTU is the smaller port MTU (capped by -M), our
+ * outstanding READs/atomics are bounded by what the peer serves and the
+ * other way round, and for timeouts and retries the more patient side wins
+ * so neither gives up on a peer that is still within its own budget. */
+static void conn_params_negotiate(struct resources *res, const struct cm_con_data_t *remote)
+{
+    struct conn_params *p = &res->params;
+    uint8_t local_rd = res->device_attr.max_qp_rd_atom > 255 ? 255 : res->device_attr.max_qp_rd_atom;
+    uint8_t local_init = res->device_attr.max_qp_init_rd_atom > 255 ? 255 : res->device_attr.max_qp_init_rd_atom;
+    // Fields a version 0 peer (or one that didn't fill them in) left as 0
+    enum ibv_mtu remote_mtu = remote->mtu ? (enum ibv_mtu)remote->mtu : IBV_MTU_256;
+    uint8_t remote_rd = remote->rd_atom ? remote->rd_atom : 1;
+    uint8_t remote_init = remote->init_rd_atom ? remote->init_rd_atom : 1;
+
+    p->mtu = res->port_attr.active_mtu ? res->port_attr.active_mtu : IBV_MTU_256;
+    if (remote_mtu < p->mtu)
+        p->mtu = remote_mtu;
+    if (config.mtu && mtu_from_bytes(config.mtu) < p->mtu)
+        p->mtu = mtu_from_bytes(config.mtu);
+
+    p->rd_atomic = local_init < remote_rd ? local_init : remote_rd;
+    p->dest_rd_atomic = local_rd < remote_init ? local_rd : remote_init;
+    if (!p->rd_atomic)
+        p->rd_atomic = 1;
+    if (!p->dest_rd_atomic)
+        p->dest_rd_atomic = 1;
+
+    p->timeout = remote->timeout > config.ack_timeout ? remote->timeout : config.ack_timeout;
+    p->retry_cnt = remote->retry_cnt > config.retry_cnt ? remote->retry_cnt : config.retry_cnt;
+    p->rnr_retry = remote->rnr_retry > config.rnr_retry ? remote->rnr_retry : config.rnr_retry;
+    if (p->timeout > 31)
+        p->timeout = 31;
+    if (p->retry_cnt > 7)
+        p->retry_cnt = 7;
+    if (p->rnr_retry > 7)
+        p->rnr_retry = 7;
+}
 
-    remote_con_data.addr = ntohll(tmp_con_data.addr);
-    remote_con_data.rkey = ntohl(tmp_con_data.rkey);
-    remote_con_data.qp_num = ntohl(tmp_con_data.qp_num);
-    remote_con_data.lid = ntohs(tmp_con_data.lid);
-    memcpy(remote_con_data.gid, tmp_con_data.gid, 16);
-    remote_con_data.size = ntohl(tmp_con_data.size);  // Add this line
+/* Record the peer's connection data and bring the QP up to RTS. */
+int conn_data_apply(struct resources *res, const struct cm_con_data_t *tmp_con_data)
+{
+    struct cm_con_data_t remote_con_data;
+
+    memset(&remote_con_data, 0, sizeof(remote_con_data));
+    remote_con_data.magic = ntohs(tmp_con_data->magic);
+    remote_con_data.version = ntohs(tmp_con_data->version);
+    remote_con_data.length = ntohs(tmp_con_data->length);
+    remote_con_data.flags = ntohs(tmp_con_data->flags);
+    remote_con_data.addr = ntohll(tmp_con_data->addr);
+    remote_con_data.rkey = ntohl(tmp_con_data->rkey);
+    remote_con_data.qp_num = ntohl(tmp_con_data->qp_num);
+    remote_con_data.lid = ntohs(tmp_con_data->lid);
+    memcpy(remote_con_data.gid, tmp_con_data->gid, 16);
+    remote_con_data.size = ntohl(tmp_con_data->size);  // Add this line
+    remote_con_data.mtu = tmp_con_data->mtu;
+    remote_con_data.rd_atom = tmp_con_data->rd_atom;
+    remote_con_data.init_rd_atom = tmp_con_data->init_rd_atom;
+    remote_con_data.timeout = tmp_con_data->timeout;
+    remote_con_data.retry_cnt = tmp_con_data->retry_cnt;
+    remote_con_data.rnr_retry = tmp_con_data->rnr_retry;
+    remote_con_data.sq_depth = ntohl(tmp_con_data->sq_depth);
+    remote_con_data.recv_depth = ntohl(tmp_con_data->recv_depth);
+    remote_con_data.max_inline = ntohl(tmp_con_data->max_inline);
+    remote_con_data.nqps = ntohl(tmp_con_data->nqps) ? ntohl(tmp_con_data->nqps) : 1;
+    remote_con_data.fetch_log = ntohl(tmp_con_data->fetch_log);
+    remote_con_data.fetch_lsn = ntohll(tmp_con_data->fetch_lsn);
+    remote_con_data.shared_off = (int64_t)ntohll((uint64_t)tmp_con_data->shared_off);
+    remote_con_data.shared_rkey = ntohl(tmp_con_data->shared_rkey);
+    remote_con_data.shared_size = ntohl(tmp_con_data->shared_size);
+    remote_con_data.log_id = ntohl(tmp_con_data->log_id);
 
     res->remote_props = remote_con_data;
+    conn_params_negotiate(res, &remote_con_data);
 
 
     fprintf(stdout, "Remote QP information:\n");
@@ -625,43 +1617,292 @@ int connect_qp(struct resources *res)
         fprintf(stdout, "%02x", remote_con_data.gid[i]);
     }
     fprintf(stdout, "\n");
+    fprintf(stdout, "  Handshake version: %u, SQ depth: %u, receive depth: %u, max inline: %u, QPs: %u\n",
+            remote_con_data.version, remote_con_data.sq_depth, remote_con_data.recv_depth,
+            remote_con_data.max_inline, remote_con_data.nqps);
+    fprintf(stdout, "Negotiated: path MTU %d, RD atomic %u/%u, timeout %u, retry %u, RNR retry %u\n",
+            128 << res->params.mtu, res->params.rd_atomic, res->params.dest_rd_atomic,
+            res->params.timeout, res->params.retry_cnt, res->params.rnr_retry);
 
-    if (modify_qp_to_init(res->qp)) {
-        fprintf(stderr, "change QP state to INIT failed\n");
-        goto connect_qp_exit;
+    if (res->ops->conn_apply(res))
+        return 1;
+
+    fprintf(stdout, "QP state was changed to RTS\n");
+    return 0;
+}
+
+/* Collect the peer's handshake message from sock, which may be non-blocking.
+ * *got counts the bytes consumed so far and must start at 0. Only the part
+ * of the message this version knows is kept, the rest is read and dropped;
+ * fields a shorter message doesn't carry stay 0. Returns 1 once the whole
+ * message is in, 0 if the socket ran dry and -1 on a bad message or error. */
+int conn_data_recv(int sock, struct cm_con_data_t *remote, size_t *got)
+{
+    char skip[64];
+    size_t total = CM_HDR_SIZE;
+    ssize_t n;
+
+    if (*got == 0)
+        memset(remote, 0, sizeof(*remote));
+
+    for (;;) {
+        if (*got >= CM_HDR_SIZE) {
+            if (ntohs(remote->magic) != CM_MAGIC) {
+                fprintf(stderr, "Bad handshake magic 0x%04x\n", ntohs(remote->magic));
+                return -1;
+            }
+            total = ntohs(remote->length);
+            if (total < CM_MIN_SIZE) {
+                fprintf(stderr, "Handshake message too short: %zu bytes\n", total);
+                return -1;
+            }
+        }
+        if (*got >= total)
+            return 1;
+
+        if (*got < sizeof(*remote))
+            n = read(sock, (char *)remote + *got,
+                     (total < sizeof(*remote) ? total : sizeof(*remote)) - *got);
+        else
+            n = read(sock, skip, total - *got < sizeof(skip) ? total - *got : sizeof(skip));
+        if (n <= 0) {
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0;
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        *got += n;
     }
+}
 
-    if (res->port_attr.link_layer == IBV_LINK_LAYER_ETHERNET) {
-        fprintf(stdout, "Detected Ethernet link layer (RoCE). Using GID-based addressing.\n");
-        config.gid_idx = 0;  // You might need to adjust this value
+/* Open QP number `index` of the connection res leads: attached to the same
+ * device and buffer, on its port from config.qp_ports. The caller still
+ * has to exchange connection data for it. */
+int resources_add_stripe(struct resources *res, int index)
+{
+    struct resources *s;
+
+    if (res->nstripes >= RDMA_MAX_QPS - 1) {
+        fprintf(stderr, "at most %d QPs per connection\n", RDMA_MAX_QPS);
+        return 1;
     }
 
-    fprintf(stdout, "Modifying QP to RTR with remote QP: %u, remote LID: %u\n", remote_con_data.qp_num, remote_con_data.lid);
-    if (config.gid_idx >= 0) {
-        fprintf(stdout, "Using GID index: %d\n", config.gid_idx);
-        fprintf(stdout, "Remote GID: ");
-        for (int i = 0; i < 16; i++) {
-            fprintf(stdout, "%02x", remote_con_data.gid[i]);
+    s = (struct resources *)calloc(1, sizeof(*s));
+    if (!s)
+        return 1;
+    resources_init(s);
+    if (config.num_ports)
+        s->ib_port = config.qp_ports[index % config.num_ports];
+    if (resources_attach(s, res->parent ? res->parent : res, res->buf, res->buf_size, res->recv_eng)) {
+        free(s);
+        return 1;
+    }
+    s->leader = res;
+    res->stripe[res->nstripes++] = s;
+    return 0;
+}
+
+/* Give res and each of its stripes a spare QP, created now so that a
+ * failover only has to swap it in. Spares sit in RESET and take no part in
+ * anything until rdma_qp_swap. */
+int resources_add_spare(struct resources *res)
+{
+    struct ibv_qp_init_attr qp_init_attr;
+    struct ibv_qp *qp = res->qp;
+    uint32_t max_inline = res->max_inline;
+
+    for (int i = 0; i < res->nstripes; i++) {
+        if (resources_add_spare(res->stripe[i]))
+            return 1;
+    }
+    if (res->spare_qp)
+        return 0;
+
+    // qp_create fills in res->qp; keep the live QP where it is
+    qp_init_attr_fill(res, &qp_init_attr);
+    qp_init_attr.cap.max_inline_data = max_inline;
+    if (res->ops->qp_create(res, &qp_init_attr)) {
+        fprintf(stderr, "failed to create spare QP\n");
+        res->qp = qp;
+        res->max_inline = max_inline;
+        return 1;
+    }
+    res->spare_qp = res->qp;
+    res->qp = qp;
+    res->max_inline = max_inline;
+    return 0;
+}
+
+/* Put the spare QP in place of a failed one, which is reset to become the
+ * next spare. Work still queued on the failed QP is written off: CQEs it
+ * flushes are recognised by its QP number and dropped, and the caller has
+ * to repost whatever had not been acknowledged. The PD, MRs and CQs stay as
+ * they are. The new QP still needs conn_data_apply against the peer's new
+ * QP. */
+int rdma_qp_swap(struct resources *res)
+{
+    struct ibv_qp *failed = res->qp;
+
+    if (!res->spare_qp) {
+        fprintf(stderr, "no spare QP to fail over to\n");
+        return 1;
+    }
+    __atomic_store_n(&res->qp, res->spare_qp, __ATOMIC_RELEASE);
+    res->spare_qp = failed;
+    if (res->ops->qp_reset(res, failed)) {
+        fprintf(stderr, "failed to reset QP %u\n", failed->qp_num);
+        return 1;
+    }
+
+    res->sq_retired = res->sq_posted;
+    res->sq_signaled = res->sq_posted;
+    res->qp_done = res->posted_cookie;
+    res->failed_status = IBV_WC_SUCCESS;
+    res->failed_wr_id = 0;
+    res->failed_cookie = 0;
+    res->idle_ms = 0;
+    return 0;
+}
+
+/* Recover a connection whose QPs failed (the peer reset its side, or retries
+ * ran out) without touching the device, PD, MRs or CQs: swap in the spare
+ * of every QP, exchange the new QP numbers over the connection's socket,
+ * which must still be up, and bring the new QPs to RTS. replay then runs
+ * against the new QPs and has to leave nothing in flight; the peer holds
+ * back its consumer until it returns, so what replay rewrites can't be
+ * taken twice. A replay that fails starts another round, up to
+ * RDMA_RECONNECT_ATTEMPTS. Both sides must have advertised
+ * CM_FLAG_RECOVER. */
+int rdma_reconnect(struct resources *res, int (*replay)(struct resources *res, void *arg), void *arg)
+{
+    struct cm_con_data_t local_con_data;
+    struct cm_con_data_t tmp_con_data;
+    size_t got;
+    char done = CM_RECONNECT_DONE;
+
+    if (!(res->remote_props.flags & CM_FLAG_RECOVER) || res->sock < 0) {
+        fprintf(stderr, "peer can't take a reconnect on this connection\n");
+        return 1;
+    }
+
+    for (int attempt = 1;; attempt++) {
+        // Leader first, then the stripes, the order the first handshake used
+        for (int i = 0; i <= res->nstripes; i++) {
+            struct resources *q = i ? res->stripe[i - 1] : res;
+
+            if (rdma_qp_swap(q) || conn_data_local(q, &local_con_data))
+                return 1;
+            local_con_data.flags |= htons(CM_FLAG_RECONNECT);
+            if (write(res->sock, &local_con_data, sizeof(local_con_data)) != sizeof(local_con_data)) {
+                fprintf(stderr, "failed to send reconnect data for QP %d\n", i);
+                return 1;
+            }
         }
-        fprintf(stdout, "\n");
+        for (int i = 0; i <= res->nstripes; i++) {
+            struct resources *q = i ? res->stripe[i - 1] : res;
+
+            got = 0;
+            if (conn_data_recv(res->sock, &tmp_con_data, &got) != 1 ||
+                !(ntohs(tmp_con_data.flags) & CM_FLAG_RECONNECT) ||
+                conn_data_apply(q, &tmp_con_data)) {
+                fprintf(stderr, "peer did not take the reconnect of QP %d\n", i);
+                return 1;
+            }
+        }
+
+        if (!replay || replay(res, arg) == 0)
+            break;
+        if (attempt == RDMA_RECONNECT_ATTEMPTS) {
+            fprintf(stderr, "replay failed on %d sets of new QPs, giving up\n", attempt);
+            return 1;
+        }
+        fprintf(stderr, "replay onto the new QPs failed, failing over again\n");
     }
 
-    if (modify_qp_to_rtr(res->qp, remote_con_data.qp_num, remote_con_data.lid, remote_con_data.gid)) {
-        fprintf(stderr, "failed to modify QP state to RTR\n");
-        goto connect_qp_exit;
+    // Releases the peer's consumer
+    if (write(res->sock, &done, 1) != 1) {
+        fprintf(stderr, "failed to confirm the reconnect\n");
+        return 1;
     }
+    return 0;
+}
 
-    if (modify_qp_to_rts(res->qp)) {
-        fprintf(stderr, "failed to modify QP state to RTS\n");
-        goto connect_qp_exit;
+/* Parse a comma separated port list into config.qp_ports. */
+int rdma_parse_ports(const char *list)
+{
+    char *end;
+
+    config.num_ports = 0;
+    while (*list && config.num_ports < RDMA_MAX_QPS) {
+        long port = strtol(list, &end, 10);
+
+        if (end == list || port < 1 || port > 255) {
+            fprintf(stderr, "Bad port list: %s\n", list);
+            return 1;
+        }
+        config.qp_ports[config.num_ports++] = (int)port;
+        list = *end == ',' ? end + 1 : end;
     }
+    return 0;
+}
 
-    if (remote_con_data.lid == 65535) {
-        fprintf(stderr, "Invalid remote LID. This might indicate a RoCE v2 setup.\n");
-        fprintf(stderr, "Try setting GID index explicitly in the configuration.\n");
+int connect_qp(struct resources *res)
+{
+    pr_trace("Entering function: %s\n", __func__);
+    struct cm_con_data_t local_con_data;
+    struct cm_con_data_t tmp_con_data;
+    size_t got = 0;
+    int nqps;
+    int rc = 0;
+    char temp_char;
+
+    if (config.num_ports && !res->ib_port)
+        res->ib_port = config.qp_ports[0];
+    rc = conn_data_local(res, &local_con_data);
+    if (rc)
+        return rc;
+
+    if (write(res->sock, &local_con_data, sizeof(local_con_data)) != sizeof(local_con_data) ||
+        conn_data_recv(res->sock, &tmp_con_data, &got) != 1) {
+        fprintf(stderr, "failed to exchange connection data between sides\n");
+        rc = 1;
+        goto connect_qp_exit;
     }
 
-    fprintf(stdout, "QP state was changed to RTS\n");
+    rc = conn_data_apply(res, &tmp_con_data);
+    if (rc)
+        goto connect_qp_exit;
+
+    // Both sides open the smaller QP count asked for; every extra QP is one more exchange
+    nqps = config.num_qps > 1 ? config.num_qps : 1;
+    if (res->remote_props.nqps < (uint32_t)nqps)
+        nqps = res->remote_props.nqps;
+    for (int i = 1; i < nqps; i++) {
+        if (resources_add_stripe(res, i) != 0 ||
+            conn_data_local(res->stripe[i - 1], &local_con_data) != 0 ||
+            write(res->sock, &local_con_data, sizeof(local_con_data)) != sizeof(local_con_data)) {
+            fprintf(stderr, "failed to set up QP %d of the connection\n", i);
+            rc = 1;
+            goto connect_qp_exit;
+        }
+    }
+    for (int i = 0; i < res->nstripes; i++) {
+        got = 0;
+        if (conn_data_recv(res->sock, &tmp_con_data, &got) != 1 ||
+            conn_data_apply(res->stripe[i], &tmp_con_data) != 0) {
+            fprintf(stderr, "failed to connect QP %d of the connection\n", i + 1);
+            rc = 1;
+            goto connect_qp_exit;
+        }
+    }
+    if (res->nstripes)
+        fprintf(stdout, "Striping writes over %d QPs\n", res->nstripes + 1);
+    // Our handshake already said we can fail over; the spares are ours alone
+    if (config.spare_qps && resources_add_spare(res) != 0) {
+        rc = 1;
+        goto connect_qp_exit;
+    }
 
     // Add these debug prints and synchronization
     fprintf(stdout, "QP ready, waiting for peer...\n");
@@ -3,47 +3,232 @@
 
 #include <infiniband/verbs.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <pthread.h>
+#include "completion.h"
+#include "mem_pool.h"
+#include "mr_cache.h"
+#include "transport.h"
 
 #define RDMA_BUFFER_SIZE (1024 * 1024)  // 1MB
 #define MSG_SIZE 4096
 
+#define DEFAULT_QUEUE_DEPTH 256
+#define DEFAULT_SIGNAL_INTERVAL 32
+#define DEFAULT_INLINE_SIZE 256
+#define RDMA_MAX_BATCH 64       // WRs chained per ibv_post_send
+#define RDMA_MAX_SGE 16         // Gather entries per write WR, capped by the device's max_sge
+#define DEFAULT_SRQ_DEPTH 1024
+
+#define RDMA_SIGNAL_LAST 0x1    // Force a CQE for the last WR of a batch
+#define RDMA_WRITE_IMM 0x2      // Last WR of a batch carries the low 32 bits of its cookie as immediate data
+
+#define RDMA_MAX_CONNS 1024     // Connections attached to one device
+#define RDMA_MAX_QPS 8          // QPs one connection stripes its writes over
+#define DEFAULT_MR_BUDGET (256UL << 20) // Caller memory the MR cache keeps registered
+
+#define CM_MAGIC 0x524d   // "RM"
+#define CM_VERSION 5
+#define CM_HDR_SIZE 8
+#define CM_MIN_SIZE offsetof(struct cm_con_data_t, mtu)
+
+// Handshake flags
+#define CM_FLAG_RECOVER   0x1 // Sender can swap a failed QP for a spare and re-handshake on the socket
+#define CM_FLAG_RECONNECT 0x2 // Replaces the QP of a live connection, see rdma_reconnect()
+#define CM_FLAG_PACK      0x4 // Sender takes (logstore) or sends (compute node) packed log batches
+#define CM_FLAG_SHARED    0x8 // Sender appends to the peer's shared log, see log_shared.h
+#define CM_RECONNECT_DONE 'G' // Ends a reconnect; unlike a handshake message's first byte
+#define RDMA_RECONNECT_ATTEMPTS 3
+
+/* Handshake message, network byte order on the wire. The header lets a
+ * peer skip trailing fields it doesn't know and default the ones it didn't
+ * get: later versions only append, and fields a peer left out read as 0. */
 struct cm_con_data_t {
+    uint16_t magic;
+    uint16_t version;
+    uint16_t length;  // Bytes sent, header included
+    uint16_t flags;
     uint64_t addr;   // Buffer address
     uint32_t rkey;   // Remote key
     uint32_t qp_num; // QP number
     uint16_t lid;    // LID of the IB port
     uint8_t gid[16]; // GID
     uint32_t size;   // Buffer size
+    // Connection parameters, each side's own limits and preferences
+    uint8_t mtu;          // enum ibv_mtu, active MTU of the port
+    uint8_t rd_atom;      // RDMA READs/atomics served in flight (max_qp_rd_atom)
+    uint8_t init_rd_atom; // RDMA READs/atomics issued in flight (max_qp_init_rd_atom)
+    uint8_t timeout;      // Local ACK timeout exponent
+    uint8_t retry_cnt;
+    uint8_t rnr_retry;
+    uint16_t pad;
+    uint32_t sq_depth;
+    uint32_t recv_depth;  // Receives behind the QP (SRQ or RQ)
+    uint32_t max_inline;
+    // Version 2
+    uint32_t nqps;        // QPs wanted on the connection, or accepted at most
+    // Version 3
+    uint32_t fetch_log;   // Stored log to read back, see log_fetch.h
+    uint64_t fetch_lsn;   // First LSN wanted; 0 for an ordinary append connection
+    // Version 4
+    int64_t shared_off;   // Shared log region relative to addr, see log_shared.h
+    uint32_t shared_rkey;
+    uint32_t shared_size; // 0 if none is offered
+    // Version 5
+    uint32_t log_id;      // Log the sender's appends persist to, the same across restarts; 0 for none
 } __attribute__((packed));
 
+// What both sides settled on, applied at RTR/RTS
+struct conn_params {
+    enum ibv_mtu mtu;
+    uint8_t rd_atomic;      // Our outstanding READs/atomics
+    uint8_t dest_rd_atomic; // The peer's, served by us
+    uint8_t timeout;
+    uint8_t retry_cnt;
+    uint8_t rnr_retry;
+};
+
 struct config_t {
     const char *dev_name;
     u_int32_t tcp_port;
     int ib_port;
     int gid_idx;
+    size_t buf_size;    // Registered buffer size, MSG_SIZE if 0
+    int queue_depth;    // Send queue depth, CQ is sized to match
+    int signal_interval; // Request a CQE every Nth send WR
+    enum cq_mode cq_mode;
+    int inline_size;    // max_inline_data requested on the QP, 0 disables inline sends
+    size_t pool_size;   // Registered pool, grown to hold buf_size
+    size_t chunk_size;  // Pool chunk handed out by mem_pool_alloc
+    size_t hugepage_size; // 0, HUGEPAGE_2MB or HUGEPAGE_1GB
+    int numa_node;      // -1 follows the HCA
+    int cq_depth;       // CQ entries, 0 sizes it for num_qps QPs
+    int srq_depth;      // Receives kept posted on a shared receive queue, 0 for none
+    const struct transport_ops *transport; // NULL picks verbs
+    int mtu;            // Path MTU cap in bytes, 0 for the best both ports support
+    int ack_timeout;    // Local ACK timeout exponent (4.096us << n), the larger side wins
+    int retry_cnt;
+    int rnr_retry;      // 7 retries forever
+    int num_qps;        // QPs per connection, the peer may settle on fewer; 0 is 1
+    int qp_ports[RDMA_MAX_QPS]; // Port of each QP, round robin; 0 falls back to ib_port
+    int num_ports;
+    int spare_qps;      // Offer CM_FLAG_RECOVER and keep a reset QP beside each one, for rdma_reconnect
+    int pack;           // Offer CM_FLAG_PACK, see log_pack.h
+    int shared_log;     // Send CM_FLAG_SHARED: append to the peer's shared log instead of our own ring
+    size_t mr_budget;   // Caller memory the MR cache keeps registered, 0 for no limit
+    int mr_odp;         // Register caller memory on demand where the device can
+    uint32_t log_id;    // Sent as the handshake's log_id
+};
+
+/* A range of the registered buffer, written to the same offset remotely.
+ * With a gather list the bytes come from its nsge entries instead, which
+ * add up to length and must stay put until the write completes. */
+struct rdma_seg {
+    size_t offset;
+    size_t length;
+    uint64_t cookie; // Caller tag reported back on completion, monotonic
+    const struct ibv_sge *sgl; // NULL to send buf + offset
+    int nsge;
 };
 struct resources {
+    struct resources *parent; // Device this connection is attached to, NULL if it owns one
+    const struct transport_ops *ops;
+    void *priv;               // Backend state of the device
     struct ibv_device_attr device_attr;
     struct ibv_port_attr port_attr;
     struct cm_con_data_t remote_props;
+    struct conn_params params;
     struct ibv_context *ib_ctx;
     struct ibv_pd *pd;
     struct ibv_cq *cq;
+    struct cq_engine cq_eng;
     struct ibv_qp *qp;
-    struct ibv_mr *mr;
+    struct ibv_qp *spare_qp; // Reset QP ready to take over from qp, NULL if none
+    int ib_port;          // Port this QP goes out of, 0 for config.ib_port
+    struct ibv_srq *srq;  // Shared by every attached QP, refilled as immediates arrive
+    uint32_t srq_depth;
+    struct cq_engine *recv_eng; // Receive CQ for this QP, NULL for the shared one
+    struct mem_pool pool; // Owns every MR; buf is its reserved head
+    struct ibv_mr *mr;    // MR covering buf
     char *buf;
     int sock;
     uint32_t buf_size;  // Add this line
+    uint32_t sq_depth;
+    uint32_t signal_interval;
+    uint32_t max_inline;  // Payloads up to this size are posted with IBV_SEND_INLINE
+    uint32_t max_sge;     // Gather entries a write WR may carry, as granted at QP creation
+    uint64_t sq_posted;   // Send WRs posted, each carries its sequence as wr_id
+    uint64_t sq_retired;  // Send WRs known to be complete
+    uint64_t sq_signaled; // Sequence of the last signaled send WR
+    uint64_t *wr_cookie;  // Caller cookie per in-flight WR, indexed by wr_id % sq_depth
+    uint64_t *wr_posted;  // Post time of signaled WRs, same indexing; shares wr_cookie's allocation
+    uint64_t done_cookie; // Highest cookie known to have completed
+    uint64_t failed_wr_id;
+    uint64_t failed_cookie;
+    enum ibv_wc_status failed_status; // First error seen, IBV_WC_SUCCESS if none
+    int idle_ms;          // Empty waits on a shared CQ since the last CQE
+    uint64_t imm_pos;     // Highest cookie announced by the peer with a write-with-immediate
+    uint32_t fetch_log;   // Set before connect_qp to fetch a stored log instead of appending
+    uint64_t fetch_lsn;
+    int64_t shared_off;   // Shared log region to offer, relative to buf; set before conn_data_local
+    uint32_t shared_rkey;
+    uint32_t shared_size;
+
+    /* Striping: a connection leader posts each write batch on the next of
+     * its QPs in turn, itself included. Per QP, posted_cookie/qp_done track
+     * the batches; the leader's done_cookie is then the position below
+     * which every QP has landed, and its failed_* the first error on any. */
+    struct resources *stripe[RDMA_MAX_QPS - 1];
+    int nstripes;
+    unsigned next_stripe;
+    struct resources *leader; // Set on a stripe
+    uint64_t posted_cookie;   // Highest cookie posted on this QP
+    uint64_t qp_done;         // Highest cookie completed on this QP
+
+    // Connections attached to this device, looked up by qp_num on the shared CQ
+    pthread_mutex_t conn_lock;
+    struct resources *conns[RDMA_MAX_CONNS];
+    int nconns;
+
+    // Caller memory writes may gather from, besides the pool; NULL until first used
+    struct mr_cache *mr_cache;
+    int odp;              // Device can register memory on demand for RC sends
 };
 
 // Function prototypes
 int rdma_write(struct resources *res, size_t offset, size_t length);
+int rdma_write_batch(struct resources *res, const struct rdma_seg *segs, int count, int flags);
+int rdma_read(struct resources *res, size_t offset, size_t length);
+int rdma_read_post(struct resources *res, size_t offset, uint64_t remote_addr, uint32_t rkey, size_t length,
+                   uint64_t cookie);
+int rdma_fetch_add(struct resources *res, size_t offset, uint64_t add, uint64_t *old);
+struct mr_cache *rdma_mr_cache(struct resources *res);
+int rdma_mr_get(struct resources *res, const void *addr, size_t length, uint32_t *lkey,
+                struct mr_cache_entry **pin);
+void rdma_mr_put(struct resources *res, struct mr_cache_entry *pin);
+int rdma_mem_invalidate(struct resources *res, const void *addr, size_t length);
+int rdma_drain(struct resources *res);
+int rdma_reap(struct resources *res);
+int rdma_reap_recv(struct resources *dev, struct cq_engine *eng, int timeout_ms);
+int poll_completion(struct resources *res);
 void resources_init(struct resources *res);
 int resources_create(struct resources *res);
+int resources_create_device(struct resources *res);
+int resources_create_cq(struct resources *dev, struct cq_engine *eng, int cqe);
+int resources_attach(struct resources *conn, struct resources *dev, char *buf, uint32_t size,
+                     struct cq_engine *recv_eng);
 int resources_destroy(struct resources *res);
 int connect_qp(struct resources *res);
+int resources_add_stripe(struct resources *res, int index);
+int rdma_parse_ports(const char *list);
+int resources_add_spare(struct resources *res);
+int rdma_qp_swap(struct resources *res);
+int rdma_reconnect(struct resources *res, int (*replay)(struct resources *res, void *arg), void *arg);
+int conn_data_local(struct resources *res, struct cm_con_data_t *local_con_data);
+int conn_data_apply(struct resources *res, const struct cm_con_data_t *remote_con_data);
+int conn_data_recv(int sock, struct cm_con_data_t *remote, size_t *got);
 int post_send(struct resources *res, int opcode);
 void usage(const char *argv0);
 void print_config(void);
@@ -0,0 +1,381 @@
+#define _GNU_SOURCE
+#include "seg_index.h"
+#include "crc32c.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static int lsn_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void seg_path(const struct seg_index *ix, uint64_t first_lsn, char *path, size_t size)
+{
+    snprintf(path, size, "%s/" SEG_NAME_FMT, ix->dir, (unsigned long)first_lsn);
+}
+
+static int index_map(struct seg_index *ix, uint64_t first_lsn)
+{
+    struct seg_map *m;
+    struct stat sb;
+    char path[512];
+    size_t size;
+    void *base;
+    int fd;
+
+    seg_path(ix, first_lsn, path, sizeof(path));
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &sb) != 0) {
+        fprintf(stderr, "failed to open segment %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    // Room for the file to grow into while it is being written, if it isn't preallocated
+    size = (size_t)sb.st_size > ix->seg_size ? (size_t)sb.st_size : ix->seg_size;
+    if (!size)
+        size = 4096;
+    if (size > UINT32_MAX) {
+        fprintf(stderr, "segment %s is too large to index\n", path);
+        close(fd);
+        return 1;
+    }
+    base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "failed to map segment %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    if (ix->nsegs == ix->segs_alloc) {
+        uint32_t alloc = ix->segs_alloc ? 2 * ix->segs_alloc : 64;
+        struct seg_map *grown = (struct seg_map *)realloc(ix->segs, alloc * sizeof(*grown));
+
+        if (!grown) {
+            munmap(base, size);
+            return 1;
+        }
+        ix->segs = grown;
+        ix->segs_alloc = alloc;
+    }
+    m = &ix->segs[ix->nsegs++];
+    m->first_lsn = first_lsn;
+    m->base = (const char *)base;
+    m->mapped = size;
+    m->end = 0;
+    return 0;
+}
+
+/* Map the segments created since the last look, in LSN order. */
+static int index_map_new(struct seg_index *ix)
+{
+    uint64_t after = ix->nsegs ? ix->segs[ix->nsegs - 1].first_lsn : 0;
+    uint64_t *found = NULL;
+    size_t nfound = 0, alloc = 0;
+    struct dirent *de;
+    int rc = 0;
+    DIR *d;
+
+    d = opendir(ix->dir);
+    if (!d) {
+        fprintf(stderr, "failed to open %s: %s\n", ix->dir, strerror(errno));
+        return 1;
+    }
+    while ((de = readdir(d))) {
+        unsigned long v;
+
+        if (sscanf(de->d_name, "%16lx.seg", &v) != 1 || strlen(de->d_name) != 20 || (ix->nsegs && v <= after))
+            continue;
+        if (nfound == alloc) {
+            uint64_t *grown = (uint64_t *)realloc(found, (alloc ? 2 * alloc : 64) * sizeof(*found));
+
+            if (!grown) {
+                rc = 1;
+                break;
+            }
+            found = grown;
+            alloc = alloc ? 2 * alloc : 64;
+        }
+        found[nfound++] = v;
+    }
+    closedir(d);
+    qsort(found, nfound, sizeof(*found), lsn_cmp);
+
+    for (size_t i = 0; !rc && i < nfound; i++)
+        rc = index_map(ix, found[i]);
+    free(found);
+    return rc;
+}
+
+/* Every stride-th record gets an entry; a full index drops every other
+ * one and doubles the stride. */
+static int index_add(struct seg_index *ix, uint64_t lsn, uint32_t seg, size_t off)
+{
+    if ((lsn - ix->first_lsn) % ix->stride)
+        return 0;
+
+    if (ix->nentries == ix->max_entries) {
+        size_t kept = 0;
+
+        for (size_t i = 0; i < ix->nentries; i += 2, kept++) {
+            ix->lsns[kept] = ix->lsns[i];
+            ix->locs[kept] = ix->locs[i];
+        }
+        ix->nentries = kept;
+        ix->stride *= 2;
+        if ((lsn - ix->first_lsn) % ix->stride)
+            return 0;
+    }
+    if (ix->nentries == ix->entries_alloc) {
+        size_t alloc = ix->entries_alloc ? 2 * ix->entries_alloc : 1024;
+        uint64_t *lsns;
+        struct seg_loc *locs;
+
+        if (alloc > ix->max_entries)
+            alloc = ix->max_entries;
+        if (!(lsns = (uint64_t *)realloc(ix->lsns, alloc * sizeof(*lsns))))
+            return 1;
+        ix->lsns = lsns;
+        if (!(locs = (struct seg_loc *)realloc(ix->locs, alloc * sizeof(*locs))))
+            return 1;
+        ix->locs = locs;
+        ix->entries_alloc = alloc;
+    }
+    ix->lsns[ix->nentries] = lsn;
+    ix->locs[ix->nentries].seg = seg;
+    ix->locs[ix->nentries].off = (uint32_t)off;
+    ix->nentries++;
+    return 0;
+}
+
+/* Walk on from where the last walk stopped: through the rest of the
+ * segment it stopped in, then into the next one while that continues the
+ * LSN sequence. Never reads past a file's current size or durable_lsn,
+ * and checks each record's CRC on the way. */
+static int index_walk(struct seg_index *ix)
+{
+    while (ix->walk < ix->nsegs) {
+        struct seg_map *m = &ix->segs[ix->walk];
+        struct stat sb;
+        char path[512];
+        size_t limit;
+
+        seg_path(ix, m->first_lsn, path, sizeof(path));
+        if (stat(path, &sb) != 0) {
+            fprintf(stderr, "failed to stat segment %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+        limit = (size_t)sb.st_size < m->mapped ? (size_t)sb.st_size : m->mapped;
+
+        while (m->end + sizeof(struct seg_rec_hdr) <= limit) {
+            const struct seg_rec_hdr *hdr = (const struct seg_rec_hdr *)(m->base + m->end);
+            uint64_t expect = ix->last_lsn ? ix->last_lsn + 1 : m->first_lsn;
+            size_t rec = seg_store_rec_size(hdr->len);
+
+            if (hdr->lsn != expect || hdr->lsn > ix->durable_lsn || (!m->end && hdr->lsn != m->first_lsn) ||
+                rec > limit - m->end || crc32c(0, hdr + 1, hdr->len) != hdr->crc)
+                break;
+            if (!ix->first_lsn)
+                ix->first_lsn = hdr->lsn;
+            if (index_add(ix, hdr->lsn, ix->walk, m->end))
+                return 1;
+            ix->last_lsn = hdr->lsn;
+            m->end += rec;
+        }
+
+        // A newer segment means this one is finished, if the next picks up where it ends
+        if (ix->walk + 1 < ix->nsegs && (!ix->last_lsn || ix->segs[ix->walk + 1].first_lsn == ix->last_lsn + 1)) {
+            ix->walk++;
+            continue;
+        }
+        break;
+    }
+    return 0;
+}
+
+/* Index the stored log in dir, up to durable_lsn. Segments are mapped at
+ * least seg_size bytes; max_entries bounds the index, 0 for
+ * SEG_INDEX_MAX_ENTRIES. */
+int seg_index_open(struct seg_index *ix, const char *dir, size_t seg_size, size_t max_entries, uint64_t durable_lsn)
+{
+    memset(ix, 0, sizeof(*ix));
+    snprintf(ix->dir, sizeof(ix->dir), "%s", dir);
+    ix->seg_size = seg_size;
+    ix->durable_lsn = durable_lsn;
+    ix->max_entries = max_entries ? max_entries : SEG_INDEX_MAX_ENTRIES;
+    if (ix->max_entries < 2)
+        ix->max_entries = 2;
+    ix->stride = SEG_INDEX_STRIDE;
+    if (seg_size > UINT32_MAX) {
+        fprintf(stderr, "segments of %zu bytes are too large to index\n", seg_size);
+        return 1;
+    }
+    if (seg_index_refresh(ix) != 0) {
+        seg_index_close(ix);
+        return 1;
+    }
+    return 0;
+}
+
+/* Pick up records appended since the last walk. */
+int seg_index_refresh(struct seg_index *ix)
+{
+    if (index_map_new(ix) != 0)
+        return 1;
+    return index_walk(ix);
+}
+
+/* Past the record at the cursor. */
+static void cursor_step(struct seg_cursor *cur)
+{
+    const struct seg_index *ix = cur->ix;
+    const struct seg_rec_hdr *hdr = (const struct seg_rec_hdr *)(ix->segs[cur->seg].base + cur->off);
+
+    cur->off += seg_store_rec_size(hdr->len);
+    cur->lsn++;
+}
+
+/* The cursor sits at the end of a segment whose successor holds its next record. */
+static void cursor_settle(struct seg_cursor *cur)
+{
+    const struct seg_index *ix = cur->ix;
+
+    while (cur->off >= ix->segs[cur->seg].end && cur->seg + 1 < ix->nsegs && cur->seg < ix->walk) {
+        cur->seg++;
+        cur->off = 0;
+    }
+}
+
+/* Point cur at the record with the given LSN, or the first one stored if
+ * that is later. Past the last record the cursor waits at the end and
+ * sees what a refresh adds. */
+void seg_index_seek(struct seg_index *ix, uint64_t lsn, struct seg_cursor *cur)
+{
+    size_t lo = 0, hi;
+
+    cur->ix = ix;
+    ix->lookups++;
+    if (!ix->nentries || lsn > ix->last_lsn) {
+        cur->seg = ix->walk < ix->nsegs ? ix->walk : 0;
+        cur->off = ix->nsegs ? ix->segs[cur->seg].end : 0;
+        cur->lsn = ix->last_lsn ? ix->last_lsn + 1 : 0;
+        return;
+    }
+    if (lsn < ix->first_lsn)
+        lsn = ix->first_lsn;
+
+    // The last entry at or before lsn
+    hi = ix->nentries - 1;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo + 1) / 2;
+
+        if (ix->lsns[mid] <= lsn)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    cur->seg = ix->locs[lo].seg;
+    cur->off = ix->locs[lo].off;
+    cur->lsn = ix->lsns[lo];
+    for (; cur->lsn < lsn; ix->walked++) {
+        cursor_step(cur);
+        cursor_settle(cur);
+    }
+}
+
+/* Returns 1 with the next record, pointing into its segment's mapping, or
+ * 0 at the end of what has been walked. */
+int seg_cursor_next(struct seg_cursor *cur, uint64_t *lsn, const void **data, uint32_t *len)
+{
+    const struct seg_rec_hdr *hdr;
+
+    if (!cur->lsn || cur->lsn > cur->ix->last_lsn)
+        return 0;
+    cursor_settle(cur);
+    hdr = (const struct seg_rec_hdr *)(cur->ix->segs[cur->seg].base + cur->off);
+    *lsn = hdr->lsn;
+    *data = hdr + 1;
+    *len = hdr->len;
+    cursor_step(cur);
+    return 1;
+}
+
+/* Point lookup; 0 with the record's payload in place, 1 if it isn't stored. */
+int seg_index_read(struct seg_index *ix, uint64_t lsn, const void **data, uint32_t *len)
+{
+    struct seg_cursor cur;
+    uint64_t found;
+
+    if (lsn > ix->last_lsn && seg_index_refresh(ix) != 0)
+        return 1;
+    if (lsn < ix->first_lsn)
+        return 1;
+    seg_index_seek(ix, lsn, &cur);
+    return !(seg_cursor_next(&cur, &found, data, len) && found == lsn);
+}
+
+/* Copy the stored records from from_lsn on into buf, in segment file
+ * format, until it is full or the log ends: one memcpy per segment out of
+ * its mapping, after a refresh picks up what was appended since. */
+int seg_index_load(struct seg_index *ix, uint64_t from_lsn, char *buf, size_t cap, struct seg_range *out)
+{
+    struct seg_cursor cur;
+
+    memset(out, 0, sizeof(*out));
+    if (seg_index_refresh(ix) != 0)
+        return 1;
+    seg_index_seek(ix, from_lsn, &cur);
+
+    while (cur.lsn && cur.lsn <= ix->last_lsn && !out->more) {
+        const struct seg_map *m;
+        size_t start;
+
+        cursor_settle(&cur);
+        m = &ix->segs[cur.seg];
+        start = cur.off;
+        while (cur.lsn <= ix->last_lsn && cur.off < m->end) {
+            const struct seg_rec_hdr *hdr = (const struct seg_rec_hdr *)(m->base + cur.off);
+
+            if (out->bytes + cur.off - start + seg_store_rec_size(hdr->len) > cap) {
+                out->more = 1;
+                break;
+            }
+            if (!out->first_lsn)
+                out->first_lsn = cur.lsn;
+            out->last_lsn = cur.lsn;
+            cursor_step(&cur);
+        }
+        memcpy(buf + out->bytes, m->base + start, cur.off - start);
+        out->bytes += cur.off - start;
+        if (cur.off == start)
+            break;
+    }
+    return 0;
+}
+
+void seg_index_print(FILE *out, const struct seg_index *ix)
+{
+    fprintf(out, "Index of %s: LSN %lu to %lu in %u segments, %zu entries every %lu records, "
+            "%lu lookups walking %.1f records each\n",
+            ix->dir, (unsigned long)ix->first_lsn, (unsigned long)ix->last_lsn, ix->nsegs, ix->nentries,
+            (unsigned long)ix->stride, (unsigned long)ix->lookups,
+            ix->lookups ? (double)ix->walked / ix->lookups : 0.0);
+}
+
+void seg_index_close(struct seg_index *ix)
+{
+    for (uint32_t i = 0; i < ix->nsegs; i++)
+        munmap((void *)ix->segs[i].base, ix->segs[i].mapped);
+    free(ix->segs);
+    free(ix->lsns);
+    free(ix->locs);
+    memset(ix, 0, sizeof(*ix));
+}
@@ -0,0 +1,102 @@
+#ifndef SEG_INDEX_H
+#define SEG_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "seg_store.h"
+
+/*
+ * Sparse LSN index over a stored log, with reads served straight from the
+ * mmap'd segment files (logstore side).
+ *
+ * Every stride-th record gets an entry mapping its LSN to the segment and
+ * offset it starts at. LSNs and locations sit in two parallel arrays, so a
+ * binary search only touches the dense LSN keys, eight to a cache line. A
+ * lookup takes the last entry at or before the LSN it wants and walks the
+ * record headers from there, fewer than stride of them, across segment
+ * ends where needed. Entries are only ever appended. Once max_entries are
+ * in use every other one is dropped and the stride doubles, so an index
+ * never takes more than max_entries * 16 bytes however long the log gets:
+ * at the default cap a billion records cost 16 MB and walks of up to a
+ * thousand headers, all in mapped memory.
+ *
+ * Segments are mapped read-only and shared as they are found, so a point
+ * read or a range scan hands out pointers into the page cache: nothing is
+ * copied and no syscall made once the pages are resident. The pointers
+ * stay valid until seg_index_close(). Mappings cost address space rather
+ * than memory; the kernel takes clean pages back as it needs them.
+ *
+ * seg_index_open() walks the log once; seg_index_refresh() walks on from
+ * where the last walk stopped, picking up what was appended since and new
+ * segments, so each record is walked once. Like recovery, a walk stops at
+ * the first record that doesn't continue the LSN sequence, doesn't fit in
+ * its file or fails its CRC, so a torn tail is never indexed. A log that
+ * is still being written can be indexed too, as long as the owner keeps
+ * durable_lsn at the store's durable LSN: walks never go past it, so what
+ * the committer is still writing stays out. SEG_INDEX_ALL is for logs that
+ * are no longer written. An index has a single owner, there is no locking.
+ */
+
+#define SEG_INDEX_STRIDE 64              // Records per entry to start with
+#define SEG_INDEX_MAX_ENTRIES (1UL << 20) // 16 MB of entries per index
+#define SEG_INDEX_ALL UINT64_MAX           // durable_lsn of a log no longer written
+
+// What seg_index_load put in the caller's buffer
+struct seg_range {
+    uint64_t first_lsn; // 0 if nothing was loaded
+    uint64_t last_lsn;
+    size_t bytes;
+    int more;           // The log goes on past what fit
+};
+
+struct seg_loc {
+    uint32_t seg; // In segs[]
+    uint32_t off; // Where the record's header starts
+};
+
+struct seg_map {
+    uint64_t first_lsn; // The file's name
+    const char *base;   // Mapped read-only, at least file size bytes
+    size_t mapped;
+    size_t end;         // Records walked up to here
+};
+
+struct seg_index {
+    char dir[256];
+    size_t seg_size;        // Segments are mapped this large at least, so they can grow into it
+    struct seg_map *segs;   // By first LSN
+    uint32_t nsegs;
+    uint32_t segs_alloc;
+    uint32_t walk;          // Segment the next walk goes on in
+    uint64_t *lsns;         // Entry keys...
+    struct seg_loc *locs;   // ...and where their records are
+    size_t nentries;
+    size_t entries_alloc;   // Grown up to max_entries as needed
+    size_t max_entries;
+    uint64_t stride;
+    uint64_t first_lsn;     // Records walked so far, 0 if none
+    uint64_t last_lsn;
+    uint64_t durable_lsn;   // Walks stop here, the owner raises it as the log grows
+    uint64_t lookups;
+    uint64_t walked;        // Headers stepped over by lookups
+};
+
+// Walks records in LSN order, from seg_index_seek on
+struct seg_cursor {
+    struct seg_index *ix;
+    uint32_t seg;
+    size_t off;
+    uint64_t lsn; // Of the record at off
+};
+
+int seg_index_open(struct seg_index *ix, const char *dir, size_t seg_size, size_t max_entries, uint64_t durable_lsn);
+int seg_index_refresh(struct seg_index *ix);
+void seg_index_seek(struct seg_index *ix, uint64_t lsn, struct seg_cursor *cur);
+int seg_cursor_next(struct seg_cursor *cur, uint64_t *lsn, const void **data, uint32_t *len);
+int seg_index_read(struct seg_index *ix, uint64_t lsn, const void **data, uint32_t *len);
+int seg_index_load(struct seg_index *ix, uint64_t from_lsn, char *buf, size_t cap, struct seg_range *out);
+void seg_index_print(FILE *out, const struct seg_index *ix);
+void seg_index_close(struct seg_index *ix);
+
+#endif // SEG_INDEX_H
@@ -0,0 +1,425 @@
+#define _GNU_SOURCE
+#include "seg_store.h"
+#include "crc32c.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+static void *seg_commit_thread(void *arg);
+
+size_t seg_store_rec_size(uint32_t len)
+{
+    return (sizeof(struct seg_rec_hdr) + len + 7) & ~(size_t)7;
+}
+
+static int seg_open_file(struct seg_store *st, uint64_t first_lsn, int create)
+{
+    char name[64];
+    int flags = create ? (O_WRONLY | O_CREAT | O_EXCL) : O_RDWR;
+
+    snprintf(name, sizeof(name), SEG_NAME_FMT, (unsigned long)first_lsn);
+    st->fd = openat(st->dirfd, name, flags | O_CLOEXEC, 0644);
+    if (st->fd < 0) {
+        fprintf(stderr, "failed to open segment %s/%s: %s\n", st->dir, name, strerror(errno));
+        return 1;
+    }
+    st->seg_first_lsn = first_lsn;
+
+    if (create) {
+        st->seg_off = 0;
+        // Preallocate so fdatasync doesn't have to flush size changes
+        if (fallocate(st->fd, 0, 0, st->seg_size) && errno != EOPNOTSUPP)
+            fprintf(stderr, "fallocate of segment %s failed: %s\n", name, strerror(errno));
+        if (fsync(st->dirfd)) {
+            fprintf(stderr, "fsync of %s failed: %s\n", st->dir, strerror(errno));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Reopen the newest segment and find the end of its valid records so a
+ * restarted logstore appends after what it already made durable. A record
+ * is valid if it continues the LSN sequence from the segment's name, fits
+ * in the file and matches its CRC; the first one that doesn't is where a
+ * crash cut a group commit short. Appends resume there, and everything
+ * after it is zeroed so no stale record can reappear behind new ones. A
+ * segment without a valid record was created by a rotation just before
+ * the crash, after the one before it was synced: its name says where the
+ * durable log ends. */
+static int seg_recover(struct seg_store *st)
+{
+    struct seg_rec_hdr hdr;
+    struct dirent *de;
+    struct stat sb;
+    uint64_t last = 0;
+    char *scratch = st->bufs[0].data;
+    size_t size;
+    int found = 0;
+    DIR *d;
+
+    d = opendir(st->dir);
+    if (!d) {
+        fprintf(stderr, "failed to open %s: %s\n", st->dir, strerror(errno));
+        return 1;
+    }
+    while ((de = readdir(d))) {
+        unsigned long v;
+
+        if (sscanf(de->d_name, "%16lx.seg", &v) == 1 && strlen(de->d_name) == 20) {
+            if (!found || v > last)
+                last = v;
+            found = 1;
+        }
+    }
+    closedir(d);
+
+    if (!found)
+        return 0;
+
+    if (seg_open_file(st, last, 0))
+        return 1;
+    if (fstat(st->fd, &sb)) {
+        fprintf(stderr, "failed to stat segment " SEG_NAME_FMT ": %s\n", (unsigned long)last, strerror(errno));
+        return 1;
+    }
+    size = (size_t)sb.st_size;
+
+    st->seg_off = 0;
+    st->durable_lsn = last ? last - 1 : 0;
+    while (st->seg_off + sizeof(hdr) <= size && pread(st->fd, &hdr, sizeof(hdr), st->seg_off) == sizeof(hdr)) {
+        size_t rec = seg_store_rec_size(hdr.len);
+
+        if (hdr.lsn != st->durable_lsn + 1 || rec > size - st->seg_off || rec > SEG_COMMIT_BUF)
+            break;
+        if (pread(st->fd, scratch, hdr.len, st->seg_off + sizeof(hdr)) != (ssize_t)hdr.len ||
+            crc32c(0, scratch, hdr.len) != hdr.crc)
+            break;
+        st->durable_lsn = hdr.lsn;
+        st->seg_off += rec;
+    }
+    st->appended_lsn = st->durable_lsn;
+
+    if (st->seg_off < size) {
+        int rc = fallocate(st->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, st->seg_off, size - st->seg_off);
+
+        // Not every filesystem zeroes ranges, write the zeros out there
+        if (rc && (errno == EOPNOTSUPP || errno == ENOSYS)) {
+            memset(scratch, 0, SEG_COMMIT_BUF);
+            for (size_t off = st->seg_off; !rc && off < size; ) {
+                size_t n = size - off < SEG_COMMIT_BUF ? size - off : SEG_COMMIT_BUF;
+                ssize_t w = pwrite(st->fd, scratch, n, off);
+
+                rc = w <= 0;
+                off += w > 0 ? (size_t)w : 0;
+            }
+        }
+        if (rc || fdatasync(st->fd)) {
+            fprintf(stderr, "failed to clear the tail of segment " SEG_NAME_FMT ": %s\n",
+                    (unsigned long)last, strerror(errno));
+            return 1;
+        }
+    }
+
+    fprintf(stdout, "Resuming segment " SEG_NAME_FMT " at offset %zu, durable LSN %lu\n",
+            (unsigned long)st->seg_first_lsn, st->seg_off, (unsigned long)st->durable_lsn);
+    return 0;
+}
+
+int seg_store_open(struct seg_store *st, const char *dir, size_t seg_size, int prefer_uring)
+{
+    memset(st, 0, sizeof(*st));
+    st->fd = -1;
+    st->dirfd = -1;
+    st->seg_size = seg_size ? seg_size : SEG_DEFAULT_SIZE;
+    snprintf(st->dir, sizeof(st->dir), "%s", dir);
+
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        fprintf(stderr, "failed to create %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    st->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (st->dirfd < 0) {
+        fprintf(stderr, "failed to open %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        st->bufs[i].data = (char *)malloc(SEG_COMMIT_BUF);
+        if (!st->bufs[i].data) {
+            fprintf(stderr, "failed to allocate %lu byte commit buffer\n", SEG_COMMIT_BUF);
+            goto seg_store_open_err;
+        }
+    }
+    st->fill = &st->bufs[0];
+
+    // Recovery reads payloads into a commit buffer, before there is anything to commit
+    if (seg_recover(st))
+        goto seg_store_open_err;
+
+    if (prefer_uring) {
+        int rc = uring_init(&st->ring, 8);
+
+        if (rc)
+            fprintf(stderr, "io_uring unavailable (%s), using pwrite + fdatasync\n", strerror(-rc));
+        else
+            st->use_uring = 1;
+    }
+
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_cond_init(&st->work, NULL);
+    pthread_cond_init(&st->done, NULL);
+    if (pthread_create(&st->thread, NULL, seg_commit_thread, st)) {
+        fprintf(stderr, "failed to start group commit thread\n");
+        goto seg_store_open_err;
+    }
+
+    fprintf(stdout, "Segment store in %s: %zu byte segments, %s commits\n",
+            dir, st->seg_size, st->use_uring ? "io_uring" : "pwrite + fdatasync");
+    return 0;
+
+seg_store_open_err:
+    if (st->use_uring)
+        uring_exit(&st->ring);
+    free(st->bufs[0].data);
+    free(st->bufs[1].data);
+    if (st->fd >= 0)
+        close(st->fd);
+    close(st->dirfd);
+    return 1;
+}
+
+static int seg_write_uring(struct seg_store *st, const char *data, size_t len, off_t off)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe cqe;
+    int rc = 0;
+
+    sqe = uring_get_sqe(&st->ring);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = st->fd;
+    sqe->addr = (uintptr_t)data;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = uring_get_sqe(&st->ring);
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = st->fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+
+    rc = uring_submit_and_wait(&st->ring, 2);
+    if (rc < 0) {
+        fprintf(stderr, "io_uring_enter failed: %s\n", strerror(-rc));
+        return 1;
+    }
+
+    rc = 0;
+    for (int i = 0; i < 2; i++) {
+        while (!uring_reap(&st->ring, &cqe))
+            uring_submit_and_wait(&st->ring, 1);
+        if (cqe.res < 0 || (i == 0 && (size_t)cqe.res != len)) {
+            fprintf(stderr, "segment %s failed: %s\n", i ? "fdatasync" : "write",
+                    cqe.res < 0 ? strerror(-cqe.res) : "short write");
+            rc = 1;
+        }
+    }
+    return rc;
+}
+
+static int seg_write_sync(struct seg_store *st, const char *data, size_t len, off_t off)
+{
+    while (len) {
+        ssize_t n = pwrite(st->fd, data, len, off);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "segment write failed: %s\n", strerror(errno));
+            return 1;
+        }
+        data += n;
+        len -= n;
+        off += n;
+    }
+    if (fdatasync(st->fd)) {
+        fprintf(stderr, "segment fdatasync failed: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+static int seg_write_run(struct seg_store *st, const char *data, size_t len)
+{
+    int rc;
+
+    if (!len)
+        return 0;
+    if (st->use_uring)
+        rc = seg_write_uring(st, data, len, st->seg_off);
+    else
+        rc = seg_write_sync(st, data, len, st->seg_off);
+    st->seg_off += len;
+    return rc;
+}
+
+/* Write one commit buffer, rotating at record boundaries. Each run ends in
+ * an fdatasync, so a rotation never leaves the old segment unsynced. */
+static int seg_write_buf(struct seg_store *st, struct seg_buf *buf)
+{
+    size_t off = 0, run = 0;
+
+    while (off < buf->len) {
+        struct seg_rec_hdr *hdr = (struct seg_rec_hdr *)(buf->data + off);
+        size_t rec = seg_store_rec_size(hdr->len);
+
+        if (st->fd < 0 || (st->seg_off + off - run + rec > st->seg_size && st->seg_off + off - run > 0)) {
+            if (seg_write_run(st, buf->data + run, off - run))
+                return 1;
+            run = off;
+            if (st->fd >= 0)
+                close(st->fd);
+            if (seg_open_file(st, hdr->lsn, 1))
+                return 1;
+        }
+        off += rec;
+    }
+    return seg_write_run(st, buf->data + run, off - run);
+}
+
+static void *seg_commit_thread(void *arg)
+{
+    struct seg_store *st = (struct seg_store *)arg;
+    struct seg_buf *buf;
+    int rc;
+
+    pthread_mutex_lock(&st->lock);
+    for (;;) {
+        while (!st->stop && !st->fill->len)
+            pthread_cond_wait(&st->work, &st->lock);
+        if (!st->fill->len)
+            break;
+
+        if (st->commit_delay_us) {
+            pthread_mutex_unlock(&st->lock);
+            usleep(st->commit_delay_us);
+            pthread_mutex_lock(&st->lock);
+        }
+
+        // Everything appended so far forms the group; appenders move on to the other buffer
+        buf = st->fill;
+        st->commit = buf;
+        st->fill = (buf == &st->bufs[0]) ? &st->bufs[1] : &st->bufs[0];
+        pthread_mutex_unlock(&st->lock);
+
+        rc = seg_write_buf(st, buf);
+
+        pthread_mutex_lock(&st->lock);
+        if (rc) {
+            st->error = 1;
+        } else {
+            __atomic_store_n(&st->durable_lsn, buf->last_lsn, __ATOMIC_RELEASE);
+            st->commits++;
+        }
+        buf->len = 0;
+        st->commit = NULL;
+        pthread_cond_broadcast(&st->done);
+        if (st->error)
+            break;
+    }
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+int seg_store_append(struct seg_store *st, uint64_t lsn, const void *data, uint32_t len)
+{
+    // Outside the lock, the committer only needs the finished record
+    return seg_store_append_crc(st, lsn, data, len, crc32c(0, data, len));
+}
+
+/* seg_store_append for a caller that has the payload's CRC32C already,
+ * e.g. from a worker thread. */
+int seg_store_append_crc(struct seg_store *st, uint64_t lsn, const void *data, uint32_t len, uint32_t crc)
+{
+    struct seg_rec_hdr *hdr;
+    size_t rec = seg_store_rec_size(len);
+
+    if (rec > SEG_COMMIT_BUF || rec > st->seg_size) {
+        fprintf(stderr, "record of %u bytes exceeds the commit buffer or segment size\n", len);
+        return 1;
+    }
+
+    pthread_mutex_lock(&st->lock);
+    while (!st->error && st->fill->len + rec > SEG_COMMIT_BUF)
+        pthread_cond_wait(&st->done, &st->lock);
+    if (st->error) {
+        pthread_mutex_unlock(&st->lock);
+        return 1;
+    }
+
+    hdr = (struct seg_rec_hdr *)(st->fill->data + st->fill->len);
+    hdr->lsn = lsn;
+    hdr->len = len;
+    hdr->crc = crc;
+    memcpy(hdr + 1, data, len);
+    memset((char *)(hdr + 1) + len, 0, rec - sizeof(*hdr) - len);
+
+    if (!st->fill->len)
+        pthread_cond_signal(&st->work);
+    st->fill->len += rec;
+    st->fill->last_lsn = lsn;
+    st->appended_lsn = lsn;
+    st->records++;
+    pthread_mutex_unlock(&st->lock);
+    return 0;
+}
+
+uint64_t seg_store_durable_lsn(struct seg_store *st)
+{
+    return __atomic_load_n(&st->durable_lsn, __ATOMIC_ACQUIRE);
+}
+
+int seg_store_wait_durable(struct seg_store *st, uint64_t lsn)
+{
+    int rc;
+
+    pthread_mutex_lock(&st->lock);
+    while (!st->error && st->durable_lsn < lsn)
+        pthread_cond_wait(&st->done, &st->lock);
+    rc = st->error;
+    pthread_mutex_unlock(&st->lock);
+    return rc;
+}
+
+/* Commit whatever is buffered, stop the committer and close the segment. */
+int seg_store_close(struct seg_store *st)
+{
+    int rc;
+
+    pthread_mutex_lock(&st->lock);
+    st->stop = 1;
+    pthread_cond_signal(&st->work);
+    pthread_mutex_unlock(&st->lock);
+    pthread_join(st->thread, NULL);
+
+    rc = st->error;
+    fprintf(stdout, "Segment store closed: durable LSN %lu, %lu records in %lu commits\n",
+            (unsigned long)st->durable_lsn, (unsigned long)st->records, (unsigned long)st->commits);
+
+    if (st->use_uring)
+        uring_exit(&st->ring);
+    if (st->fd >= 0)
+        close(st->fd);
+    close(st->dirfd);
+    free(st->bufs[0].data);
+    free(st->bufs[1].data);
+    pthread_mutex_destroy(&st->lock);
+    pthread_cond_destroy(&st->work);
+    pthread_cond_destroy(&st->done);
+    return rc;
+}
@@ -0,0 +1,73 @@
+#ifndef SEG_STORE_H
+#define SEG_STORE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "uring.h"
+
+/*
+ * Durable log on the logstore: records are appended to rotating segment
+ * files named after the first LSN they hold. Appends land in an in-memory
+ * commit buffer; a group-commit thread swaps it out and writes it with one
+ * fdatasync (io_uring linked write + fsync when available, pwrite +
+ * fdatasync otherwise), then advances durable_lsn.
+ *
+ * Segment file format: back-to-back seg_rec_hdr + payload, padded to 8.
+ * The header holds the CRC32C of the payload for recovery to check.
+ * Stored logs are read back through an index, see seg_index.h.
+ */
+
+#define SEG_DEFAULT_SIZE (64UL << 20)
+#define SEG_COMMIT_BUF (4UL << 20)
+#define SEG_NAME_FMT "%016lx.seg"
+
+struct seg_rec_hdr {
+    uint64_t lsn;
+    uint32_t len;
+    uint32_t crc;  // CRC32C of the payload
+};
+
+struct seg_buf {
+    char *data;
+    size_t len;
+    uint64_t last_lsn;
+};
+
+struct seg_store {
+    char dir[256];
+    int dirfd;
+    size_t seg_size;
+    int fd;                   // Current segment, -1 before the first write
+    size_t seg_off;
+    uint64_t seg_first_lsn;
+    int commit_delay_us;      // Extra wait before a commit to grow the group
+
+    struct seg_buf bufs[2];
+    struct seg_buf *fill;     // Appenders write here
+    struct seg_buf *commit;   // Owned by the committer while writing
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_t thread;
+    int stop;
+    int error;
+
+    int use_uring;
+    struct uring ring;
+
+    uint64_t appended_lsn;
+    uint64_t durable_lsn;     // Everything up to here survived fdatasync
+    uint64_t commits;
+    uint64_t records;
+};
+
+int seg_store_open(struct seg_store *st, const char *dir, size_t seg_size, int prefer_uring);
+int seg_store_append(struct seg_store *st, uint64_t lsn, const void *data, uint32_t len);
+int seg_store_append_crc(struct seg_store *st, uint64_t lsn, const void *data, uint32_t len, uint32_t crc);
+uint64_t seg_store_durable_lsn(struct seg_store *st);
+int seg_store_wait_durable(struct seg_store *st, uint64_t lsn);
+int seg_store_close(struct seg_store *st);
+size_t seg_store_rec_size(uint32_t len);
+
+#endif // SEG_STORE_H
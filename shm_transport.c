@@ -0,0 +1,493 @@
+#define _GNU_SOURCE
+#include "rdma.h"
+#include "transport.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Shared-memory transport. Each device is two POSIX shm objects named after
+ * the owning process: "<pid>.<dev>.mem" holds the pool (what the verbs
+ * transport registers) and "<pid>.<dev>.cq" a table of soft CQs. A peer
+ * maps both on connect; its writes, reads and atomics then complete inline
+ * in ibv_post_send as memcpy/atomics plus a fence, and write-with-immediate
+ * pushes a receive completion onto the owner's soft CQ.
+ *
+ * Handshake fields keep their verbs meaning where they can: addr is the
+ * buffer's offset in the pool (zero-based MR), qp_num is per process, lid is
+ * the index of the QP's receive CQ and gid carries the pid and device.
+ *
+ * For failover testing, SHM_FAIL_EVERY=n in the environment fails every
+ * nth WR a QP executes with IBV_WC_RETRY_EXC_ERR, as an HCA does when the
+ * peer stops answering, without touching the peer's memory.
+ */
+
+#define SHM_MAX_CQS 128
+#define SHM_NAME_FMT "/rdma-prot.%u.%u.%s"
+#define SHM_MAX_WR 16384
+
+struct shm_ctrl {
+    uint32_t ncqs;
+    char pad[60];
+    struct soft_cq cqs[SHM_MAX_CQS];
+};
+
+struct shm_dev {
+    unsigned id;
+    int mem_fd;
+    int ctrl_fd;
+    struct shm_ctrl *ctrl;
+};
+
+struct shm_qp {
+    struct ibv_qp qp;          // Only qp_num is used, so the generic code sees a QP
+    struct soft_cq *send_cq;
+    uint32_t recv_cq;          // Index in our control table, sent as lid
+    uint32_t remote_qpn;
+    char *remote_mem;          // Peer's pool
+    size_t remote_mem_len;
+    struct shm_ctrl *remote_ctrl;
+    struct soft_cq *remote_recv_cq;
+    uint64_t executed;         // WRs executed, for SHM_FAIL_EVERY
+    uint64_t fail_every;
+};
+
+struct shm_addr {
+    uint32_t pid;
+    uint32_t dev;
+};
+
+static unsigned shm_next_dev;
+static uint32_t shm_next_qpn = 1;
+
+static void shm_name(char *name, size_t len, uint32_t pid, uint32_t dev, const char *kind)
+{
+    snprintf(name, len, SHM_NAME_FMT, pid, dev, kind);
+}
+
+static int shm_open_dev(struct shm_dev *sd, const char *kind)
+{
+    char name[64];
+    int fd;
+
+    shm_name(name, sizeof(name), getpid(), sd->id, kind);
+    shm_unlink(name); // Left over by a crashed process with a recycled pid
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0)
+        fprintf(stderr, "shm_open %s failed: %s\n", name, strerror(errno));
+    return fd;
+}
+
+static int shm_open_device(struct resources *res)
+{
+    struct shm_dev *sd;
+
+    sd = (struct shm_dev *)calloc(1, sizeof(*sd));
+    if (!sd)
+        return 1;
+    sd->id = __atomic_fetch_add(&shm_next_dev, 1, __ATOMIC_RELAXED);
+    sd->mem_fd = -1;
+    res->priv = sd;
+
+    sd->ctrl_fd = shm_open_dev(sd, "cq");
+    if (sd->ctrl_fd < 0)
+        goto shm_open_device_err;
+    if (ftruncate(sd->ctrl_fd, sizeof(struct shm_ctrl))) {
+        fprintf(stderr, "failed to size shm CQ table: %s\n", strerror(errno));
+        goto shm_open_device_err;
+    }
+    sd->ctrl = (struct shm_ctrl *)mmap(NULL, sizeof(struct shm_ctrl), PROT_READ | PROT_WRITE, MAP_SHARED, sd->ctrl_fd, 0);
+    if (sd->ctrl == MAP_FAILED) {
+        sd->ctrl = NULL;
+        fprintf(stderr, "failed to map shm CQ table: %s\n", strerror(errno));
+        goto shm_open_device_err;
+    }
+
+    // Limits the generic layer clamps against
+    memset(&res->device_attr, 0, sizeof(res->device_attr));
+    res->device_attr.max_qp_wr = SHM_MAX_WR;
+    res->device_attr.max_cqe = SOFT_CQ_ENTRIES;
+    res->device_attr.max_srq_wr = SHM_MAX_WR;
+    res->device_attr.max_mr_size = ~0ULL;
+    res->device_attr.atomic_cap = IBV_ATOMIC_HCA;
+    res->device_attr.max_qp_rd_atom = 16;
+    res->device_attr.max_qp_init_rd_atom = 16;
+    res->device_attr.max_sge = RDMA_MAX_SGE;
+    memset(&res->port_attr, 0, sizeof(res->port_attr));
+    res->port_attr.state = IBV_PORT_ACTIVE;
+    res->port_attr.link_layer = IBV_LINK_LAYER_UNSPECIFIED;
+    res->port_attr.active_mtu = IBV_MTU_4096;
+
+    fprintf(stdout, "Shared-memory device %u of process %u\n", sd->id, (unsigned)getpid());
+    return 0;
+
+shm_open_device_err:
+    res->ops->close_device(res);
+    return 1;
+}
+
+static void shm_close_device(struct resources *res)
+{
+    struct shm_dev *sd = (struct shm_dev *)res->priv;
+    char name[64];
+
+    if (!sd)
+        return;
+    if (sd->ctrl)
+        munmap(sd->ctrl, sizeof(struct shm_ctrl));
+    if (sd->ctrl_fd >= 0) {
+        close(sd->ctrl_fd);
+        shm_name(name, sizeof(name), getpid(), sd->id, "cq");
+        shm_unlink(name);
+    }
+    if (sd->mem_fd >= 0) {
+        close(sd->mem_fd);
+        shm_name(name, sizeof(name), getpid(), sd->id, "mem");
+        shm_unlink(name);
+    }
+    free(sd);
+    res->priv = NULL;
+}
+
+static int shm_pool_create(struct resources *res, size_t size, size_t reserved, int access)
+{
+    struct shm_dev *sd = (struct shm_dev *)res->priv;
+
+    (void)access;
+    sd->mem_fd = shm_open_dev(sd, "mem");
+    if (sd->mem_fd < 0)
+        return 1;
+    // No PD: the pool is addressed by offset and guarded by nothing but file permissions
+    return mem_pool_create(&res->pool, NULL, sd->mem_fd, size, reserved, config.chunk_size,
+                           0, config.numa_node, 0, 0);
+}
+
+static int shm_cq_create(struct resources *res, struct cq_engine *eng, int cqe, enum cq_mode mode)
+{
+    struct shm_dev *sd = (struct shm_dev *)res->priv;
+    uint32_t idx = __atomic_fetch_add(&sd->ctrl->ncqs, 1, __ATOMIC_RELAXED);
+
+    (void)cqe;
+    if (idx >= SHM_MAX_CQS) {
+        fprintf(stderr, "shm device out of CQs (max %d)\n", SHM_MAX_CQS);
+        return 1;
+    }
+    soft_cq_init(&sd->ctrl->cqs[idx]);
+    cq_engine_init_soft(eng, &sd->ctrl->cqs[idx], mode);
+    return 0;
+}
+
+/* Immediates never need a posted receive here, so the SRQ is only a
+ * credit count the generic layer keeps topping up. */
+static int shm_srq_create(struct resources *res, uint32_t depth)
+{
+    res->srq_depth = depth;
+    return 0;
+}
+
+static int shm_post_srq_recv(struct resources *res, struct ibv_recv_wr *wr, struct ibv_recv_wr **bad_wr)
+{
+    (void)res;
+    (void)wr;
+    (void)bad_wr;
+    return 0;
+}
+
+static int shm_qp_create(struct resources *res, struct ibv_qp_init_attr *attr)
+{
+    struct resources *dev = res->parent ? res->parent : res;
+    struct shm_dev *sd = (struct shm_dev *)dev->priv;
+    struct cq_engine *recv_eng = res->recv_eng ? res->recv_eng : &dev->cq_eng;
+    struct shm_qp *sq;
+
+    sq = (struct shm_qp *)calloc(1, sizeof(*sq));
+    if (!sq)
+        return 1;
+    sq->qp.qp_num = __atomic_fetch_add(&shm_next_qpn, 1, __ATOMIC_RELAXED);
+    sq->qp.qp_type = IBV_QPT_RC;
+    sq->qp.state = IBV_QPS_RESET;
+    sq->send_cq = dev->cq_eng.scq;
+    sq->recv_cq = recv_eng->scq - sd->ctrl->cqs;
+
+    if (getenv("SHM_FAIL_EVERY"))
+        sq->fail_every = strtoull(getenv("SHM_FAIL_EVERY"), NULL, 0);
+
+    res->qp = &sq->qp;
+    // Everything is copied at post time
+    res->max_inline = attr->cap.max_inline_data;
+    return 0;
+}
+
+static int shm_qp_destroy(struct resources *res)
+{
+    struct shm_qp *sq = (struct shm_qp *)res->qp;
+
+    if (sq->remote_mem)
+        munmap(sq->remote_mem, sq->remote_mem_len);
+    if (sq->remote_ctrl)
+        munmap(sq->remote_ctrl, sizeof(struct shm_ctrl));
+    free(sq);
+    res->qp = NULL;
+    return 0;
+}
+
+static int shm_qp_reset(struct resources *res, struct ibv_qp *qp)
+{
+    struct shm_qp *sq = (struct shm_qp *)qp;
+
+    (void)res;
+    if (sq->remote_mem)
+        munmap(sq->remote_mem, sq->remote_mem_len);
+    if (sq->remote_ctrl)
+        munmap(sq->remote_ctrl, sizeof(struct shm_ctrl));
+    sq->remote_mem = NULL;
+    sq->remote_mem_len = 0;
+    sq->remote_ctrl = NULL;
+    sq->remote_recv_cq = NULL;
+    sq->remote_qpn = 0;
+    sq->executed = 0;
+    sq->qp.state = IBV_QPS_RESET;
+    return 0;
+}
+
+static int shm_conn_local(struct resources *res, struct cm_con_data_t *local)
+{
+    struct resources *dev = res->parent ? res->parent : res;
+    struct shm_dev *sd = (struct shm_dev *)dev->priv;
+    struct shm_qp *sq = (struct shm_qp *)res->qp;
+    struct shm_addr addr = { (uint32_t)getpid(), sd->id };
+
+    local->addr = res->buf - dev->pool.base;
+    local->lid = sq->recv_cq;
+    memcpy(local->gid, &addr, sizeof(addr));
+    return 0;
+}
+
+static void *shm_map_peer(const struct shm_addr *addr, const char *kind, size_t *len)
+{
+    char name[64];
+    struct stat st;
+    void *p = MAP_FAILED;
+    int fd;
+
+    shm_name(name, sizeof(name), addr->pid, addr->dev, kind);
+    fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "shm_open %s failed: %s (is the peer on this host and using -T shm?)\n", name, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) == 0) {
+        *len = st.st_size;
+        p = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "failed to map %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+    return p;
+}
+
+static int shm_conn_apply(struct resources *res)
+{
+    struct shm_qp *sq = (struct shm_qp *)res->qp;
+    struct shm_addr addr;
+    size_t ctrl_len;
+
+    memcpy(&addr, res->remote_props.gid, sizeof(addr));
+    if (res->remote_props.lid >= SHM_MAX_CQS) {
+        fprintf(stderr, "peer receive CQ %u out of range\n", res->remote_props.lid);
+        return 1;
+    }
+
+    sq->remote_ctrl = (struct shm_ctrl *)shm_map_peer(&addr, "cq", &ctrl_len);
+    if (!sq->remote_ctrl)
+        return 1;
+    sq->remote_mem = (char *)shm_map_peer(&addr, "mem", &sq->remote_mem_len);
+    if (!sq->remote_mem)
+        return 1;
+
+    sq->remote_recv_cq = &sq->remote_ctrl->cqs[res->remote_props.lid];
+    sq->remote_qpn = res->remote_props.qp_num;
+    sq->qp.state = IBV_QPS_RTS;
+    fprintf(stdout, "Mapped peer process %u device %u: %zu byte pool\n", addr.pid, addr.dev, sq->remote_mem_len);
+    return 0;
+}
+
+static int shm_range_ok(struct shm_qp *sq, uint64_t addr, uint64_t len)
+{
+    return addr <= sq->remote_mem_len && len <= sq->remote_mem_len - addr;
+}
+
+static uint64_t wr_length(const struct ibv_send_wr *wr)
+{
+    uint64_t len = 0;
+
+    for (int i = 0; i < wr->num_sge; i++)
+        len += wr->sg_list[i].length;
+    return len;
+}
+
+/* Copy bytes [from, to) of the gathered SGE stream to dst + from. */
+static void gather(char *dst, const struct ibv_send_wr *wr, uint64_t from, uint64_t to)
+{
+    uint64_t pos = 0;
+
+    for (int i = 0; i < wr->num_sge && pos < to; i++) {
+        const struct ibv_sge *sge = &wr->sg_list[i];
+        uint64_t start = pos > from ? pos : from;
+        uint64_t end = pos + sge->length < to ? pos + sge->length : to;
+
+        if (start < end)
+            memcpy(dst + start, (const char *)(uintptr_t)sge->addr + (start - pos), end - start);
+        pos += sge->length;
+    }
+}
+
+/* Scatter src over the WR's SGEs. */
+static void scatter(const struct ibv_send_wr *wr, const char *src)
+{
+    for (int i = 0; i < wr->num_sge; i++) {
+        memcpy((void *)(uintptr_t)wr->sg_list[i].addr, src, wr->sg_list[i].length);
+        src += wr->sg_list[i].length;
+    }
+}
+
+/* The first word is stored last, behind a release fence, so a consumer
+ * polling a header at the start of a write never sees it ahead of the
+ * bytes it covers. */
+static void shm_write(char *dst, const struct ibv_send_wr *wr, uint64_t len)
+{
+    uint64_t lead = len < sizeof(uint64_t) ? len : sizeof(uint64_t);
+
+    gather(dst, wr, lead, len);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    gather(dst, wr, 0, lead);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static enum ibv_wc_status shm_execute(struct shm_qp *sq, struct ibv_send_wr *wr, struct ibv_wc *wc)
+{
+    uint64_t len = wr_length(wr);
+    uint64_t raddr;
+    uint64_t *word;
+
+    switch (wr->opcode) {
+    case IBV_WR_RDMA_WRITE:
+    case IBV_WR_RDMA_WRITE_WITH_IMM:
+        wc->opcode = IBV_WC_RDMA_WRITE;
+        raddr = wr->wr.rdma.remote_addr;
+        if (!shm_range_ok(sq, raddr, len))
+            return IBV_WC_REM_ACCESS_ERR;
+        shm_write(sq->remote_mem + raddr, wr, len);
+
+        if (wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM) {
+            struct ibv_wc rwc;
+
+            memset(&rwc, 0, sizeof(rwc));
+            rwc.status = IBV_WC_SUCCESS;
+            rwc.opcode = IBV_WC_RECV_RDMA_WITH_IMM;
+            rwc.qp_num = sq->remote_qpn;
+            rwc.imm_data = wr->imm_data;
+            rwc.wc_flags = IBV_WC_WITH_IMM;
+            // A full receive CQ is the RNR case: keep retrying
+            while (soft_cq_push(sq->remote_recv_cq, &rwc))
+                sched_yield();
+        }
+        return IBV_WC_SUCCESS;
+
+    case IBV_WR_RDMA_READ:
+        wc->opcode = IBV_WC_RDMA_READ;
+        wc->byte_len = len;
+        raddr = wr->wr.rdma.remote_addr;
+        if (!shm_range_ok(sq, raddr, len))
+            return IBV_WC_REM_ACCESS_ERR;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        scatter(wr, sq->remote_mem + raddr);
+        return IBV_WC_SUCCESS;
+
+    case IBV_WR_ATOMIC_FETCH_AND_ADD:
+    case IBV_WR_ATOMIC_CMP_AND_SWP:
+        raddr = wr->wr.atomic.remote_addr;
+        if (len != sizeof(uint64_t) || (raddr & 7) || !shm_range_ok(sq, raddr, len))
+            return IBV_WC_REM_INV_REQ_ERR;
+        word = (uint64_t *)(sq->remote_mem + raddr);
+        if (wr->opcode == IBV_WR_ATOMIC_FETCH_AND_ADD) {
+            wc->opcode = IBV_WC_FETCH_ADD;
+            *(uint64_t *)(uintptr_t)wr->sg_list[0].addr =
+                __atomic_fetch_add(word, wr->wr.atomic.compare_add, __ATOMIC_ACQ_REL);
+        } else {
+            uint64_t expected = wr->wr.atomic.compare_add;
+
+            wc->opcode = IBV_WC_COMP_SWAP;
+            __atomic_compare_exchange_n(word, &expected, wr->wr.atomic.swap, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+            *(uint64_t *)(uintptr_t)wr->sg_list[0].addr = expected;
+        }
+        wc->byte_len = sizeof(uint64_t);
+        return IBV_WC_SUCCESS;
+
+    default:
+        return IBV_WC_LOC_QP_OP_ERR;
+    }
+}
+
+/* Execute the chain in order. Like an RC QP, the first failure moves the QP
+ * to error and flushes every WR behind it with a completion. */
+static int shm_post_send(struct resources *res, struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr)
+{
+    struct shm_qp *sq = (struct shm_qp *)res->qp;
+
+    if (sq->qp.state != IBV_QPS_RTS && sq->qp.state != IBV_QPS_ERR) {
+        *bad_wr = wr;
+        return EINVAL;
+    }
+
+    for (; wr; wr = wr->next) {
+        struct ibv_wc wc;
+
+        memset(&wc, 0, sizeof(wc));
+        wc.wr_id = wr->wr_id;
+        wc.qp_num = sq->qp.qp_num;
+        if (sq->qp.state == IBV_QPS_ERR) {
+            wc.status = IBV_WC_WR_FLUSH_ERR;
+        } else if (sq->fail_every && ++sq->executed % sq->fail_every == 0) {
+            wc.status = IBV_WC_RETRY_EXC_ERR;
+            sq->qp.state = IBV_QPS_ERR;
+        } else {
+            wc.status = shm_execute(sq, wr, &wc);
+            if (wc.status != IBV_WC_SUCCESS)
+                sq->qp.state = IBV_QPS_ERR;
+        }
+
+        if ((wr->send_flags & IBV_SEND_SIGNALED) || wc.status != IBV_WC_SUCCESS) {
+            // The generic layer never has more CQEs outstanding than the CQ holds
+            if (soft_cq_push(sq->send_cq, &wc)) {
+                *bad_wr = wr;
+                return ENOMEM;
+            }
+        }
+    }
+    return 0;
+}
+
+const struct transport_ops shm_transport = {
+    .name = "shm",
+    .open_device = shm_open_device,
+    .close_device = shm_close_device,
+    .pool_create = shm_pool_create,
+    .cq_create = shm_cq_create,
+    .srq_create = shm_srq_create,
+    .post_srq_recv = shm_post_srq_recv,
+    .qp_create = shm_qp_create,
+    .qp_destroy = shm_qp_destroy,
+    .qp_reset = shm_qp_reset,
+    .conn_local = shm_conn_local,
+    .conn_apply = shm_conn_apply,
+    .post_send = shm_post_send,
+};
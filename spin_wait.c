@@ -0,0 +1,30 @@
+#include "spin_wait.h"
+#include "stats.h"
+#include <sched.h>
+
+void spin_wait_init(struct spin_wait *w, int spins)
+{
+    w->budget = spins;
+    spin_wait_reset(w);
+}
+
+void spin_wait_reset(struct spin_wait *w)
+{
+    w->spins = w->budget;
+    w->start = 0;
+}
+
+/* Returns 1 once the wait has timed out, 0 to poll again. */
+int spin_wait(struct spin_wait *w)
+{
+    if (w->spins > 0) {
+        w->spins--;
+        return 0;
+    }
+    if (!w->start)
+        w->start = stats_now();
+    else if (stats_now() - w->start > SPIN_WAIT_TIMEOUT_MS * 1000000ULL)
+        return 1;
+    sched_yield();
+    return 0;
+}
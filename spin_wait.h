@@ -0,0 +1,38 @@
+#ifndef SPIN_WAIT_H
+#define SPIN_WAIT_H
+
+#include <stdint.h>
+
+/*
+ * Bounded waits for a one-sided acknowledgement or a completion.
+ *
+ * Whoever waits for the other side polls: the first `spins` rounds
+ * back to back, then yielding the CPU between rounds, and gives up once
+ * SPIN_WAIT_TIMEOUT_MS pass that way without the wait ending. The clock
+ * only starts once yielding does, so a wait that ends while spinning never
+ * reads it. The caller polls, and calls spin_wait() after every round
+ * that didn't end the wait:
+ *
+ *     spin_wait_init(&w, SPIN_WAIT_SPINS);
+ *     while (!done()) {
+ *         if (spin_wait(&w))
+ *             return timed_out();
+ *     }
+ *
+ * spin_wait_reset() starts over after a round that made progress.
+ */
+
+#define SPIN_WAIT_SPINS 1000       // Polls before a waiter starts yielding the CPU
+#define SPIN_WAIT_TIMEOUT_MS 10000
+
+struct spin_wait {
+    int spins;      // Polls left before yielding
+    int budget;
+    uint64_t start; // stats_now() when yielding began, 0 before
+};
+
+void spin_wait_init(struct spin_wait *w, int spins);
+void spin_wait_reset(struct spin_wait *w);
+int spin_wait(struct spin_wait *w);
+
+#endif // SPIN_WAIT_H
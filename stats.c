@@ -0,0 +1,180 @@
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+static struct stats_page local_page;
+static struct stats_page *page = &local_page;
+static struct thread_stats overflow; // Shared by the threads past STATS_MAX_THREADS
+static char page_path[64];
+
+__thread struct thread_stats *stats_tls;
+
+/* Move the counters into a shared memory file named after the pid, where
+ * rdma_stats can read them. Call it before any thread posts: slots claimed
+ * earlier stay in process memory. */
+int stats_open(void)
+{
+    struct stats_page *shared;
+    int fd;
+
+    snprintf(page_path, sizeof(page_path), STATS_PATH_FMT, (int)getpid());
+    fd = open(page_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("stats page open");
+        page_path[0] = '\0';
+        return 1;
+    }
+    if (ftruncate(fd, sizeof(*shared))) {
+        perror("stats page ftruncate");
+        goto stats_open_fail;
+    }
+    shared = (struct stats_page *)mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shared == MAP_FAILED) {
+        perror("stats page mmap");
+        goto stats_open_fail;
+    }
+    close(fd);
+
+    shared->pid = getpid();
+    __atomic_store_n(&shared->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    page = shared;
+    return 0;
+
+stats_open_fail:
+    close(fd);
+    unlink(page_path);
+    page_path[0] = '\0';
+    return 1;
+}
+
+void stats_close(void)
+{
+    if (!page_path[0])
+        return;
+    unlink(page_path);
+    page_path[0] = '\0';
+}
+
+const struct stats_page *stats_page(void)
+{
+    return page;
+}
+
+/* Slot of the calling thread, claimed on first use. A name labels the slot
+ * in dumps; unnamed threads show up by index. */
+struct thread_stats *stats_thread(const char *name)
+{
+    if (!stats_tls) {
+        uint32_t i = __atomic_fetch_add(&page->nthreads, 1, __ATOMIC_RELAXED);
+
+        if (i < STATS_MAX_THREADS) {
+            stats_tls = &page->threads[i];
+        } else {
+            __atomic_store_n(&page->nthreads, STATS_MAX_THREADS, __ATOMIC_RELAXED);
+            stats_tls = &overflow;
+        }
+    }
+    if (name)
+        snprintf(stats_tls->name, sizeof(stats_tls->name), "%s", name);
+    return stats_tls;
+}
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Upper bound of the log2 bucket holding the given percentile. */
+static uint64_t hist_percentile(const uint64_t *hist, int buckets, double pct)
+{
+    uint64_t total = 0, seen = 0;
+
+    for (int b = 0; b < buckets; b++)
+        total += hist[b];
+    if (!total)
+        return 0;
+    for (int b = 0; b < buckets; b++) {
+        seen += hist[b];
+        if (seen >= total * pct)
+            return (2ULL << b) - 1;
+    }
+    return (2ULL << (buckets - 1)) - 1;
+}
+
+static void print_line(FILE *out, const char *name, const struct thread_stats *t)
+{
+    fprintf(out, "%-16s %12lu %10lu %6.1f %14lu %12lu %12lu %6.1f%% %10lu %10lu\n", name,
+            (unsigned long)t->posts, (unsigned long)t->doorbells,
+            t->doorbells ? (double)t->posts / t->doorbells : 0.0, (unsigned long)t->bytes,
+            (unsigned long)t->cqes, (unsigned long)t->polls,
+            t->polls ? 100.0 * t->polls_empty / t->polls : 0.0,
+            (unsigned long)hist_percentile(t->latency, STATS_LAT_BUCKETS, 0.5),
+            (unsigned long)hist_percentile(t->latency, STATS_LAT_BUCKETS, 0.99));
+}
+
+/* One line per thread and a total. The writers keep going meanwhile, so a
+ * line may be a few operations out of step with itself. */
+void stats_print(FILE *out, const struct stats_page *pg)
+{
+    struct thread_stats sum;
+    uint32_t n = __atomic_load_n(&pg->nthreads, __ATOMIC_ACQUIRE);
+
+    if (n > STATS_MAX_THREADS)
+        n = STATS_MAX_THREADS;
+    memset(&sum, 0, sizeof(sum));
+    fprintf(out, "%-16s %12s %10s %6s %14s %12s %12s %7s %10s %10s\n", "thread", "posts", "doorbells",
+            "wr/db", "bytes", "cqes", "polls", "empty", "p50 ns", "p99 ns");
+    for (uint32_t i = 0; i < n; i++) {
+        const struct thread_stats *t = &pg->threads[i];
+        char name[24];
+
+        if (!t->posts && !t->polls && !t->pipe_items)
+            continue;
+        memcpy(name, t->name, sizeof(t->name));
+        name[sizeof(t->name)] = '\0';
+        if (!name[0])
+            snprintf(name, sizeof(name), "thread-%u", i);
+        print_line(out, name, t);
+
+        sum.posts += t->posts;
+        sum.doorbells += t->doorbells;
+        sum.bytes += t->bytes;
+        sum.cqes += t->cqes;
+        sum.polls += t->polls;
+        sum.polls_empty += t->polls_empty;
+        sum.mr_lookups += t->mr_lookups;
+        sum.mr_regs += t->mr_regs;
+        sum.mr_reg_ns += t->mr_reg_ns;
+        sum.mr_evictions += t->mr_evictions;
+        sum.pipe_items += t->pipe_items;
+        sum.pipe_stalls += t->pipe_stalls;
+        for (int b = 0; b < STATS_BATCH_BUCKETS; b++)
+            sum.batch[b] += t->batch[b];
+        for (int b = 0; b < STATS_LAT_BUCKETS; b++)
+            sum.latency[b] += t->latency[b];
+    }
+    print_line(out, "total", &sum);
+
+    fprintf(out, "WRs per doorbell:");
+    for (int b = 0; b < STATS_BATCH_BUCKETS; b++) {
+        if (sum.batch[b])
+            fprintf(out, " %lu%s: %lu", 1UL << b, b + 1 < STATS_BATCH_BUCKETS ? "" : "+",
+                    (unsigned long)sum.batch[b]);
+    }
+    fprintf(out, "\n");
+    if (sum.mr_lookups)
+        fprintf(out, "MR cache: %lu lookups, %.1f%% hits, %lu registrations at %.1f us each, %lu evictions\n",
+                (unsigned long)sum.mr_lookups, 100.0 * (sum.mr_lookups - sum.mr_regs) / sum.mr_lookups,
+                (unsigned long)sum.mr_regs, sum.mr_regs ? sum.mr_reg_ns / 1e3 / sum.mr_regs : 0.0,
+                (unsigned long)sum.mr_evictions);
+    if (sum.pipe_items)
+        fprintf(out, "Pipeline: %lu records through workers, %lu stalls on a full pipeline\n",
+                (unsigned long)sum.pipe_items, (unsigned long)sum.pipe_stalls);
+}
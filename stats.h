@@ -0,0 +1,80 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Per-thread data path counters, readable live from outside the process.
+ *
+ * Every thread that posts or reaps gets its own slot, padded to a cache
+ * line, and is the only writer of it: updates are plain increments with no
+ * atomics or sharing. The slots live in one page set mapped from
+ * /dev/shm/rdma_prot-<pid>.stats once stats_open() has run, so rdma_stats
+ * can map the same file and print them while the process keeps going;
+ * without stats_open() they stay in process memory.
+ *
+ * Build with make STATS=0 to compile the updates out.
+ */
+
+#ifndef RDMA_STATS
+#define RDMA_STATS 1
+#endif
+
+#define STATS_MAX_THREADS 64
+#define STATS_BATCH_BUCKETS 8   // Doorbells by WRs per post, log2: 1, 2-3, 4-7, ...
+#define STATS_LAT_BUCKETS 40    // Signaled WRs by post-to-completion time, log2 ns
+#define STATS_MAGIC 0x53544154u // "STAT"
+#define STATS_PATH_FMT "/dev/shm/rdma_prot-%d.stats"
+
+struct thread_stats {
+    char name[16];
+    uint64_t posts;       // Send WRs posted
+    uint64_t doorbells;   // ibv_post_send calls
+    uint64_t bytes;       // Bytes in the posted WRs
+    uint64_t cqes;        // Completions handled, sends and receives
+    uint64_t polls;       // CQ polls
+    uint64_t polls_empty; // ...that came back with nothing
+    uint64_t mr_lookups;  // MR cache, see mr_cache.h
+    uint64_t mr_regs;     // ...misses, each registering
+    uint64_t mr_reg_ns;   // ...time spent registering
+    uint64_t mr_evictions;
+    uint64_t pipe_items;  // Records checked by a pipeline worker, see log_pipe.h
+    uint64_t pipe_stalls; // ...and times a poller held records back, the pipeline being full
+    uint64_t batch[STATS_BATCH_BUCKETS];
+    uint64_t latency[STATS_LAT_BUCKETS];
+} __attribute__((aligned(64)));
+
+struct stats_page {
+    uint32_t magic;
+    uint32_t nthreads;    // Slots handed out
+    int32_t pid;
+    char pad[52];
+    struct thread_stats threads[STATS_MAX_THREADS];
+};
+
+extern __thread struct thread_stats *stats_tls;
+
+int stats_open(void);
+void stats_close(void);
+struct thread_stats *stats_thread(const char *name);
+uint64_t stats_now(void);
+void stats_print(FILE *out, const struct stats_page *page);
+const struct stats_page *stats_page(void);
+
+#define STATS_LOG2(v) ((v) ? 63 - __builtin_clzll(v) : 0)
+
+#if RDMA_STATS
+#define STATS_SELF() (stats_tls ? stats_tls : stats_thread(NULL))
+#define STATS_ADD(field, n) (STATS_SELF()->field += (n))
+#define STATS_HIST(field, v, buckets)                                      \
+    do {                                                                   \
+        unsigned b_ = STATS_LOG2((uint64_t)(v));                           \
+        STATS_SELF()->field[b_ < (buckets) ? b_ : (buckets) - 1]++;        \
+    } while (0)
+#else
+#define STATS_ADD(field, n) ((void)0)
+#define STATS_HIST(field, v, buckets) ((void)0)
+#endif
+
+#endif // STATS_H
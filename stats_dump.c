@@ -0,0 +1,77 @@
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+/*
+ * rdma_stats: print the data path counters of a running compute_node,
+ * logstore or log_bench. Only maps their stats page read-only, the process
+ * itself is never interrupted.
+ */
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-i seconds] <pid>\n", argv0);
+    fprintf(stderr, "  -i  print again every interval until the process exits\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const struct stats_page *pg;
+    char path[64];
+    int interval = 0;
+    pid_t pid;
+    int fd, opt;
+
+    while ((opt = getopt(argc, argv, "i:")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    pid = atoi(argv[optind]);
+
+    snprintf(path, sizeof(path), STATS_PATH_FMT, (int)pid);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "no stats for pid %d: %s: %s\n", (int)pid, path, strerror(errno));
+        return 1;
+    }
+    pg = (const struct stats_page *)mmap(NULL, sizeof(*pg), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (pg == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if (__atomic_load_n(&pg->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC) {
+        fprintf(stderr, "%s is not a stats page\n", path);
+        return 1;
+    }
+
+    for (;;) {
+        stats_print(stdout, pg);
+        fflush(stdout);
+        if (!interval)
+            break;
+        // A crashed process leaves its page behind
+        if (kill(pid, 0) && errno == ESRCH) {
+            fprintf(stderr, "pid %d has exited\n", (int)pid);
+            break;
+        }
+        sleep(interval);
+        fprintf(stdout, "\n");
+    }
+    return 0;
+}
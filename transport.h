@@ -0,0 +1,57 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <infiniband/verbs.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "completion.h"
+
+/*
+ * Transport backends behind struct resources. The generic layer in rdma.c
+ * keeps the verbs data model (ibv_send_wr chains in, ibv_wc out, MRs from
+ * the pool) and leaves everything that touches a device to the backend:
+ *
+ *   verbs - ibverbs RC QPs on an HCA (or Soft-RoCE)
+ *   shm   - a process-shared memory segment per device; writes, reads and
+ *           atomics on a peer in the same host complete synchronously as
+ *           memcpy/atomics plus a fence, immediates land on the peer's
+ *           soft CQ. Needs nothing but /dev/shm.
+ */
+
+struct resources;
+struct cm_con_data_t;
+
+struct transport_ops {
+    const char *name;
+
+    // Device: fill device_attr/port_attr and open whatever the PD stands for
+    int (*open_device)(struct resources *dev);
+    void (*close_device)(struct resources *dev);
+    // Register: map the device pool (reserved head of `reserved` bytes) and make it remotely accessible
+    int (*pool_create)(struct resources *dev, size_t size, size_t reserved, int access);
+    // Poll: completions are drained through the cq_engine set up here
+    int (*cq_create)(struct resources *dev, struct cq_engine *eng, int cqe, enum cq_mode mode);
+    // Sets dev->srq_depth, left 0 if immediates can't be received
+    int (*srq_create)(struct resources *dev, uint32_t depth);
+    int (*post_srq_recv)(struct resources *dev, struct ibv_recv_wr *wr, struct ibv_recv_wr **bad_wr);
+
+    // QP: attr carries the CQs, depths and inline size; sets res->qp and res->max_inline
+    int (*qp_create)(struct resources *res, struct ibv_qp_init_attr *attr);
+    int (*qp_destroy)(struct resources *res);
+    // Take qp (not necessarily res->qp) back to RESET, dropping its peer and queued WRs
+    int (*qp_reset)(struct resources *res, struct ibv_qp *qp);
+    // Addressing for the handshake, host byte order; addr/rkey/qp_num/size are prefilled
+    int (*conn_local)(struct resources *res, struct cm_con_data_t *local);
+    // Bring the QP up against res->remote_props
+    int (*conn_apply)(struct resources *res);
+
+    // Write, write-with-immediate, read and atomics, as ibv_post_send
+    int (*post_send)(struct resources *res, struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr);
+};
+
+extern const struct transport_ops verbs_transport;
+extern const struct transport_ops shm_transport;
+
+int transport_parse(const char *name, const struct transport_ops **ops);
+
+#endif // TRANSPORT_H
@@ -0,0 +1,129 @@
+#include "uring.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+int uring_init(struct uring *r, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return -errno;
+    r->entries = p.sq_entries;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len)
+            r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+        goto uring_init_err;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            r->cq_ptr = NULL;
+            goto uring_init_err;
+        }
+    }
+
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto uring_init_err;
+    }
+
+    r->sq_head = (unsigned *)((char *)r->sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+    return 0;
+
+uring_init_err:
+    {
+        int err = -errno;
+
+        if (r->sq_ptr == MAP_FAILED)
+            r->sq_ptr = NULL;
+        uring_exit(r);
+        return err;
+    }
+}
+
+void uring_exit(struct uring *r)
+{
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr)
+        munmap(r->sq_ptr, r->sq_len);
+    if (r->fd > 0)
+        close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+/* Next free SQE, zeroed, or NULL if the submission queue is full. */
+struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *r->sq_tail + r->pending;
+    struct io_uring_sqe *sqe;
+
+    if (tail - head >= r->entries)
+        return NULL;
+
+    sqe = &r->sqes[tail & *r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+    r->pending++;
+    return sqe;
+}
+
+/* Publish queued SQEs and wait for at least wait_nr completions. */
+int uring_submit_and_wait(struct uring *r, unsigned wait_nr)
+{
+    unsigned submit = r->pending;
+    int rc;
+
+    __atomic_store_n(r->sq_tail, *r->sq_tail + submit, __ATOMIC_RELEASE);
+    r->pending = 0;
+
+    do {
+        rc = syscall(__NR_io_uring_enter, r->fd, submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (rc < 0 && errno == EINTR);
+
+    return rc < 0 ? -errno : rc;
+}
+
+/* Pop one completion; returns 1 if one was available. */
+int uring_reap(struct uring *r, struct io_uring_cqe *cqe)
+{
+    unsigned head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+
+    *cqe = r->cqes[head & *r->cq_mask];
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
@@ -0,0 +1,38 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+/*
+ * Minimal io_uring wrapper over the raw syscalls, enough for the segment
+ * store to submit linked write + fdatasync chains without liburing.
+ */
+
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+    unsigned pending; // SQEs queued but not yet submitted
+};
+
+int uring_init(struct uring *r, unsigned entries);
+void uring_exit(struct uring *r);
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+int uring_submit_and_wait(struct uring *r, unsigned wait_nr);
+int uring_reap(struct uring *r, struct io_uring_cqe *cqe);
+
+#endif // URING_H